@@ -544,6 +544,13 @@ void ov965x_set_sxga_mode(struct usb_sn9c20x *dev, bool sxga)
 		value = (value & 0x7) | 0x40;
 		sn9c20x_write_i2c_data(dev, 1, 0x12, &value);
 	}
+
+	/* A manual banding filter counts rows, their rate changes with the
+	 * mode */
+	sn9c20x_read_i2c_data(dev, 1, OV965X_CTL_COM11, &value);
+	if (value & OV965X_COM11_MANUAL_BANDING_FILTER &&
+	    dev->vsettings.power_line != V4L2_CID_POWER_LINE_FREQUENCY_DISABLED)
+		ov965x_set_banding_filter(dev);
 }
 
 /**
@@ -696,6 +703,123 @@ int ov_set_autogain(struct usb_sn9c20x *dev)
 	return ret;
 }
 
+/**
+ * @brief Set the banding filter for omnivision sensors
+ *
+ * @param dev
+ *
+ * @returns 0 or negative error value
+ *
+ * The filter keeps the exposure of the sensor AEC to multiples of the
+ * flicker period, COM11 selects the 50 Hz period instead of the 60 Hz one.
+ * COM8 and COM11 are at the same place on OV7660.
+ *
+ * For OV7660, OV7670 and SOI968.
+ */
+int ov_set_banding_filter(struct usb_sn9c20x *dev)
+{
+	__u8 com8, com11;
+	int ret;
+
+	ret = sn9c20x_read_i2c_data(dev, 1, OV7670_CTL_COM8, &com8);
+	if (ret < 0)
+		return ret;
+	ret = sn9c20x_read_i2c_data(dev, 1, OV7670_CTL_COM11, &com11);
+	if (ret < 0)
+		return ret;
+
+	switch (dev->vsettings.power_line) {
+	case V4L2_CID_POWER_LINE_FREQUENCY_DISABLED:
+		com8 &= ~OV7670_COM8_BANDING_BIT;
+		break;
+	case V4L2_CID_POWER_LINE_FREQUENCY_50HZ:
+		com8 |= OV7670_COM8_BANDING_BIT;
+		com11 |= OV7670_COM11_50HZ_BIT;
+		break;
+	case V4L2_CID_POWER_LINE_FREQUENCY_60HZ:
+		com8 |= OV7670_COM8_BANDING_BIT;
+		com11 &= ~OV7670_COM11_50HZ_BIT;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	ret = sn9c20x_write_i2c_data(dev, 1, OV7670_CTL_COM11, &com11);
+	if (ret < 0)
+		return ret;
+	return sn9c20x_write_i2c_data(dev, 1, OV7670_CTL_COM8, &com8);
+}
+
+/**
+ * @def OV965X_ROWS_PER_S_VGA
+ *   Rows read per second by OV965x in VGA, 500 rows at 30 fps with the
+ *   clocks of ov9650_init
+ * @def OV965X_ROWS_PER_S_SXGA
+ *   Rows read per second by OV965x in SXGA, 1050 rows at 15 fps
+ */
+#define OV965X_ROWS_PER_S_VGA	15000
+#define OV965X_ROWS_PER_S_SXGA	15750
+
+/**
+ * @brief Set the banding filter for ov965x sensors
+ *
+ * @param dev
+ *
+ * @returns 0 or negative error value
+ *
+ * OV965x has no 50/60 Hz selector. In manual banding mode (COM11 bit 0)
+ * the AEC steps are MBD rows long, MBD is set to the rows read in a
+ * flicker period of the mode in use. ov965x_set_sxga_mode() sets it again
+ * when the mode changes.
+ *
+ * For OV9650 and OV9655.
+ */
+int ov965x_set_banding_filter(struct usb_sn9c20x *dev)
+{
+	unsigned int rows_per_s;
+	__u8 com8, com11, mbd;
+	int ret;
+
+	ret = sn9c20x_read_i2c_data(dev, 1, OV965X_CTL_COM8, &com8);
+	if (ret < 0)
+		return ret;
+	ret = sn9c20x_read_i2c_data(dev, 1, OV965X_CTL_COM11, &com11);
+	if (ret < 0)
+		return ret;
+
+	if (dev->vsettings.format.width > 640 &&
+	    dev->vsettings.format.height > 480)
+		rows_per_s = OV965X_ROWS_PER_S_SXGA;
+	else
+		rows_per_s = OV965X_ROWS_PER_S_VGA;
+
+	switch (dev->vsettings.power_line) {
+	case V4L2_CID_POWER_LINE_FREQUENCY_DISABLED:
+		com8 &= ~OV965X_COM8_BANDING_FILTER_ON;
+		return sn9c20x_write_i2c_data(dev, 1, OV965X_CTL_COM8, &com8);
+	case V4L2_CID_POWER_LINE_FREQUENCY_50HZ:
+		com8 |= OV965X_COM8_BANDING_FILTER_ON;
+		com11 |= OV965X_COM11_MANUAL_BANDING_FILTER;
+		mbd = rows_per_s / 100;
+		break;
+	case V4L2_CID_POWER_LINE_FREQUENCY_60HZ:
+		com8 |= OV965X_COM8_BANDING_FILTER_ON;
+		com11 |= OV965X_COM11_MANUAL_BANDING_FILTER;
+		mbd = rows_per_s / 120;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	ret = sn9c20x_write_i2c_data(dev, 1, OV965X_CTL_MBD, &mbd);
+	if (ret < 0)
+		return ret;
+	ret = sn9c20x_write_i2c_data(dev, 1, OV965X_CTL_COM11, &com11);
+	if (ret < 0)
+		return ret;
+	return sn9c20x_write_i2c_data(dev, 1, OV965X_CTL_COM8, &com8);
+}
+
 /**
  * @brief Set exposure for SOI968 sensors
  *
@@ -800,7 +924,7 @@ int ov9650_set_gain(struct usb_sn9c20x *dev)
  *
  * @param dev Pointer to device structure
  *
- * @returns 0 or negative error code
+ * @returns 1 if the switch moved, 0 or negative error code
  *
  */
 int ov7670_flip_detect(struct usb_sn9c20x *dev)
@@ -808,22 +932,24 @@ int ov7670_flip_detect(struct usb_sn9c20x *dev)
 	const __u8 flip_bit = 0x01;
 	int ret = 0;
 	__u8 val;
-	static __u8 flip_reg = flip_bit;
 	__u8 vflip;
 
 	ret = usb_sn9c20x_control_read(dev, 0x1009, &val, 1);
 	if (ret < 0)
 		return -EAGAIN;
-	if (flip_reg != (val & flip_bit)) {
+	if (dev->camera.flip_state != (val & flip_bit)) {
 		if (val & flip_bit)
 			vflip = 0;
 		else
 			vflip = 1;
 		ret = ov7670_auto_flip(dev, vflip);
-		flip_reg = (val & flip_bit);
+		if (ret < 0)
+			return ret;
+		dev->camera.flip_state = (val & flip_bit);
+		return 1;
 	}
 
-	return ret;
+	return 0;
 }
 
 /**
@@ -831,7 +957,7 @@ int ov7670_flip_detect(struct usb_sn9c20x *dev)
  *
  * @param dev Pointer to device structure
  *
- * @returns 0 or negative error code
+ * @returns 1 if the switch moved, 0 or negative error code
  *
  */
 int ov965x_flip_detect(struct usb_sn9c20x *dev)
@@ -842,9 +968,11 @@ int ov965x_flip_detect(struct usb_sn9c20x *dev)
 	ret = usb_sn9c20x_control_read(dev, 0x1009, &val, 1);
 	if (ret < 0)
 		return -EAGAIN;
-	if (val & 0x01)
-		dev->vsettings.vflip = 1;
-	else
-		dev->vsettings.vflip = 0;
+	if ((val & 0x01) != dev->vsettings.vflip) {
+		dev->vsettings.vflip = val & 0x01;
+		v4l2_notify_control(dev, V4L2_CID_VFLIP,
+				    dev->vsettings.vflip);
+		return 1;
+	}
 	return ret;
 }
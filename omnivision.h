@@ -197,6 +197,7 @@
 #define OV7670_CTL_CLKRC		0x11
 #define OV7670_CTL_COM7			0x12
 #define OV7670_CTL_COM8			0x13
+#define OV7670_COM8_BANDING_BIT		0x20
 #define OV7670_CTL_COM9			0x14
 #define OV7670_CTL_COM10		0x15
 #define OV7670_CTL_HSTART		0x17
@@ -234,6 +235,7 @@
 #define OV7670_CTL_OFON			0x39
 #define OV7670_CTL_TSLB			0x3a
 #define OV7670_CTL_COM11		0x3b
+#define OV7670_COM11_50HZ_BIT		0x08
 #define OV7670_CTL_COM12		0x3c
 #define OV7670_CTL_COM13		0x3d
 #define OV7670_CTL_COM14		0x3e
@@ -552,4 +554,6 @@ int ov9650_set_gain(struct usb_sn9c20x *dev);
 
 int ov_set_exposure(struct usb_sn9c20x *);
 int ov_set_autogain(struct usb_sn9c20x *dev);
+int ov_set_banding_filter(struct usb_sn9c20x *dev);
+int ov965x_set_banding_filter(struct usb_sn9c20x *dev);
 #endif
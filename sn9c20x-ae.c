@@ -0,0 +1,155 @@
+/**
+ * @file sn9c20x-ae.c
+ * @author microdia project
+ *
+ * @brief Software auto-exposure controller
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * The controller only computes the next settings from the mean luma, the
+ * caller reads the statistics and programs the sensor. tools/ae-sim.c
+ * builds it in user space and runs it against recorded or simulated
+ * scenes.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#endif
+
+#include "sn9c20x-ae.h"
+
+/**
+ * @brief Base 2 logarithm in 8.8 fixed point
+ *
+ * @param x Value, 0 is taken as 1
+ *
+ * @returns log2(x) * 256, linear between powers of two
+ */
+static int sn9c20x_ae_log2(unsigned int x)
+{
+	int n;
+
+	if (x == 0)
+		x = 1;
+	n = fls(x) - 1;
+	return (n << 8) + (((x << 8) >> n) & 0xff);
+}
+
+/**
+ * @brief Inverse of sn9c20x_ae_log2()
+ *
+ * @param y log2 of the value in 8.8 fixed point, not negative
+ *
+ * @returns The value
+ */
+static unsigned int sn9c20x_ae_exp2(int y)
+{
+	return ((256 + (y & 0xff)) << (y >> 8)) >> 8;
+}
+
+/**
+ * @brief Move a setting by a correction in the log domain
+ *
+ * @param value Current value of the setting
+ * @param u Correction in 8.8 log2 units, reduced by the part applied
+ * @param lo Lowest value of the setting, at least 1
+ * @param hi Highest value of the setting, at most SN9C20X_AE_SETTING_MAX + 1
+ *
+ * @returns The new value of the setting
+ */
+static int sn9c20x_ae_step(int value, int *u, int lo, int hi)
+{
+	int l = sn9c20x_ae_log2(value);
+	int nl = clamp_t(int, l + *u, 0, sn9c20x_ae_log2(hi) + 0x100);
+	int nv = clamp_t(int, sn9c20x_ae_exp2(nl), lo, hi);
+
+	*u -= sn9c20x_ae_log2(nv) - l;
+	return nv;
+}
+
+/**
+ * @brief Run the controller once
+ *
+ * @param p Tunables
+ * @param integral Integral of the error, kept between runs
+ * @param yavg Mean luma of the last frame
+ * @param soft_gain Non-zero if the gain is driven along with the exposure
+ * @param exposure Exposure setting, updated
+ * @param gain Gain setting, updated
+ *
+ * @returns The error in 8.8 log2 units, 0 inside the target band
+ *
+ * A PI controller on log2 of the exposure drives the mean luma back into
+ * [min_yavg, max_yavg], aiming at the middle of the band. Inside the band
+ * nothing changes, so flicker doesn't make it hunt. With soft auto gain
+ * the gain takes over once the exposure is at its highest, and gives way
+ * first when the picture is too bright.
+ *
+ * The tunables come from debugfs and are clamped to SN9C20X_AE_GAIN_MAX
+ * and SN9C20X_AE_SETTING_MAX, so the correction fits in an int whatever
+ * was written there.
+ */
+int sn9c20x_ae_update(const struct sn9c20x_ae_params *p, int *integral,
+	int yavg, int soft_gain, int *exposure, int *gain)
+{
+	int kp = min_t(__u32, p->kp, SN9C20X_AE_GAIN_MAX);
+	int ki = min_t(__u32, p->ki, SN9C20X_AE_GAIN_MAX);
+	int exposure_max = clamp_t(__u32, p->exposure_max, 1,
+				   SN9C20X_AE_SETTING_MAX);
+	int gain_max = min_t(__u32, p->gain_max, SN9C20X_AE_SETTING_MAX);
+	int target, err, u, saturated;
+
+	if (yavg >= p->min_yavg && yavg <= p->max_yavg) {
+		*integral = 0;
+		return 0;
+	}
+
+	target = (p->min_yavg + p->max_yavg) / 2;
+	err = sn9c20x_ae_log2(target) - sn9c20x_ae_log2(yavg);
+
+	/* Don't wind up the integral against a setting at its limit */
+	if (err > 0)
+		saturated = *exposure >= exposure_max &&
+			(!soft_gain || *gain >= gain_max);
+	else
+		saturated = *exposure <= 1 && (!soft_gain || *gain <= 0);
+	if (!saturated)
+		*integral = clamp_t(int, *integral + err,
+				    -SN9C20X_AE_INTEGRAL_MAX,
+				    SN9C20X_AE_INTEGRAL_MAX);
+
+	u = (kp * err + ki * *integral) / 100;
+
+	if (u > 0) {
+		*exposure = sn9c20x_ae_step(*exposure, &u, 1, exposure_max);
+		if (soft_gain && *exposure == exposure_max)
+			*gain = sn9c20x_ae_step(*gain + 1, &u, 1,
+						gain_max + 1) - 1;
+	} else {
+		if (soft_gain)
+			*gain = sn9c20x_ae_step(*gain + 1, &u, 1,
+						gain_max + 1) - 1;
+		if (*gain == 0 || !soft_gain)
+			*exposure = sn9c20x_ae_step(*exposure, &u, 1,
+						    exposure_max);
+	}
+
+	return err;
+}
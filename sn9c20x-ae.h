@@ -0,0 +1,58 @@
+/**
+ * @file sn9c20x-ae.h
+ * @author microdia project
+ *
+ * @brief Software auto-exposure controller
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef SN9C20X_AE_H
+#define SN9C20X_AE_H
+
+#include <linux/types.h>
+
+/**
+ * @def SN9C20X_AE_INTEGRAL_MAX
+ *   Bound of the soft auto-exposure integral, 4 EV in 8.8 fixed point
+ * @def SN9C20X_AE_GAIN_MAX
+ *   Highest proportional or integral gain used, in percent
+ * @def SN9C20X_AE_SETTING_MAX
+ *   Highest exposure or gain setting used, the sensor registers are
+ *   16 bits at most
+ */
+#define SN9C20X_AE_INTEGRAL_MAX	(4 << 8)
+#define SN9C20X_AE_GAIN_MAX	10000
+#define SN9C20X_AE_SETTING_MAX	0xffff
+
+/**
+ * @struct sn9c20x_ae_params
+ *   Tunables of the soft auto-exposure controller, gains in percent
+ */
+struct sn9c20x_ae_params {
+	int min_yavg;
+	int max_yavg;
+	__u32 kp;
+	__u32 ki;
+	__u32 exposure_max;
+	__u32 gain_max;
+};
+
+int sn9c20x_ae_update(const struct sn9c20x_ae_params *p, int *integral,
+	int yavg, int soft_gain, int *exposure, int *gain);
+
+#endif
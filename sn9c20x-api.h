@@ -0,0 +1,89 @@
+/**
+ * @file sn9c20x-api.h
+ * @author microdia project
+ *
+ * @brief Structures shared with the applications
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * Only depends on <linux/types.h>, applications include it as is.
+ */
+
+#ifndef SN9C20X_API_H
+#define SN9C20X_API_H
+
+#include <linux/types.h>
+
+/**
+ * @def SN9C20X_HEADER_SIZE
+ *   Size of the header the bridge sends after each frame
+ */
+#define SN9C20X_HEADER_SIZE	64
+
+/**
+ * @def SN9C20X_PROGRESS_OFFSET
+ *   mmap() offset of the frame progress page, past any video buffer
+ */
+#define SN9C20X_PROGRESS_OFFSET		0x40000000
+
+/**
+ * @struct sn9c20x_progress
+ *   Progress of the frame being received, mapped read-only by applications
+ *
+ * The driver increments count before and after updating the other fields,
+ * readers retry until they see the same even count before and after
+ * reading them.
+ */
+struct sn9c20x_progress {
+	__u32 count;
+	__u32 index;		/**< Index of the buffer being filled */
+	__u32 sequence;		/**< Sequence number the frame will get */
+	__u32 lines;		/**< bytesused / bytesperline */
+	__u32 bytesused;	/**< Bytes of the frame received so far */
+	__u32 reserved;
+	__u64 timestamp;	/**< Start of the frame, monotonic ns */
+};
+
+/**
+ * @def SN9C20X_META_WINDOWS
+ *   Number of luma windows summed up in a frame header
+ */
+#define SN9C20X_META_WINDOWS	8
+
+/**
+ * @def SN9C20X_META_DROPPED
+ *   The frame the record describes was dropped, no buffer has its sequence
+ */
+#define SN9C20X_META_DROPPED	(1 << 0)
+
+/**
+ * @struct sn9c20x_meta_record
+ *   Statistics of one frame, read() from the metadata device
+ */
+struct sn9c20x_meta_record {
+	__u32 sequence;		/**< Sequence number of the frame */
+	__u32 flags;		/**< SN9C20X_META_* flags */
+	__u64 timestamp;	/**< Start of the frame, monotonic ns */
+	__u32 window[SN9C20X_META_WINDOWS];	/**< Luma sums of the windows */
+	__u32 exposure;		/**< Exposure applied to the frame */
+	__u32 gain;		/**< Gain applied to the frame */
+	__u8 header[SN9C20X_HEADER_SIZE];	/**< Raw frame header */
+};
+
+#endif
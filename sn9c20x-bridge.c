@@ -344,10 +344,36 @@ static const int BY[] = {
 };
 
 
+/**
+ * @var sn9c20x_qtables
+ *   JPEG quantisation tables of the bridge, luma then chroma
+ */
+const __u8 sn9c20x_qtables[128] = {
+	0x0d, 0x08, 0x08, 0x0d, 0x08, 0x08, 0x0d, 0x0d,
+	0x0d, 0x0d, 0x11, 0x0d, 0x0d, 0x11, 0x15, 0x21,
+	0x15, 0x15, 0x11, 0x11, 0x15, 0x2a, 0x1d, 0x1d,
+	0x19, 0x21, 0x32, 0x2a, 0x32, 0x32, 0x2e, 0x2a,
+	0x2e, 0x2e, 0x36, 0x3a, 0x4b, 0x43, 0x36, 0x3a,
+	0x47, 0x3a, 0x2e, 0x2e, 0x43, 0x5c, 0x43, 0x47,
+	0x4f, 0x54, 0x58, 0x58, 0x58, 0x32, 0x3f, 0x60,
+	0x64, 0x5c, 0x54, 0x64, 0x4b, 0x54, 0x58, 0x54,
+	0x0d, 0x11, 0x11, 0x15, 0x11, 0x15, 0x26, 0x15,
+	0x15, 0x26, 0x54, 0x36, 0x2e, 0x36, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54
+};
+
 int sn9c20x_set_camera_control(struct usb_sn9c20x *dev,
 	__u32 control, __s32 value)
 {
 	int ret = -EINVAL;
+
+	/* Soft auto-exposure changes the sensor settings from a worker */
+	mutex_lock(&dev->ctrl_mutex);
 	switch (control) {
 	case V4L2_CID_CONTRAST:
 		if (dev->camera.set_contrast) {
@@ -428,10 +454,11 @@ int sn9c20x_set_camera_control(struct usb_sn9c20x *dev,
 		}
 		break;
 	case V4L2_CID_AUTO_WHITE_BALANCE:
-		if (dev->camera.set_auto_whitebalance) {
-			dev->vsettings.auto_whitebalance = value;
+		/* Without a sensor AWB the driver balances in software */
+		dev->vsettings.auto_whitebalance = value;
+		ret = 0;
+		if (dev->camera.set_auto_whitebalance)
 			ret = dev->camera.set_auto_whitebalance(dev);
-		}
 		break;
 	case V4L2_CID_EXPOSURE_AUTO:
 		dev->vsettings.auto_exposure = value;
@@ -439,7 +466,46 @@ int sn9c20x_set_camera_control(struct usb_sn9c20x *dev,
 		if (dev->camera.set_auto_exposure)
 			ret = dev->camera.set_auto_exposure(dev);
 		break;
+	case V4L2_CID_POWER_LINE_FREQUENCY:
+		ret = -ERANGE;
+		if (value < V4L2_CID_POWER_LINE_FREQUENCY_DISABLED ||
+		    value > V4L2_CID_POWER_LINE_FREQUENCY_60HZ)
+			break;
+		dev->vsettings.power_line = value;
+		ret = 0;
+		if (dev->camera.set_power_line)
+			ret = dev->camera.set_power_line(dev);
+		break;
+	case V4L2_CID_SN9C20X_METERING:
+		ret = -ERANGE;
+		if (value < SN9C20X_METERING_AVERAGE ||
+		    value > SN9C20X_METERING_RECT)
+			break;
+		dev->vsettings.metering = value;
+		ret = dev_sn9c20x_set_metering(dev);
+		break;
+	case V4L2_CID_SN9C20X_METER_LEFT:
+	case V4L2_CID_SN9C20X_METER_TOP:
+	case V4L2_CID_SN9C20X_METER_WIDTH:
+	case V4L2_CID_SN9C20X_METER_HEIGHT:
+		ret = -ERANGE;
+		if (value < 0 || value > 100)
+			break;
+		if (control == V4L2_CID_SN9C20X_METER_LEFT)
+			dev->vsettings.meter_left = value;
+		else if (control == V4L2_CID_SN9C20X_METER_TOP)
+			dev->vsettings.meter_top = value;
+		else if (control == V4L2_CID_SN9C20X_METER_WIDTH)
+			dev->vsettings.meter_width = value;
+		else
+			dev->vsettings.meter_height = value;
+		ret = dev_sn9c20x_set_metering(dev);
+		break;
 	}
+	mutex_unlock(&dev->ctrl_mutex);
+
+	if (ret == 0)
+		v4l2_notify_control(dev, control, value);
 	return ret;
 }
 
@@ -1114,6 +1180,13 @@ int sn9c20x_set_resolution(struct usb_sn9c20x *dev,
 	window[4] = mode->window[2] >> 4;
 	window[5] = mode->window[3] >> 3;
 
+	/* The sensor arrays start with a blue pixel */
+	dev->camera.bayer_phase =
+		((mode->window[0] + dev->camera.hstart) & 1 ?
+		 SN9C20X_BAYER_COLUMN : 0) |
+		((mode->window[1] + dev->camera.vstart) & 1 ?
+		 SN9C20X_BAYER_ROW : 0);
+
 	if (dev->camera.set_sxga_mode) {
 		if (width > 640 && height > 480) {
 			dev->camera.set_sxga_mode(dev, true);
@@ -1136,6 +1209,47 @@ int sn9c20x_set_resolution(struct usb_sn9c20x *dev,
 }
 
 
+/**
+ * @brief Estimate the buffer size of a JPEG frame
+ *
+ * @param dev Pointer to the device
+ * @param width Width of the frame
+ * @param height Height of the frame
+ *
+ * @return Size of a buffer for a JPEG frame, header included
+ *
+ * This is a heuristic, not a worst case bound. Each coefficient of a block
+ * is counted with the bits of its quantised value for a coefficient as
+ * large as a level shifted sample (128), while the DCT gives coefficients
+ * up to 1024 and the Huffman codes add up to 16 bits per coefficient plus
+ * the DC and end of block codes. A true bound would be several times the
+ * size of an uncompressed frame. In YUV 4:2:2 there are as many chroma
+ * blocks as luma blocks. This is about 140 KB for VGA, the bridge sends
+ * 30 to 80 KB for real scenes.
+ *
+ * Frames larger than the buffer are truncated and returned as errors (or
+ * dropped with SN9C20X_QUEUE_DROP_CORRUPTED), they also scale the estimate
+ * up for the next buffers, up to the size of an uncompressed frame. Room
+ * is left for the header added on dequeue.
+ */
+unsigned int sn9c20x_jpeg_size(struct usb_sn9c20x *dev,
+	int width, int height)
+{
+	unsigned int bits = 0;
+	unsigned int size;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sn9c20x_qtables); i++)
+		bits += fls(128 / max_t(int, sn9c20x_qtables[i], 1));
+
+	/* A luma and a chroma block for every 64 pixels */
+	size = width * height / 64 * bits / 8;
+	size = size * dev->jpeg_scale / 100;
+	size = min_t(unsigned int, size, width * height * 2);
+
+	return size + SN9C20X_JPEG_HEADER_SIZE;
+}
+
 int sn9c20x_set_format(struct usb_sn9c20x *dev, __u32 format)
 {
 	int i;
@@ -1148,6 +1262,11 @@ int sn9c20x_set_format(struct usb_sn9c20x *dev, __u32 format)
 			dev->vsettings.format.sizeimage =
 				dev->vsettings.format.height *
 				dev->vsettings.format.bytesperline;
+			if (format == V4L2_PIX_FMT_JPEG)
+				dev->vsettings.format.sizeimage =
+					sn9c20x_jpeg_size(dev,
+						dev->vsettings.format.width,
+						dev->vsettings.format.height);
 			dev->vsettings.format.pixelformat = format;
 			dev->vsettings.format.colorspace = V4L2_COLORSPACE_SRGB;
 			dev->vsettings.format.priv = 0;
@@ -1270,27 +1389,7 @@ int sn9c20x_initialize(struct usb_sn9c20x *dev)
 		{0x1185, 0x80},
 	};
 
-	__u8 qtable1[64] = {
-		0x0d, 0x08, 0x08, 0x0d, 0x08, 0x08, 0x0d, 0x0d,
-		0x0d, 0x0d, 0x11, 0x0d, 0x0d, 0x11, 0x15, 0x21,
-		0x15, 0x15, 0x11, 0x11, 0x15, 0x2a, 0x1d, 0x1d,
-		0x19, 0x21, 0x32, 0x2a, 0x32, 0x32, 0x2e, 0x2a,
-		0x2e, 0x2e, 0x36, 0x3a, 0x4b, 0x43, 0x36, 0x3a,
-		0x47, 0x3a, 0x2e, 0x2e, 0x43, 0x5c, 0x43, 0x47,
-		0x4f, 0x54, 0x58, 0x58, 0x58, 0x32, 0x3f, 0x60,
-		0x64, 0x5c, 0x54, 0x64, 0x4b, 0x54, 0x58, 0x54
-	};
-
-	__u8 qtable2[64] = {
-		0x0d, 0x11, 0x11, 0x15, 0x11, 0x15, 0x26, 0x15,
-		0x15, 0x26, 0x54, 0x36, 0x2e, 0x36, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54
-	};
+	__u8 qtable[64];
 
 	for (i = 0; i < ARRAY_SIZE(regs); i++) {
 		reg = regs[i][0];
@@ -1302,11 +1401,13 @@ int sn9c20x_initialize(struct usb_sn9c20x *dev)
 		}
 	}
 
-	ret = usb_sn9c20x_control_write(dev, 0x1100, qtable1, 64);
+	memcpy(qtable, sn9c20x_qtables, 64);
+	ret = usb_sn9c20x_control_write(dev, 0x1100, qtable, 64);
 	if (ret < 0)
 		goto err;
 
-	ret = usb_sn9c20x_control_write(dev, 0x1140, qtable2, 64);
+	memcpy(qtable, sn9c20x_qtables + 64, 64);
+	ret = usb_sn9c20x_control_write(dev, 0x1140, qtable, 64);
 	if (ret < 0)
 		goto err;
 
@@ -1382,3 +1483,59 @@ int sn9c20x_reset_device(struct usb_sn9c20x *dev)
 
 	return 0;
 }
+
+/**
+ * @brief Bring the device back from the register shadow after a reset
+ *
+ * @param dev Pointer to the device
+ *
+ * @return Zero for success or error value
+ *
+ * The bridge registers are replayed from the shadow in a few transfers.
+ * This includes the bridge controls, the resolution and the format. The
+ * sensor has lost its state too and SCCB has no burst writes, so it goes
+ * through its init table again. Then only the controls it handles are
+ * applied. A full reset is done when the shadow can't be used.
+ */
+int sn9c20x_restore_device(struct usb_sn9c20x *dev)
+{
+	int ret;
+
+	ret = usb_sn9c20x_shadow_replay(dev);
+	if (ret < 0) {
+		UDIA_INFO("Register shadow unusable (%d), full reset\n", ret);
+		return sn9c20x_reset_device(dev);
+	}
+
+	ret = sn9c20x_i2c_initialize(dev);
+	if (ret < 0)
+		return ret;
+
+	ret = sn9c20x_initialize_sensor(dev);
+	if (ret < 0)
+		return ret;
+
+	if (dev->camera.set_sxga_mode)
+		dev->camera.set_sxga_mode(dev,
+			dev->vsettings.format.width > 640 &&
+			dev->vsettings.format.height > 480);
+
+	/* set_hvflip sets both flips */
+	sn9c20x_set_camera_control(dev, V4L2_CID_HFLIP,
+				   dev->vsettings.hflip);
+	sn9c20x_set_camera_control(dev, V4L2_CID_GAIN,
+				   dev->vsettings.gain);
+	sn9c20x_set_camera_control(dev, V4L2_CID_EXPOSURE_AUTO,
+				   dev->vsettings.auto_exposure);
+	sn9c20x_set_camera_control(dev, V4L2_CID_AUTOGAIN,
+				   dev->vsettings.auto_gain);
+	sn9c20x_set_camera_control(dev, V4L2_CID_AUTO_WHITE_BALANCE,
+				   dev->vsettings.auto_whitebalance);
+	sn9c20x_set_camera_control(dev, V4L2_CID_EXPOSURE,
+				   dev->vsettings.exposure);
+	if (dev->vsettings.power_line != dev->camera.power_line)
+		sn9c20x_set_camera_control(dev, V4L2_CID_POWER_LINE_FREQUENCY,
+					   dev->vsettings.power_line);
+
+	return 0;
+}
@@ -45,13 +45,18 @@
 #define SN9C20X_1_2_SCALE	0x10
 #define SN9C20X_1_4_SCALE	0x20
 
+extern const __u8 sn9c20x_qtables[128];
+
 int sn9c20x_initialize(struct usb_sn9c20x *dev);
 int sn9c20x_reset_device(struct usb_sn9c20x *dev);
+int sn9c20x_restore_device(struct usb_sn9c20x *dev);
 int sn9c20x_set_LEDs(struct usb_sn9c20x *dev, int enable);
 int sn9c20x_set_camera_control(struct usb_sn9c20x *dev,
 				 __u32 control, __s32 value);
 int sn9c20x_enable_video(struct usb_sn9c20x *dev, int enable);
 int sn9c20x_i2c_initialize(struct usb_sn9c20x *dev);
+unsigned int sn9c20x_jpeg_size(struct usb_sn9c20x *dev,
+	int width, int height);
 
 int sn9c20x_write_i2c_data_ext(struct usb_sn9c20x *dev, __u8 nbytes,
 	__u8 address, const __u8 [nbytes], __u8 last_byte);
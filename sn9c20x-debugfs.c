@@ -188,6 +188,234 @@ static struct file_operations bridge_dump_ops = {
 	.release	= seq_release,
 };
 
+/**
+ * @brief Print out the last stream start profiles
+ *
+ * @param m
+ * @param v
+ *
+ * @return 0 or negative error code
+ *
+ * One line per stream start (oldest first) with the time spent in each
+ * phase, followed by the minimum, average and maximum of each phase.
+ * All times are in microseconds.
+ */
+static int start_profile_show(struct seq_file *m, void *v)
+{
+	static const char *names[SN9C20X_PHASES] = {
+		"restore", "queue", "bridge", "altset", "alloc",
+		"submit", "enable", "header", "frame"
+	};
+	struct usb_sn9c20x *dev = m->private;
+	struct sn9c20x_start_profile *history;
+	s64 lo[SN9C20X_PHASES + 1], hi[SN9C20X_PHASES + 1];
+	s64 sum[SN9C20X_PHASES + 1], total;
+	unsigned long flags;
+	unsigned int count, first, i, j;
+
+	history = kmalloc(sizeof(dev->profile.history), GFP_KERNEL);
+	if (history == NULL)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&dev->profile.lock, flags);
+	memcpy(history, dev->profile.history, sizeof(dev->profile.history));
+	count = dev->profile.count;
+	spin_unlock_irqrestore(&dev->profile.lock, flags);
+
+	first = count > SN9C20X_PROFILE_DEPTH ? count - SN9C20X_PROFILE_DEPTH : 0;
+	for (j = 0; j <= SN9C20X_PHASES; j++) {
+		lo[j] = LLONG_MAX;
+		hi[j] = 0;
+		sum[j] = 0;
+	}
+
+	seq_printf(m, "%6s %4s", "start", "warm");
+	for (j = 0; j < SN9C20X_PHASES; j++)
+		seq_printf(m, " %8s", names[j]);
+	seq_printf(m, " %8s\n", "total");
+
+	for (i = first; i < count; i++) {
+		struct sn9c20x_start_profile *p =
+			&history[i % SN9C20X_PROFILE_DEPTH];
+
+		seq_printf(m, "%6u %4d", i, p->warm);
+		total = 0;
+		for (j = 0; j <= SN9C20X_PHASES; j++) {
+			s64 t = j < SN9C20X_PHASES ? p->phase[j] : total;
+
+			if (j < SN9C20X_PHASES)
+				total += t;
+			lo[j] = min(lo[j], t);
+			hi[j] = max(hi[j], t);
+			sum[j] += t;
+			seq_printf(m, " %8lld", div_s64(t, 1000));
+		}
+		seq_printf(m, "\n");
+	}
+
+	if (count > first) {
+		seq_printf(m, "%11s", "min");
+		for (j = 0; j <= SN9C20X_PHASES; j++)
+			seq_printf(m, " %8lld", div_s64(lo[j], 1000));
+		seq_printf(m, "\n%11s", "avg");
+		for (j = 0; j <= SN9C20X_PHASES; j++)
+			seq_printf(m, " %8lld",
+				   div_s64(sum[j], (count - first) * 1000));
+		seq_printf(m, "\n%11s", "max");
+		for (j = 0; j <= SN9C20X_PHASES; j++)
+			seq_printf(m, " %8lld", div_s64(hi[j], 1000));
+		seq_printf(m, "\n");
+	}
+
+	kfree(history);
+	return 0;
+}
+
+static int start_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, start_profile_show, inode->i_private);
+}
+
+static struct file_operations start_profile_ops = {
+	.owner		= THIS_MODULE,
+	.open		= start_profile_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * @brief Print out the frame timestamp statistics
+ *
+ * @param m
+ * @param v
+ *
+ * @return 0
+ *
+ */
+static int timestamps_show(struct seq_file *m, void *v)
+{
+	struct usb_sn9c20x *dev = m->private;
+	struct sn9c20x_video_queue *queue = &dev->queue;
+	s64 interval, jitter, jitter_max;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	interval = queue->interval;
+	jitter = queue->jitter;
+	jitter_max = queue->jitter_max;
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
+	seq_printf(m, "Frame interval : %lld us\n", div_s64(interval, 1000));
+	seq_printf(m, "Jitter         : %lld us\n", div_s64(jitter, 1000));
+	seq_printf(m, "Jitter (max)   : %lld us\n", div_s64(jitter_max, 1000));
+
+	return 0;
+}
+
+static int timestamps_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, timestamps_show, inode->i_private);
+}
+
+static struct file_operations timestamps_ops = {
+	.owner		= THIS_MODULE,
+	.open		= timestamps_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * @brief Print out the stream watchdog statistics
+ *
+ * @param m
+ * @param v
+ *
+ * @return 0
+ *
+ * For each recovery step, the number of times it was taken, the number
+ * of stalls it ended and the average time it took. The recovery time
+ * runs from the detection of a stall to the next frame.
+ */
+static int watchdog_show(struct seq_file *m, void *v)
+{
+	static const char *names[SN9C20X_RECOVERIES] = {
+		"resubmit", "altset", "reset"
+	};
+	struct usb_sn9c20x *dev = m->private;
+	struct sn9c20x_watchdog *wd = &dev->watchdog;
+	unsigned int recovered = 0;
+	int i;
+
+	seq_printf(m, "%8s %8s %8s %8s\n", "step", "count", "fixed", "avg(us)");
+	for (i = 0; i < SN9C20X_RECOVERIES; i++) {
+		seq_printf(m, "%8s %8u %8u %8lld\n", names[i],
+			   wd->count[i], wd->fixed[i], wd->count[i] ?
+			   div_s64(wd->spent[i], wd->count[i] * 1000) : 0);
+		recovered += wd->fixed[i];
+	}
+
+	seq_printf(m, "\nRecovered      : %u\n", recovered);
+	seq_printf(m, "Given up       : %u\n", wd->failed);
+	seq_printf(m, "Recovery (avg) : %lld us\n", recovered ?
+		   div_s64(wd->recovery, recovered * 1000) : 0);
+	seq_printf(m, "Recovery (max) : %lld us\n",
+		   div_s64(wd->recovery_max, 1000));
+
+	return 0;
+}
+
+static int watchdog_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, watchdog_show, inode->i_private);
+}
+
+static struct file_operations watchdog_ops = {
+	.owner		= THIS_MODULE,
+	.open		= watchdog_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * @brief Print out the DQBUF latency histogram
+ *
+ * @param m
+ * @param v
+ *
+ * @return 0
+ *
+ * Counts the time DQBUF took once the frame was available, in power of
+ * two microsecond buckets.
+ */
+static int dqbuf_latency_show(struct seq_file *m, void *v)
+{
+	struct usb_sn9c20x *dev = m->private;
+	int i;
+
+	for (i = 0; i < SN9C20X_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, "< %5u us : %u\n", 1U << i,
+			   dev->dqbuf_latency[i]);
+	seq_printf(m, "longer     : %u\n", dev->dqbuf_latency[i]);
+
+	return 0;
+}
+
+static int dqbuf_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dqbuf_latency_show, inode->i_private);
+}
+
+static struct file_operations dqbuf_latency_ops = {
+	.owner		= THIS_MODULE,
+	.open		= dqbuf_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /**
  * @brief Set the value for a specific register of the bridge
  *
@@ -488,6 +716,46 @@ int sn9c20x_create_debugfs_files(struct usb_sn9c20x *dev)
 						    S_IRUGO | S_IWUGO,
 						    dev->debug.dent_device,
 						    dev, &sensor_value32_ops);
+			dev->debug.dent_start_profile =
+				debugfs_create_file("start_profile",
+						    S_IRUGO,
+						    dev->debug.dent_device,
+						    dev, &start_profile_ops);
+			dev->debug.dent_timestamps =
+				debugfs_create_file("timestamps",
+						    S_IRUGO,
+						    dev->debug.dent_device,
+						    dev, &timestamps_ops);
+			dev->debug.dent_dqbuf_latency =
+				debugfs_create_file("dqbuf_latency",
+						    S_IRUGO,
+						    dev->debug.dent_device,
+						    dev, &dqbuf_latency_ops);
+			dev->debug.dent_watchdog =
+				debugfs_create_file("watchdog",
+						    S_IRUGO,
+						    dev->debug.dent_device,
+						    dev, &watchdog_ops);
+			dev->debug.dent_ae_kp =
+				debugfs_create_u32("ae.kp",
+						   S_IRUGO | S_IWUSR,
+						   dev->debug.dent_device,
+						   &dev->camera.ae_kp);
+			dev->debug.dent_ae_ki =
+				debugfs_create_u32("ae.ki",
+						   S_IRUGO | S_IWUSR,
+						   dev->debug.dent_device,
+						   &dev->camera.ae_ki);
+			dev->debug.dent_ae_exposure_max =
+				debugfs_create_u32("ae.exposure_max",
+						   S_IRUGO | S_IWUSR,
+						   dev->debug.dent_device,
+						   &dev->camera.ae_exposure_max);
+			dev->debug.dent_ae_gain_max =
+				debugfs_create_u32("ae.gain_max",
+						   S_IRUGO | S_IWUSR,
+						   dev->debug.dent_device,
+						   &dev->camera.ae_gain_max);
 		}
 	}
 	kref_get(&debug_ref);
@@ -519,6 +787,22 @@ int sn9c20x_remove_debugfs_files(struct usb_sn9c20x *dev)
 		debugfs_remove(dev->debug.dent_sensor_val16);
 	if (dev->debug.dent_sensor_val32)
 		debugfs_remove(dev->debug.dent_sensor_val32);
+	if (dev->debug.dent_start_profile)
+		debugfs_remove(dev->debug.dent_start_profile);
+	if (dev->debug.dent_timestamps)
+		debugfs_remove(dev->debug.dent_timestamps);
+	if (dev->debug.dent_dqbuf_latency)
+		debugfs_remove(dev->debug.dent_dqbuf_latency);
+	if (dev->debug.dent_watchdog)
+		debugfs_remove(dev->debug.dent_watchdog);
+	if (dev->debug.dent_ae_kp)
+		debugfs_remove(dev->debug.dent_ae_kp);
+	if (dev->debug.dent_ae_ki)
+		debugfs_remove(dev->debug.dent_ae_ki);
+	if (dev->debug.dent_ae_exposure_max)
+		debugfs_remove(dev->debug.dent_ae_exposure_max);
+	if (dev->debug.dent_ae_gain_max)
+		debugfs_remove(dev->debug.dent_ae_gain_max);
 	if (dev->debug.dent_device)
 		debugfs_remove(dev->debug.dent_device);
 	kref_put(&debug_ref, debugfs_delete);
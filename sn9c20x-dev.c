@@ -24,8 +24,10 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/string.h>
+#include <linux/mutex.h>
 #include <stdarg.h>
 
 #include "sn9c20x.h"
@@ -39,6 +41,98 @@ int (*sn_probes[])(struct usb_sn9c20x *dev) = {
 	mt9v112_probe,
 };
 
+/**
+ * @def SN9C20X_SENSOR_CACHE
+ *   Number of devices whose probed sensor is remembered
+ */
+#define SN9C20X_SENSOR_CACHE	16
+
+/**
+ * @struct sn9c20x_sensor_cache
+ *   Probe that found the sensor of a device, the device is identified by
+ *   its USB path and serial number
+ */
+struct sn9c20x_sensor_cache {
+	char path[64];
+	char serial[32];
+	int probe;
+};
+
+static struct sn9c20x_sensor_cache sensor_cache[SN9C20X_SENSOR_CACHE];
+static unsigned int sensor_cache_next;		/**< Next entry to replace */
+static unsigned int probe_hits[ARRAY_SIZE(sn_probes)];	/**< Hits per probe */
+static DEFINE_MUTEX(sensor_cache_lock);		/**< Protects the cache and hits */
+
+/**
+ * @brief Probe the sensor of a device sold with several sensors
+ *
+ * @param dev Pointer to device structure
+ *
+ * @returns The sensor found or negative error value
+ *
+ * Every probe that fails waits out the I2C timeouts. The probe that found
+ * the sensor of a device seen before, on the same USB path and with the
+ * same serial number, is tried first. The others follow by their number
+ * of hits so far. The probes themselves run without the lock so that
+ * several devices can probe at the same time.
+ */
+static int dev_sn9c20x_probe_sensor(struct usb_sn9c20x *dev)
+{
+	struct sn9c20x_sensor_cache key;
+	struct sn9c20x_sensor_cache *entry = NULL;
+	unsigned int rank[ARRAY_SIZE(sn_probes)];
+	int order[ARRAY_SIZE(sn_probes)];
+	int i, j;
+	int ret = -ENODEV;
+
+	memset(&key, 0, sizeof(key));
+	usb_make_path(dev->udev, key.path, sizeof(key.path));
+	if (dev->udev->serial)
+		strlcpy(key.serial, dev->udev->serial, sizeof(key.serial));
+
+	mutex_lock(&sensor_cache_lock);
+	for (i = 0; i < SN9C20X_SENSOR_CACHE; i++) {
+		if (strcmp(sensor_cache[i].path, key.path) == 0 &&
+		    strcmp(sensor_cache[i].serial, key.serial) == 0) {
+			entry = &sensor_cache[i];
+			break;
+		}
+	}
+
+	/* Insertion sort, the cached probe first */
+	for (i = 0; i < ARRAY_SIZE(sn_probes); i++) {
+		rank[i] = probe_hits[i];
+		if (entry != NULL && entry->probe == i)
+			rank[i] = UINT_MAX;
+		for (j = i; j > 0 && rank[order[j - 1]] < rank[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	mutex_unlock(&sensor_cache_lock);
+
+	for (i = 0; i < ARRAY_SIZE(sn_probes); i++) {
+		ret = sn_probes[order[i]](dev);
+		if (ret > 0)
+			break;
+	}
+	if (ret <= 0)
+		return -ENODEV;
+
+	mutex_lock(&sensor_cache_lock);
+	probe_hits[order[i]]++;
+	if (entry == NULL || strcmp(entry->path, key.path) != 0 ||
+	    strcmp(entry->serial, key.serial) != 0) {
+		entry = &sensor_cache[sensor_cache_next];
+		sensor_cache_next = (sensor_cache_next + 1) %
+				    SN9C20X_SENSOR_CACHE;
+	}
+	key.probe = order[i];
+	*entry = key;
+	mutex_unlock(&sensor_cache_lock);
+
+	return ret;
+}
+
 struct sn9c20x_video_mode sn9c20x_modes[SN9C20X_N_MODES] = {
 	{
 		.width = 128,
@@ -116,22 +210,27 @@ struct sn9c20x_video_format sn9c20x_fmts[SN9C20X_N_FMTS] = {
 int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 {
 	int ret = 0;
-	int i;
 
 	dev->camera.min_yavg = 80;
 	dev->camera.max_yavg = 130;
-	dev->camera.old_step = 0;
-	dev->camera.older_step = 0;
-	dev->camera.exposure_step = 16;
+	dev->camera.ae_integral = 0;
+	dev->camera.ae_kp = 70;
+	dev->camera.ae_ki = 20;
+	dev->camera.ae_exposure_max = 0xff;
+	dev->camera.ae_gain_max = 0xff;
+	dev->camera.flip_phase = 0;
+	dev->camera.power_line = V4L2_CID_POWER_LINE_FREQUENCY_DISABLED;
 
-	/* Probe sensor first if sensor set to probe*/
+	/* Probe sensor first if sensor set to probe. A sensor that was not
+	 * found is probed again on the next reset. */
 	if (dev->camera.sensor == PROBE_SENSOR) {
-		for (i = 0; i < ARRAY_SIZE(sn_probes); i++) {
-			ret = sn_probes[i](dev);
-			dev->camera.sensor = ret;
-			if (ret > 0)
-				break;
+		ret = dev_sn9c20x_probe_sensor(dev);
+		if (ret < 0) {
+			UDIA_INFO("No sensor found.\n");
+			return ret;
 		}
+		dev->camera.sensor = ret;
+		ret = 0;
 	}
 
 	switch (dev->camera.sensor) {
@@ -143,6 +242,7 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		dev->camera.set_gain = soi968_set_gain;
 		dev->camera.set_auto_gain = ov_set_autogain;
 		dev->camera.set_auto_whitebalance = soi968_set_autowhitebalance;
+		dev->camera.set_power_line = ov_set_banding_filter;
 		dev->camera.hstart = 60;
 		dev->camera.vstart = 11;
 		UDIA_INFO("Detected SOI968 Sensor.\n");
@@ -153,10 +253,13 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		dev->camera.vstart = 7;
 		dev->camera.set_sxga_mode = ov965x_set_sxga_mode;
 		dev->camera.set_hvflip = ov965x_set_hvflip;
+		/* TSLB makes up for the vertical flip only */
+		dev->camera.flip_phase = SN9C20X_BAYER_COLUMN;
 		dev->camera.set_exposure = ov_set_exposure;
 		dev->camera.set_auto_gain = ov_set_autogain;
 		dev->camera.set_gain = ov9650_set_gain;
 		dev->camera.flip_detect = ov965x_flip_detect;
+		dev->camera.set_power_line = ov965x_set_banding_filter;
 		UDIA_INFO("Detected OV9650 Sensor.\n");
 		break;
 	case OV9655_SENSOR:
@@ -164,6 +267,9 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		dev->camera.set_sxga_mode = ov965x_set_sxga_mode;
 		dev->camera.set_exposure = ov_set_exposure;
 		dev->camera.set_auto_gain = ov_set_autogain;
+		dev->camera.set_power_line = ov965x_set_banding_filter;
+		/* The init table turns the banding filter on */
+		dev->camera.power_line = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
 		dev->camera.hstart = 0;
 		dev->camera.vstart = 7;
 		UDIA_INFO("Detected OV9655 Sensor.\n");
@@ -172,7 +278,10 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		sn9c20x_write_i2c_array(dev, ov7670_init, 0);
 		dev->camera.set_exposure = ov_set_exposure;
 		dev->camera.set_auto_gain = ov_set_autogain;
+		dev->camera.set_power_line = ov_set_banding_filter;
+		dev->camera.power_line = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
 		dev->camera.flip_detect = ov7670_flip_detect;
+		dev->camera.flip_state = 0x01;
 		dev->camera.hstart = 0;
 		dev->camera.vstart = 1;
 		UDIA_INFO("Detected OV7670 Sensor.\n");
@@ -181,6 +290,8 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		sn9c20x_write_i2c_array(dev, ov7660_init, 0);
 		dev->camera.set_exposure = ov_set_exposure;
 		dev->camera.set_auto_gain = ov_set_autogain;
+		dev->camera.set_power_line = ov_set_banding_filter;
+		dev->camera.power_line = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
 		dev->camera.set_gain = ov9650_set_gain;
 		dev->camera.hstart = 1;
 		dev->camera.vstart = 1;
@@ -190,6 +301,8 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		sn9c20x_write_i2c_array(dev, mt9v111_init, 1);
 		dev->camera.set_hvflip = mt9v111_set_hvflip;
 		dev->camera.set_exposure = mt9v111_set_exposure;
+		/* 16 rows of about 63 us at VGA */
+		dev->camera.exposure_unit_ns = 1000000;
 		dev->camera.set_auto_exposure = mt9v111_set_autoexposure;
 		dev->camera.set_auto_whitebalance = mt9v111_set_autowhitebalance;
 		dev->camera.hstart = 2;
@@ -199,6 +312,8 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 	case MT9V112_SENSOR:
 		sn9c20x_write_i2c_array(dev, mt9v112_init, 1);
 		dev->camera.set_hvflip = mt9v112_set_hvflip;
+		dev->camera.flip_phase = SN9C20X_BAYER_COLUMN |
+			SN9C20X_BAYER_ROW;
 		dev->camera.hstart = 6;
 		dev->camera.vstart = 2;
 		UDIA_INFO("Detected MT9V112 Sensor.\n");
@@ -216,6 +331,8 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		sn9c20x_write_i2c_array(dev, mt9v011_init, 1);
 		dev->camera.set_hvflip = mt9v011_set_hvflip;
 		dev->camera.set_exposure = mt9v011_set_exposure;
+		/* 16 rows of about 63 us at VGA */
+		dev->camera.exposure_unit_ns = 1000000;
 		dev->camera.hstart = 2;
 		dev->camera.vstart = 2;
 		UDIA_INFO("Detected MT9V011 Sensor.\n");
@@ -230,8 +347,12 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 		dev->camera.i2c_flags |= SN9C20X_I2C_400KHZ;
 		sn9c20x_write_i2c_array(dev, hv7131r_init, 0);
 		dev->camera.set_hvflip = hv7131r_set_hvflip;
+		dev->camera.flip_phase = SN9C20X_BAYER_COLUMN |
+			SN9C20X_BAYER_ROW;
 		dev->camera.set_gain = hv7131r_set_gain;
 		dev->camera.set_exposure = hv7131r_set_exposure;
+		/* 65536 pixel clocks at 24 MHz */
+		dev->camera.exposure_unit_ns = 2730000;
 		dev->camera.hstart = 0;
 		dev->camera.vstart = 1;
 		UDIA_INFO("Detected HV7131R Sensor.\n");
@@ -245,23 +366,140 @@ int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev)
 
 
 /**
- * @brief Wrapper function to detect hardware states
+ * @brief Average the colours of a frame for software white balance
  *
  * @param dev Pointer to device structure
+ * @param data Frame data
+ * @param len Length of the frame data
  *
- * @returns 0
+ * Reads a sparse grid of the frame only. The Bayer pattern moves with the
+ * parity of the window start and with the flips the sensor doesn't make
+ * up for, see flip_phase. SN9C20X I420 comes in blocks of 16x8 pixels,
+ * 128 Y bytes followed by 32 U and 32 V bytes, its mean YUV is converted
+ * to RGB. JPEG frames aren't sampled.
  */
-int dev_sn9c20x_call_constantly(struct usb_sn9c20x *dev)
+static void dev_sn9c20x_sample_colour(struct usb_sn9c20x *dev,
+	const __u8 *data, unsigned int len)
 {
+	struct v4l2_pix_format *fmt = &dev->vsettings.format;
+	struct sn9c20x_camera *cam = &dev->camera;
+	unsigned int r = 0, g = 0, b = 0, n = 0;
+	unsigned int ysum = 0, usum = 0, vsum = 0;
+	unsigned int bpl = fmt->bytesperline;
+	unsigned int x, y, xstep, ystep, i, j, blocks, step;
+	unsigned int phase, bx, by;
+	int my, mu, mv;
+	const __u8 *p;
 
-	/* Know to be broken, temporarely disabled */
-	/*dev_sn9c20x_flip_detection(dev);*/
-	if (!dev->camera.set_auto_exposure &&
-		dev->vsettings.auto_exposure) {
-		dev_sn9c20x_perform_soft_ae(dev);
+	switch (fmt->pixelformat) {
+	case V4L2_PIX_FMT_SBGGR8:
+		/* Blue is at (bx, by) in each 2x2 cell, red across from it */
+		phase = cam->bayer_phase;
+		if (dev->vsettings.hflip)
+			phase ^= cam->flip_phase & SN9C20X_BAYER_COLUMN;
+		if (dev->vsettings.vflip)
+			phase ^= cam->flip_phase & SN9C20X_BAYER_ROW;
+		bx = phase & SN9C20X_BAYER_COLUMN ? 1 : 0;
+		by = phase & SN9C20X_BAYER_ROW ? bpl : 0;
+
+		xstep = max(fmt->width / 16, 2U) & ~1;
+		ystep = max(fmt->height / 16, 2U) & ~1;
+		for (y = 0; y + 1 < fmt->height; y += ystep) {
+			for (x = 0; x + 1 < fmt->width; x += xstep) {
+				p = data + y * bpl + x;
+				b += p[by + bx];
+				g += (p[by + (1 - bx)] +
+				      p[(bpl - by) + bx]) / 2;
+				r += p[(bpl - by) + (1 - bx)];
+				n++;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_SN9C20X_I420:
+		blocks = len / 192;
+		step = max(blocks / 64, 1U);
+		for (i = 0; i < blocks; i += step) {
+			p = data + i * 192;
+			for (j = 0; j < 32; j++) {
+				ysum += p[j * 4];
+				usum += p[128 + j];
+				vsum += p[160 + j];
+			}
+			n += 32;
+		}
+		if (n == 0)
+			return;
+		my = ysum / n;
+		mu = (int)(usum / n) - 128;
+		mv = (int)(vsum / n) - 128;
+		r = max(my + ((359 * mv) >> 8), 0);
+		g = max(my - ((88 * mu + 183 * mv) >> 8), 0);
+		b = max(my + ((454 * mu) >> 8), 0);
+		n = 1;
+		break;
+	default:
+		return;
 	}
+	if (n == 0)
+		return;
 
-	return 0;
+	cam->awb_red = r / n;
+	cam->awb_green = g / n;
+	cam->awb_blue = b / n;
+	cam->awb_valid = 1;
+}
+
+/**
+ * @brief Queue a run of software auto-exposure and white balance
+ *
+ * @param dev Pointer to device structure
+ * @param buf Buffer of the frame that just ended, can be NULL
+ *
+ * Called from the completion handler after each frame header, the sensor
+ * and the bridge gains are only written from the worker. Runs are spaced
+ * by SN9C20X_AE_FRAMES frames.
+ */
+void dev_sn9c20x_schedule_auto(struct usb_sn9c20x *dev,
+	struct sn9c20x_buffer *buf)
+{
+	int soft_ae = !dev->camera.set_auto_exposure &&
+		dev->vsettings.auto_exposure;
+	int soft_awb = !dev->camera.set_auto_whitebalance &&
+		dev->vsettings.auto_whitebalance;
+
+	if (!soft_ae && !soft_awb)
+		return;
+
+	if (++dev->ae_frames < SN9C20X_AE_FRAMES)
+		return;
+	dev->ae_frames = 0;
+
+	if (soft_awb && buf != NULL &&
+	    buf->buf.bytesused == dev->vsettings.format.sizeimage)
+		dev_sn9c20x_sample_colour(dev,
+			dev->queue.mem + buf->buf.m.offset,
+			buf->buf.bytesused);
+
+	schedule_work(&dev->auto_work);
+}
+
+/**
+ * @brief Worker running software auto-exposure and white balance
+ *
+ * @param work Work structure of the device
+ */
+void dev_sn9c20x_auto_work(struct work_struct *work)
+{
+	struct usb_sn9c20x *dev = container_of(work, struct usb_sn9c20x,
+					       auto_work);
+
+	mutex_lock(&dev->ctrl_mutex);
+	if (!dev->camera.set_auto_exposure && dev->vsettings.auto_exposure)
+		dev_sn9c20x_perform_soft_ae(dev);
+	if (!dev->camera.set_auto_whitebalance &&
+	    dev->vsettings.auto_whitebalance)
+		dev_sn9c20x_perform_soft_awb(dev);
+	mutex_unlock(&dev->ctrl_mutex);
 }
 
 /**
@@ -269,7 +507,7 @@ int dev_sn9c20x_call_constantly(struct usb_sn9c20x *dev)
  *
  * @param dev Pointer to device structure
  *
- * @returns 0 or negative error value
+ * @returns 1 if the flip changed, 0 or negative error value
  *
  */
 int dev_sn9c20x_flip_detection(struct usb_sn9c20x *dev)
@@ -280,6 +518,103 @@ int dev_sn9c20x_flip_detection(struct usb_sn9c20x *dev)
 	return ret;
 }
 
+/**
+ * @brief Compute the weights of the header windows for a metering mode
+ *
+ * @param dev Pointer to device structure
+ *
+ * @returns 0 or negative error value
+ *
+ * The bridge doesn't document how its eight luma windows tile the picture,
+ * they are taken as two rows of four in raster order. Each window of the
+ * user rectangle is weighted by the part of it the rectangle covers.
+ */
+int dev_sn9c20x_set_metering(struct usb_sn9c20x *dev)
+{
+	static const __u8 centre[SN9C20X_META_WINDOWS] = {
+		1, 3, 3, 1,
+		1, 3, 3, 1,
+	};
+	static const __u8 spot[SN9C20X_META_WINDOWS] = {
+		0, 1, 1, 0,
+		0, 1, 1, 0,
+	};
+	struct sn9c20x_video *vs = &dev->vsettings;
+	__u8 *weight = dev->camera.window_weight;
+	int x0, x1, y0, y1, w, h;
+	int i;
+
+	switch (vs->metering) {
+	case SN9C20X_METERING_AVERAGE:
+		memset(weight, 1, SN9C20X_META_WINDOWS);
+		break;
+	case SN9C20X_METERING_CENTRE:
+		memcpy(weight, centre, SN9C20X_META_WINDOWS);
+		break;
+	case SN9C20X_METERING_SPOT:
+		memcpy(weight, spot, SN9C20X_META_WINDOWS);
+		break;
+	case SN9C20X_METERING_RECT:
+		/* Windows are 25% wide and 50% high, weights go up to 16 */
+		for (i = 0; i < SN9C20X_META_WINDOWS; i++) {
+			x0 = max(vs->meter_left, (i % 4) * 25);
+			x1 = min(vs->meter_left + vs->meter_width,
+				 (i % 4) * 25 + 25);
+			y0 = max(vs->meter_top, (i / 4) * 50);
+			y1 = min(vs->meter_top + vs->meter_height,
+				 (i / 4) * 50 + 50);
+			w = max(x1 - x0, 0);
+			h = max(y1 - y0, 0);
+			weight[i] = (w * h * 16 + 25 * 50 - 1) / (25 * 50);
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Round an exposure to a multiple of the flicker period
+ *
+ * @param dev Pointer to device structure
+ * @param exposure Exposure setting
+ *
+ * @returns The exposure setting to use
+ *
+ * Lamps on the mains flicker at twice its frequency. Exposures lasting a
+ * whole number of flicker periods see the same light in every frame.
+ * Exposures shorter than a period are left alone, as are sensors whose
+ * exposure step isn't known.
+ */
+static int dev_sn9c20x_antiflicker(struct usb_sn9c20x *dev, int exposure)
+{
+	unsigned int unit = dev->camera.exposure_unit_ns;
+	unsigned int period, n;
+
+	switch (dev->vsettings.power_line) {
+	case V4L2_CID_POWER_LINE_FREQUENCY_50HZ:
+		period = 10000000;
+		break;
+	case V4L2_CID_POWER_LINE_FREQUENCY_60HZ:
+		period = 8333333;
+		break;
+	default:
+		return exposure;
+	}
+	if (unit == 0)
+		return exposure;
+
+	n = (exposure * unit + period / 2) / period;
+	if (n == 0)
+		return exposure;
+
+	return clamp_t(int, (n * period + unit / 2) / unit, 1,
+		       min_t(__u32, dev->camera.ae_exposure_max,
+			     SN9C20X_AE_SETTING_MAX));
+}
+
 /**
  * @brief Perform software autoexposure
  *
@@ -287,78 +622,133 @@ int dev_sn9c20x_flip_detection(struct usb_sn9c20x *dev)
  *
  * @returns 0 or negative error value
  *
+ * Runs the PI controller of sn9c20x-ae.c on the mean luma and programs
+ * the new exposure and gain. The gains are tuned in debugfs. With a power
+ * line frequency set, the exposure is kept to multiples of the flicker
+ * period.
+ *
  * @author Stefan Krastanov
  */
 int dev_sn9c20x_perform_soft_ae(struct usb_sn9c20x *dev)
 {
-	int yavg, new_exp;
-	yavg = -1;
+	struct sn9c20x_camera *cam = &dev->camera;
+	struct sn9c20x_ae_params params = {
+		.min_yavg = cam->min_yavg,
+		.max_yavg = cam->max_yavg,
+		.kp = cam->ae_kp,
+		.ki = cam->ae_ki,
+		.exposure_max = cam->ae_exposure_max,
+		.gain_max = cam->ae_gain_max,
+	};
+	int yavg, err;
+	int exposure, gain;
+	int soft_gain;
 
-	if (!dev->camera.set_exposure)
+	if (!cam->set_exposure)
 		return -1;
-	yavg = atomic_read(&dev->camera.yavg);
+	yavg = atomic_read(&cam->yavg);
 
-	UDIA_DEBUG("Sensor YAVG: %d\n", yavg);
 	if (yavg < 0) {
 		/* Can't get YAVG - we have nothing to do */
+		UDIA_DEBUG("Sensor YAVG: %d\n", yavg);
 		return -1;
 	}
 
-	/*some hardcoded values are present
-	 *like those for maximal/minimal exposure
-	 *and exposure steps*/
-
-	/* image too dark */
-	if (yavg < dev->camera.min_yavg) {
-		/*worst case - exposure is allready maximal*/
-		if (dev->vsettings.exposure > 0xf5)
-			return 0;
-		/*change exposure just a bit*/
-		new_exp = dev->vsettings.exposure + dev->camera.exposure_step;
-		if (new_exp > 0xff)
-			new_exp = 0xff;
-		if (new_exp < 0x1)
-			new_exp = 1;
-		/*set it*/
-		dev->vsettings.exposure = new_exp;
-		dev->camera.set_exposure(dev);
-		/*note the direction of the change*/
-		dev->camera.older_step = dev->camera.old_step;
-		dev->camera.old_step = 1; /*it's going up*/
-
-		/*check if it's oscillating and take smaller step if it is*/
-		if (dev->camera.old_step ^ dev->camera.older_step)
-			dev->camera.exposure_step /= 2;
-			/* oscilating - divide the step by 2 */
-		else
-			dev->camera.exposure_step += 2;
-			/* same direction - step must be bigger */
+	soft_gain = cam->set_gain && !cam->set_auto_gain &&
+		dev->vsettings.auto_gain;
+	exposure = dev->vsettings.exposure;
+	gain = dev->vsettings.gain;
+
+	/* tools/ae-sim.c replays these lines */
+	UDIA_DEBUG("Soft AE: yavg %d exposure %d gain %d\n",
+		   yavg, exposure, gain);
+
+	err = sn9c20x_ae_update(&params, &cam->ae_integral, yavg, soft_gain,
+				&exposure, &gain);
+	if (err)
+		UDIA_DEBUG("Soft AE: error %d integral %d exposure %d "
+			   "gain %d\n", err, cam->ae_integral, exposure, gain);
+
+	exposure = dev_sn9c20x_antiflicker(dev, exposure);
+
+	if (exposure != dev->vsettings.exposure) {
+		dev->vsettings.exposure = exposure;
+		cam->set_exposure(dev);
+		v4l2_notify_control(dev, V4L2_CID_EXPOSURE, exposure);
+	}
+	if (gain != dev->vsettings.gain) {
+		dev->vsettings.gain = gain;
+		cam->set_gain(dev);
+		v4l2_notify_control(dev, V4L2_CID_GAIN, gain);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Move a bridge colour gain towards grey
+ *
+ * @param gain Current gain
+ * @param green Mean of the green channel
+ * @param colour Mean of the channel the gain applies to
+ *
+ * @returns The new gain
+ */
+static int dev_sn9c20x_awb_step(int gain, unsigned int green,
+	unsigned int colour)
+{
+	int target, step;
+
+	/* Within 3% is grey enough */
+	if (colour == 0 || abs((int)green - (int)colour) * 32 < green)
+		return gain;
+
+	target = max(gain, 1) * green / colour;
+	step = (target - gain) / 2;
+	if (step == 0)
+		step = target > gain ? 1 : -1;
+	return clamp(gain + step, 1, 0x7f);
+}
+
+/**
+ * @brief Perform software white balance
+ *
+ * @param dev
+ *
+ * @returns 0 or negative error value
+ *
+ * Grey world: the bridge red and blue gains are moved half way towards
+ * making the mean red and blue match the mean green of the last sampled
+ * frame.
+ */
+int dev_sn9c20x_perform_soft_awb(struct usb_sn9c20x *dev)
+{
+	struct sn9c20x_camera *cam = &dev->camera;
+	int red, blue;
+
+	if (!cam->set_red_gain || !cam->set_blue_gain)
+		return -1;
+	if (!cam->awb_valid)
+		return 0;
+	cam->awb_valid = 0;
+
+	UDIA_DEBUG("Soft AWB: R %u G %u B %u\n",
+		   cam->awb_red, cam->awb_green, cam->awb_blue);
+
+	red = dev_sn9c20x_awb_step(dev->vsettings.red_gain,
+				   cam->awb_green, cam->awb_red);
+	blue = dev_sn9c20x_awb_step(dev->vsettings.blue_gain,
+				    cam->awb_green, cam->awb_blue);
+
+	if (red != dev->vsettings.red_gain) {
+		dev->vsettings.red_gain = red;
+		cam->set_red_gain(dev);
+		v4l2_notify_control(dev, V4L2_CID_RED_BALANCE, red);
 	}
-	/*image too light*/
-	if (yavg > dev->camera.max_yavg) {
-		/*worst case - exposure is allready minimal*/
-		if (dev->vsettings.exposure < 0x10)
-			return 0;
-		/*change exposure just a bit*/
-		new_exp = dev->vsettings.exposure - dev->camera.exposure_step;
-		if (new_exp > 0xff)
-			new_exp = 0xff;
-		if (new_exp < 0x1)
-			new_exp = 1;
-		/*set it*/
-		dev->vsettings.exposure = new_exp;
-		dev->camera.set_exposure(dev);
-		/*note the direction of the change*/
-		dev->camera.older_step = dev->camera.old_step;
-		dev->camera.old_step = 0; /*it's going down*/
-
-		/*check if it's oscillating and take smaller step if it is*/
-		if (dev->camera.old_step ^ dev->camera.older_step)
-			dev->camera.exposure_step /= 2;
-			/* oscilating - divide the step by 2 */
-		else
-			dev->camera.exposure_step += 2;
-			/* same direction - step must be bigger */
+	if (blue != dev->vsettings.blue_gain) {
+		dev->vsettings.blue_gain = blue;
+		cam->set_blue_gain(dev);
+		v4l2_notify_control(dev, V4L2_CID_BLUE_BALANCE, blue);
 	}
 
 	return 0;
@@ -0,0 +1,376 @@
+/**
+ * @file sn9c20x-meta.c
+ * @author microdia project
+ *
+ * @brief Per-frame metadata device
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * The bridge sends a 64 bytes header after each frame. Besides the luma
+ * sums of its eight windows it carries the colour window and a few more
+ * bytes the driver doesn't decode. A second video device lets user space
+ * read() one struct sn9c20x_meta_record (sn9c20x-api.h) per frame: the raw
+ * header, the decoded window sums, the exposure and gain in use, the
+ * sequence number and the timestamp the frame gets on the capture device.
+ * Auto exposure, white balance or quality monitors can then run on a few
+ * bytes per frame instead of the images.
+ *
+ * Records are only kept while the device is open. The completion handler
+ * writes them to a small ring, the oldest unread record is overwritten
+ * when the readers fall behind.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/usb.h>
+#include <asm/uaccess.h>
+#include <media/v4l2-common.h>
+
+#include "sn9c20x.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+#include <media/v4l2-ioctl.h>
+#endif
+
+/**
+ * @param dev Device structure
+ * @param header Raw frame header
+ * @param window Luma sums of the windows
+ * @param sequence Sequence number of the frame
+ * @param flags SN9C20X_META_* flags
+ * @param stamp Start of the frame
+ *
+ * @brief Record the statistics of a frame for the metadata readers
+ *
+ * Called from the completion handler.
+ */
+void sn9c20x_meta_frame(struct usb_sn9c20x *dev, const __u8 *header,
+	const __u32 *window, __u32 sequence, __u32 flags, ktime_t stamp)
+{
+	struct sn9c20x_meta *meta = &dev->meta;
+	struct sn9c20x_meta_record *rec;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&meta->lock, irqflags);
+	if (meta->users == 0) {
+		spin_unlock_irqrestore(&meta->lock, irqflags);
+		return;
+	}
+	if (meta->head - meta->tail == SN9C20X_META_RECORDS) {
+		meta->tail++;
+		meta->overrun++;
+	}
+	rec = &meta->ring[meta->head % SN9C20X_META_RECORDS];
+	rec->sequence = sequence;
+	rec->flags = flags;
+	rec->timestamp = ktime_to_ns(stamp);
+	memcpy(rec->window, window, sizeof(rec->window));
+	rec->exposure = dev->vsettings.exposure;
+	rec->gain = dev->vsettings.gain;
+	memcpy(rec->header, header, sizeof(rec->header));
+	meta->head++;
+	spin_unlock_irqrestore(&meta->lock, irqflags);
+
+	wake_up_interruptible(&meta->wait);
+}
+
+/**
+ * @param meta Metadata device
+ * @param rec Record to fill
+ *
+ * @returns 0 if a record was taken, -EAGAIN if there was none
+ *
+ * @brief Take the oldest unread record from the ring
+ */
+static int sn9c20x_meta_take(struct sn9c20x_meta *meta,
+	struct sn9c20x_meta_record *rec)
+{
+	unsigned long irqflags;
+	int ret = -EAGAIN;
+
+	spin_lock_irqsave(&meta->lock, irqflags);
+	if (meta->head != meta->tail) {
+		*rec = meta->ring[meta->tail % SN9C20X_META_RECORDS];
+		meta->tail++;
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&meta->lock, irqflags);
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
+static int sn9c20x_meta_open(struct inode *inode, struct file *fp)
+#else
+static int sn9c20x_meta_open(struct file *fp)
+#endif
+{
+	struct usb_sn9c20x *dev;
+	unsigned long irqflags;
+	int ret;
+
+	dev = video_get_drvdata(video_devdata(fp));
+
+	ret = wait_for_completion_interruptible(&dev->init_done);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&dev->open_lock);
+
+	if (dev->meta.vdev == NULL || dev->disconnected) {
+		mutex_unlock(&dev->open_lock);
+		return -ENODEV;
+	}
+
+	spin_lock_irqsave(&dev->meta.lock, irqflags);
+	if (dev->meta.users++ == 0) {
+		dev->meta.head = 0;
+		dev->meta.tail = 0;
+		dev->meta.overrun = 0;
+	}
+	spin_unlock_irqrestore(&dev->meta.lock, irqflags);
+
+	kref_get(&dev->vopen);
+
+	mutex_unlock(&dev->open_lock);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
+static int sn9c20x_meta_release(struct inode *inode, struct file *fp)
+#else
+static int sn9c20x_meta_release(struct file *fp)
+#endif
+{
+	struct usb_sn9c20x *dev;
+	unsigned long irqflags;
+
+	dev = video_get_drvdata(video_devdata(fp));
+
+	mutex_lock(&dev->open_lock);
+	spin_lock_irqsave(&dev->meta.lock, irqflags);
+	dev->meta.users--;
+	spin_unlock_irqrestore(&dev->meta.lock, irqflags);
+	mutex_unlock(&dev->open_lock);
+
+	kref_put(&dev->vopen, usb_sn9c20x_delete);
+	return 0;
+}
+
+/**
+ * @param fp File pointer
+ * @param buf User buffer
+ * @param count Size of the user buffer
+ * @param f_pos Unused
+ *
+ * @returns Number of bytes read or negative error code
+ *
+ * @brief Read as many whole records as fit in the user buffer
+ *
+ * Blocks until a record is available unless the file is non-blocking.
+ */
+static ssize_t sn9c20x_meta_read(struct file *fp, char __user *buf,
+	size_t count, loff_t *f_pos)
+{
+	struct usb_sn9c20x *dev;
+	struct sn9c20x_meta_record rec;
+	ssize_t done = 0;
+	int ret;
+
+	dev = video_get_drvdata(video_devdata(fp));
+
+	if (count < sizeof(rec))
+		return -EINVAL;
+
+	while (count - done >= sizeof(rec)) {
+		ret = sn9c20x_meta_take(&dev->meta, &rec);
+		if (ret < 0) {
+			if (done)
+				break;
+			if (dev->meta.vdev == NULL)
+				return -ENODEV;
+			if (fp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			ret = wait_event_interruptible(dev->meta.wait,
+				dev->meta.head != dev->meta.tail ||
+				dev->meta.vdev == NULL);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		if (copy_to_user(buf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
+	}
+
+	return done;
+}
+
+static unsigned int sn9c20x_meta_poll(struct file *fp, poll_table *wait)
+{
+	struct usb_sn9c20x *dev;
+	unsigned int mask = 0;
+
+	dev = video_get_drvdata(video_devdata(fp));
+
+	poll_wait(fp, &dev->meta.wait, wait);
+
+	if (dev->meta.head != dev->meta.tail)
+		mask |= POLLIN | POLLRDNORM;
+	if (dev->meta.vdev == NULL)
+		mask |= POLLERR | POLLHUP;
+
+	return mask;
+}
+
+/**
+ * @param file
+ * @param priv
+ * @param cap
+ *
+ * @return 0
+ */
+static int sn9c20x_meta_querycap(struct file *file, void *priv,
+	struct v4l2_capability *cap)
+{
+	struct usb_sn9c20x *dev;
+
+	dev = video_get_drvdata(video_devdata(file));
+
+	strlcpy(cap->driver, "sn9c20x", sizeof(cap->driver));
+	strlcpy(cap->card, video_devdata(file)->name, sizeof(cap->card));
+	cap->capabilities = V4L2_CAP_READWRITE;
+	cap->version = (__u32) DRIVER_VERSION_NUM;
+
+	if (usb_make_path(dev->udev, cap->bus_info, sizeof(cap->bus_info)) < 0)
+		strlcpy(cap->bus_info, cap->card, sizeof(cap->bus_info));
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+static const struct v4l2_ioctl_ops sn9c20x_meta_ioctl_ops = {
+	.vidioc_querycap            = sn9c20x_meta_querycap,
+};
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
+static struct file_operations sn9c20x_meta_fops = {
+#else
+static struct v4l2_file_operations sn9c20x_meta_fops = {
+#endif
+	.owner = THIS_MODULE,
+	.open = sn9c20x_meta_open,
+	.release = sn9c20x_meta_release,
+	.read = sn9c20x_meta_read,
+	.poll = sn9c20x_meta_poll,
+	.ioctl = video_ioctl2,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
+	.llseek = no_llseek
+#endif
+};
+
+/**
+ * @param vdev Metadata video device
+ *
+ * @brief Drop the reference the metadata device holds on the device
+ */
+static void sn9c20x_meta_release_vdev(struct video_device *vdev)
+{
+	struct usb_sn9c20x *dev = video_get_drvdata(vdev);
+
+	video_device_release(vdev);
+	kref_put(&dev->vopen, usb_sn9c20x_delete);
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Register the metadata video device
+ */
+int sn9c20x_meta_register(struct usb_sn9c20x *dev)
+{
+	struct video_device *vdev;
+	int ret;
+
+	spin_lock_init(&dev->meta.lock);
+	init_waitqueue_head(&dev->meta.wait);
+
+	vdev = video_device_alloc();
+	if (vdev == NULL)
+		return -ENOMEM;
+
+	strlcpy(vdev->name, "SN9C20x USB 2.0 Webcam Metadata",
+		sizeof(vdev->name));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 27)
+	vdev->dev = &dev->interface->dev;
+	vdev->owner = THIS_MODULE;
+	vdev->type = VID_TYPE_CAPTURE;
+	vdev->vidioc_querycap = sn9c20x_meta_querycap;
+#else
+	vdev->parent = &dev->interface->dev;
+	vdev->ioctl_ops = &sn9c20x_meta_ioctl_ops;
+#endif
+	vdev->fops = &sn9c20x_meta_fops;
+	vdev->release = sn9c20x_meta_release_vdev;
+	vdev->minor = -1;
+
+	video_set_drvdata(vdev, dev);
+	dev->meta.vdev = vdev;
+
+	ret = video_register_device(vdev, VFL_TYPE_GRABBER, -1);
+	if (ret < 0) {
+		UDIA_ERROR("Metadata device register fail !\n");
+		dev->meta.vdev = NULL;
+		video_device_release(vdev);
+		return ret;
+	}
+	kref_get(&dev->vopen);
+
+	UDIA_INFO("Frame metadata available on /dev/video%d\n", vdev->minor);
+	return 0;
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @brief Unregister the metadata video device
+ *
+ * Called when the device goes away, readers still holding the device open
+ * are woken up and get -ENODEV.
+ */
+void sn9c20x_meta_unregister(struct usb_sn9c20x *dev)
+{
+	struct video_device *vdev = dev->meta.vdev;
+
+	if (vdev == NULL)
+		return;
+
+	dev->meta.vdev = NULL;
+	video_unregister_device(vdev);
+	wake_up_interruptible(&dev->meta.wait);
+}
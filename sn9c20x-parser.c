@@ -0,0 +1,263 @@
+/**
+ * @file sn9c20x-parser.c
+ * @author microdia project
+ *
+ * @brief Parser of the stream sent by the bridge
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * The parser doesn't touch the device, it only tells the caller where the
+ * frame data and the headers are. tools/parser-test.c builds it in user
+ * space and replays streams split at every offset through it,
+ * tools/isoc-bench.c times the isochronous walk against recorded URBs.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/usb.h>
+#include <asm/unaligned.h>
+#endif
+
+#include "sn9c20x-parser.h"
+
+/**
+ * @var frame_magic
+ *   First bytes of the 64 bytes header sent by the bridge after each frame
+ */
+static const unsigned char frame_magic[6] = {
+	0xff, 0xff, 0x00, 0xc4, 0xc4, 0x96
+};
+
+/**
+ * @param buf Start of a possible header
+ *
+ * @returns Non-zero if buf starts with the header magic
+ *
+ * @brief Check the header magic with two word compares
+ */
+static inline int sn9c20x_is_magic(const unsigned char *buf)
+{
+	return get_unaligned_le32(buf) == 0xc400ffff &&
+	       get_unaligned_le16(buf + 4) == 0x96c4;
+}
+
+/**
+ * @param buf Data of an isochronous packet
+ * @param buf_length Length of the packet
+ *
+ * @returns 0 if the packet is a frame header, -1 otherwise
+ */
+int usb_sn9c20x_detect_frame(const unsigned char *buf,
+	unsigned int buf_length)
+{
+	if (buf_length == SN9C20X_HEADER_SIZE && sn9c20x_is_magic(buf))
+		return 0;
+	return -1;
+}
+
+/**
+ * @param walk Packets of the URB and position in them
+ * @param chunk Frame data or header found, for SN9C20X_ISOC_DATA and
+ *	SN9C20X_ISOC_HEADER
+ * @param len Length of what was found
+ *
+ * @returns The next sn9c20x_isoc_token of the URB
+ *
+ * @brief Walk the packets of an isochronous URB
+ *
+ * The packets are laid out in the transfer buffer iso_max_frame_size
+ * bytes apart, so the payload of a run of full packets is contiguous and
+ * returned at once. Frame headers come in packets of their own, they and
+ * the packets with errors end a run, as does a short packet. walk->first
+ * is the packet the run starts at, or the header or failed packet.
+ *
+ * Called until it returns SN9C20X_ISOC_END.
+ */
+int sn9c20x_isoc_next(struct sn9c20x_isoc_walk *walk,
+	const unsigned char **chunk, unsigned int *len)
+{
+	const struct usb_iso_packet_descriptor *desc;
+	const unsigned char *run = NULL;
+	const unsigned char *data;
+	unsigned int run_len = 0;
+
+	for (; walk->next < walk->packets; walk->next++) {
+		desc = &walk->desc[walk->next];
+		data = walk->buffer + desc->offset;
+
+		if (desc->status != 0 ||
+		    usb_sn9c20x_detect_frame(data, desc->actual_length) == 0) {
+			/* The packet is looked at again after the run */
+			if (run_len != 0)
+				break;
+			walk->first = walk->next++;
+			*chunk = data;
+			*len = desc->actual_length;
+			return desc->status != 0 ? SN9C20X_ISOC_ERROR :
+						   SN9C20X_ISOC_HEADER;
+		}
+
+		if (desc->actual_length == 0)
+			continue;
+		if (run_len == 0) {
+			run = data;
+			walk->first = walk->next;
+		} else if (run + run_len != data) {
+			break;
+		}
+		run_len += desc->actual_length;
+	}
+
+	if (run_len == 0)
+		return SN9C20X_ISOC_END;
+
+	*chunk = run;
+	*len = run_len;
+	return SN9C20X_ISOC_DATA;
+}
+
+/**
+ * @param match Number of header magic bytes matched
+ *
+ * @returns Number of bytes to give up
+ *
+ * @brief Find how many of the matched bytes can't start the header magic
+ *
+ * After a mismatch, the matched bytes are shifted until the remaining ones
+ * are a prefix of the magic again ("ff ff ff 00" still has a match after
+ * giving up a single byte).
+ */
+static unsigned int sn9c20x_magic_shift(unsigned int match)
+{
+	unsigned int shift;
+
+	for (shift = 1; shift < match; shift++) {
+		if (memcmp(frame_magic + shift, frame_magic,
+			   match - shift) == 0)
+			break;
+	}
+	return shift;
+}
+
+/**
+ * @param parser Parser state
+ * @param data Position in the transfer, moved past what was parsed
+ * @param end End of the transfer
+ * @param chunk Frame data found, for SN9C20X_BULK_DATA
+ * @param len Length of the frame data found
+ *
+ * @returns The next sn9c20x_bulk_token of the stream
+ *
+ * @brief Parse the continuous byte stream of the bulk endpoint
+ *
+ * The bridge sends the frame data followed by a 64 bytes header. Neither
+ * the header nor its magic are aligned on transfers, so the parser keeps
+ * the number of magic bytes matched at the end of a transfer and the
+ * header bytes received so far. Magic bytes held back that turn out not
+ * to be a header are returned as frame data.
+ *
+ * Called until it returns SN9C20X_BULK_END, a complete header is then in
+ * parser->header.
+ */
+int sn9c20x_bulk_next(struct sn9c20x_bulk_parser *parser,
+	const unsigned char **data, const unsigned char *end,
+	const unsigned char **chunk, unsigned int *len)
+{
+	const unsigned char *pos = *data;
+	const unsigned char *magic;
+	unsigned int n;
+
+	while (pos < end) {
+		/* Collect the rest of a header */
+		if (parser->header_len) {
+			n = min_t(unsigned int,
+				  SN9C20X_HEADER_SIZE - parser->header_len,
+				  end - pos);
+			memcpy(parser->header + parser->header_len, pos, n);
+			parser->header_len += n;
+			pos += n;
+			if (parser->header_len == SN9C20X_HEADER_SIZE) {
+				parser->header_len = 0;
+				*data = pos;
+				return SN9C20X_BULK_HEADER;
+			}
+			continue;
+		}
+
+		/* Complete a magic started in the previous transfer */
+		if (parser->match) {
+			while (pos < end &&
+			       parser->match < sizeof(frame_magic)) {
+				if (*pos == frame_magic[parser->match]) {
+					parser->match++;
+					pos++;
+					continue;
+				}
+				n = sn9c20x_magic_shift(parser->match);
+				parser->match -= n;
+				*data = pos;
+				*chunk = frame_magic;
+				*len = n;
+				return SN9C20X_BULK_DATA;
+			}
+			if (parser->match == sizeof(frame_magic)) {
+				memcpy(parser->header, frame_magic,
+				       sizeof(frame_magic));
+				parser->header_len = sizeof(frame_magic);
+				parser->match = 0;
+			}
+			continue;
+		}
+
+		/* Look for the next magic, it can be cut by the end of the
+		 * transfer */
+		magic = pos;
+		while ((magic = memchr(magic, 0xff, end - magic)) != NULL) {
+			if ((size_t)(end - magic) < sizeof(frame_magic)) {
+				if (memcmp(magic, frame_magic, end - magic) == 0)
+					break;
+			} else if (sn9c20x_is_magic(magic)) {
+				break;
+			}
+			magic++;
+		}
+
+		*chunk = pos;
+		if (magic == NULL) {
+			pos = end;
+		} else if ((size_t)(end - magic) < sizeof(frame_magic)) {
+			parser->match = end - magic;
+			pos = end;
+		} else {
+			memcpy(parser->header, magic, sizeof(frame_magic));
+			parser->header_len = sizeof(frame_magic);
+			pos = magic + sizeof(frame_magic);
+		}
+
+		*len = (magic != NULL ? magic : end) - *chunk;
+		if (*len) {
+			*data = pos;
+			return SN9C20X_BULK_DATA;
+		}
+	}
+
+	*data = pos;
+	return SN9C20X_BULK_END;
+}
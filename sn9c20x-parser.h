@@ -0,0 +1,82 @@
+/**
+ * @file sn9c20x-parser.h
+ * @author microdia project
+ *
+ * @brief Parser of the stream sent by the bridge
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef SN9C20X_PARSER_H
+#define SN9C20X_PARSER_H
+
+#include "sn9c20x-api.h"
+
+/**
+ * @struct sn9c20x_bulk_parser
+ *   State of the bulk stream parser kept between transfers
+ */
+struct sn9c20x_bulk_parser {
+	unsigned int match;		/**< Header magic bytes matched so far */
+	unsigned int header_len;	/**< Header bytes received, 0 if none */
+	__u8 header[SN9C20X_HEADER_SIZE];	/**< Header being received */
+};
+
+/**
+ * @enum sn9c20x_bulk_token
+ *   What sn9c20x_bulk_next() found in the stream
+ */
+enum sn9c20x_bulk_token {
+	SN9C20X_BULK_END	= 0,	/**< The transfer is consumed */
+	SN9C20X_BULK_DATA	= 1,	/**< Frame data */
+	SN9C20X_BULK_HEADER	= 2,	/**< A complete frame header */
+};
+
+struct usb_iso_packet_descriptor;
+
+/**
+ * @struct sn9c20x_isoc_walk
+ *   Position in the packets of an isochronous URB
+ */
+struct sn9c20x_isoc_walk {
+	const unsigned char *buffer;	/**< Transfer buffer of the URB */
+	const struct usb_iso_packet_descriptor *desc;	/**< Its packets */
+	int packets;			/**< Number of packets */
+	int next;			/**< Next packet to look at */
+	int first;			/**< First packet of what was found */
+};
+
+/**
+ * @enum sn9c20x_isoc_token
+ *   What sn9c20x_isoc_next() found in the packets
+ */
+enum sn9c20x_isoc_token {
+	SN9C20X_ISOC_END	= 0,	/**< The URB is consumed */
+	SN9C20X_ISOC_DATA	= 1,	/**< Frame data of a run of packets */
+	SN9C20X_ISOC_HEADER	= 2,	/**< A frame header packet */
+	SN9C20X_ISOC_ERROR	= 3,	/**< A packet with an error */
+};
+
+int usb_sn9c20x_detect_frame(const unsigned char *buf,
+	unsigned int buf_length);
+int sn9c20x_isoc_next(struct sn9c20x_isoc_walk *walk,
+	const unsigned char **chunk, unsigned int *len);
+int sn9c20x_bulk_next(struct sn9c20x_bulk_parser *parser,
+	const unsigned char **data, const unsigned char *end,
+	const unsigned char **chunk, unsigned int *len);
+
+#endif
@@ -68,6 +68,15 @@
  *    process waiting on the buffer might restart the dequeue operation
  *    immediately.
  *
+ * 3. The user asked for the latest frame only and falls behind.
+ *
+ *    When the irq queue runs empty, the completion handler takes the oldest
+ *    ready buffer back from the main queue and overwrites it, and dequeuing
+ *    hands the older ready buffers back to the driver so that the newest
+ *    frame is returned. The main queue is then modified from interrupt
+ *    context, so all its operations are protected by the irq spinlock as
+ *    well.
+ *
  */
 
 #include <linux/kernel.h>
@@ -93,6 +102,8 @@ void sn9c20x_queue_init(struct sn9c20x_video_queue *queue)
 	spin_lock_init(&queue->irqlock);
 	INIT_LIST_HEAD(&queue->mainqueue);
 	INIT_LIST_HEAD(&queue->irqqueue);
+	queue->progress = (struct sn9c20x_progress *)
+		get_zeroed_page(GFP_KERNEL);
 }
 
 /**
@@ -106,6 +117,9 @@ void sn9c20x_queue_init(struct sn9c20x_video_queue *queue)
  * filled in URB completion handler.
  *
  * Buffers will be individually mapped, so they must all be page aligned.
+ *
+ * Buffers left allocated by a previous user (see the warm standby) are
+ * reused as is when their number and size match the request.
  */
 int sn9c20x_alloc_buffers(struct sn9c20x_video_queue *queue,
 	unsigned int nbuffers, unsigned int buflength)
@@ -118,6 +132,35 @@ int sn9c20x_alloc_buffers(struct sn9c20x_video_queue *queue,
 
 	mutex_lock(&queue->mutex);
 
+	if (nbuffers != 0) {
+		if (nbuffers < queue->min_buffers)
+			nbuffers = queue->min_buffers;
+		else if (nbuffers > queue->max_buffers)
+			nbuffers = queue->max_buffers;
+	}
+
+	if (nbuffers != 0 && nbuffers == queue->count &&
+	    bufsize == queue->buf_size) {
+		for (i = 0; i < nbuffers; ++i) {
+			if (queue->buffer[i].vma_use_count != 0)
+				break;
+		}
+		if (i == nbuffers) {
+			UDIA_DEBUG("Reusing %d v4l2 buffers\n", nbuffers);
+			INIT_LIST_HEAD(&queue->mainqueue);
+			INIT_LIST_HEAD(&queue->irqqueue);
+			for (i = 0; i < nbuffers; ++i) {
+				queue->buffer[i].state = SN9C20X_BUF_STATE_IDLE;
+				queue->buffer[i].buf.length = buflength;
+				queue->buffer[i].buf.bytesused = 0;
+				queue->buffer[i].buf.sequence = 0;
+				queue->buffer[i].buf.flags = SN9C20X_BUF_FLAGS;
+			}
+			ret = nbuffers;
+			goto done;
+		}
+	}
+
 	ret = sn9c20x_free_buffers(queue);
 	if (ret < 0)
 		goto done;
@@ -126,11 +169,6 @@ int sn9c20x_alloc_buffers(struct sn9c20x_video_queue *queue,
 	if (nbuffers == 0)
 		goto done;
 
-	if (nbuffers < queue->min_buffers)
-		nbuffers = queue->min_buffers;
-	else if (nbuffers > queue->max_buffers)
-		nbuffers = queue->max_buffers;
-
 	/* Decrement the number of buffers until allocation succeeds. */
 	for (; nbuffers >= queue->min_buffers; --nbuffers) {
 		mem = vmalloc_32(nbuffers * bufsize);
@@ -159,7 +197,7 @@ int sn9c20x_alloc_buffers(struct sn9c20x_video_queue *queue,
 		queue->buffer[i].buf.sequence = 0;
 		queue->buffer[i].buf.field = V4L2_FIELD_NONE;
 		queue->buffer[i].buf.memory = V4L2_MEMORY_MMAP;
-		queue->buffer[i].buf.flags = 0;
+		queue->buffer[i].buf.flags = SN9C20X_BUF_FLAGS;
 		init_waitqueue_head(&queue->buffer[i].wait);
 	}
 
@@ -216,6 +254,9 @@ static void __sn9c20x_query_buffer(struct sn9c20x_buffer *buf,
 
 	switch (buf->state) {
 	case SN9C20X_BUF_STATE_ERROR:
+#ifdef V4L2_BUF_FLAG_ERROR
+		v4l2_buf->flags |= V4L2_BUF_FLAG_ERROR;
+#endif
 	case SN9C20X_BUF_STATE_DONE:
 		v4l2_buf->flags |= V4L2_BUF_FLAG_DONE;
 		break;
@@ -306,6 +347,8 @@ int sn9c20x_queue_buffer(struct sn9c20x_video_queue *queue,
 
 	buf->state = SN9C20X_BUF_STATE_QUEUED;
 	buf->buf.bytesused = 0;
+	buf->lost = 0;
+	buf->overflow = 0;
 	list_add_tail(&buf->stream, &queue->mainqueue);
 	list_add_tail(&buf->queue, &queue->irqqueue);
 	spin_unlock_irqrestore(&queue->irqlock, flags);
@@ -333,6 +376,175 @@ static int sn9c20x_queue_waiton(struct sn9c20x_buffer *buf, int nonblocking)
 		buf->state != SN9C20X_BUF_STATE_ACTIVE);
 }
 
+/**
+ * @param buf
+ *
+ * @returns Non-zero if the buffer holds a frame ready to be dequeued
+ */
+static inline int sn9c20x_buffer_ready(struct sn9c20x_buffer *buf)
+{
+	return buf->state == SN9C20X_BUF_STATE_DONE ||
+	       (buf->state == SN9C20X_BUF_STATE_ERROR &&
+		(buf->lost || buf->overflow));
+}
+
+/**
+ * @param queue
+ * @param buf Ready buffer to give back to the driver
+ *
+ * @brief Requeue a ready buffer whose frame is dropped
+ *
+ * The buffer moves to the end of both queues. Must be called with the irq
+ * spinlock held.
+ */
+static void __sn9c20x_queue_recycle(struct sn9c20x_video_queue *queue,
+	struct sn9c20x_buffer *buf)
+{
+	buf->state = SN9C20X_BUF_STATE_QUEUED;
+	buf->buf.bytesused = 0;
+	buf->lost = 0;
+	buf->overflow = 0;
+	list_move_tail(&buf->stream, &queue->mainqueue);
+	list_add_tail(&buf->queue, &queue->irqqueue);
+	queue->reclaimed++;
+}
+
+/**
+ * @param queue
+ *
+ * @returns The buffer to fill next or NULL
+ *
+ * @brief Reclaim the oldest ready buffer if the irq queue is empty
+ *
+ * Only done in latest frame mode. Must be called with the irq spinlock
+ * held.
+ */
+static struct sn9c20x_buffer *__sn9c20x_queue_reclaim(
+	struct sn9c20x_video_queue *queue)
+{
+	struct sn9c20x_buffer *buf, *old;
+
+	if (!list_empty(&queue->irqqueue))
+		return list_first_entry(&queue->irqqueue,
+					struct sn9c20x_buffer, queue);
+
+	if ((queue->flags & (SN9C20X_QUEUE_LATEST_FRAME |
+			     SN9C20X_QUEUE_STREAMING |
+			     SN9C20X_QUEUE_DISCONNECTED)) !=
+	    (SN9C20X_QUEUE_LATEST_FRAME | SN9C20X_QUEUE_STREAMING))
+		return NULL;
+
+	/* The newest ready frame is kept for the application */
+	list_for_each_entry(buf, &queue->mainqueue, stream) {
+		if (sn9c20x_buffer_ready(buf))
+			break;
+	}
+	list_for_each_entry(old, &queue->mainqueue, stream) {
+		if (old == buf || !sn9c20x_buffer_ready(old))
+			continue;
+		__sn9c20x_queue_recycle(queue, buf);
+		return buf;
+	}
+	return NULL;
+}
+
+/**
+ * @param queue
+ *
+ * @returns The buffer to fill or NULL if none is available
+ */
+struct sn9c20x_buffer *sn9c20x_queue_first_buffer(
+	struct sn9c20x_video_queue *queue)
+{
+	struct sn9c20x_buffer *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	buf = __sn9c20x_queue_reclaim(queue);
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+	return buf;
+}
+
+/**
+ * @param queue
+ * @param enable
+ *
+ * @brief Turn the latest frame mode on or off
+ *
+ * In latest frame mode a consumer that falls behind gets the most recent
+ * frame instead of its backlog.
+ */
+void sn9c20x_queue_latest_frame(struct sn9c20x_video_queue *queue,
+	int enable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	if (enable)
+		queue->flags |= SN9C20X_QUEUE_LATEST_FRAME;
+	else
+		queue->flags &= ~SN9C20X_QUEUE_LATEST_FRAME;
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+}
+
+/**
+ * @param queue
+ * @param lines Number of lines between progress updates, 0 disables them
+ * @param bytesperline Line length of the format, 0 if it is compressed
+ *
+ * @brief Set up the sub-frame progress updates
+ */
+void sn9c20x_queue_slices(struct sn9c20x_video_queue *queue,
+	unsigned int lines, unsigned int bytesperline)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	queue->slice_lines = lines;
+	queue->bytesperline = bytesperline;
+	queue->slice_bytes = queue->progress ? lines * bytesperline : 0;
+	queue->slice_next = queue->slice_bytes;
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+}
+
+/**
+ * @param queue
+ * @param buf Buffer being filled
+ *
+ * @brief Publish how much of the frame has been received
+ *
+ * Called from the completion handler each time another slice of lines
+ * arrived, so that applications can start on the top of a frame in
+ * a raw format before its bottom is received. The slices can be turned
+ * off meanwhile, they are checked again under the irq lock.
+ */
+void sn9c20x_queue_progress(struct sn9c20x_video_queue *queue,
+	struct sn9c20x_buffer *buf)
+{
+	struct sn9c20x_progress *progress = queue->progress;
+	__u32 bytesused = buf->buf.bytesused;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	if (queue->slice_bytes == 0 || queue->bytesperline == 0)
+		goto unlock;
+
+	progress->count++;
+	smp_wmb();
+	progress->index = buf->buf.index;
+	progress->sequence = queue->sequence;
+	progress->lines = bytesused / queue->bytesperline;
+	progress->bytesused = bytesused;
+	progress->timestamp = ktime_to_ns(buf->stamp);
+	smp_wmb();
+	progress->count++;
+
+	queue->slice_next = bytesused - bytesused % queue->slice_bytes +
+			    queue->slice_bytes;
+unlock:
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+}
+
 /**
  * @brief Dequeue a video buffer.
  *
@@ -348,7 +560,8 @@ static int sn9c20x_queue_waiton(struct sn9c20x_buffer *buf, int nonblocking)
 int sn9c20x_dequeue_buffer(struct sn9c20x_video_queue *queue,
 	struct v4l2_buffer *v4l2_buf, int nonblocking)
 {
-	struct sn9c20x_buffer *buf;
+	struct sn9c20x_buffer *buf, *next;
+	unsigned long flags;
 	int ret = 0;
 
 	if (v4l2_buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
@@ -366,20 +579,55 @@ int sn9c20x_dequeue_buffer(struct sn9c20x_video_queue *queue,
 		goto done;
 	}
 
-	buf = list_first_entry(&queue->mainqueue, struct sn9c20x_buffer,
-			       stream);
+	/* In latest frame mode the completion handler can take a ready
+	 * buffer back at any time, the buffer waited on is checked again
+	 * once it is ready. */
+	for (;;) {
+		spin_lock_irqsave(&queue->irqlock, flags);
+		buf = list_first_entry(&queue->mainqueue,
+				       struct sn9c20x_buffer, stream);
+		while ((queue->flags & SN9C20X_QUEUE_LATEST_FRAME) &&
+		       (queue->flags & SN9C20X_QUEUE_STREAMING) &&
+		       !list_is_last(&buf->stream, &queue->mainqueue)) {
+			next = list_entry(buf->stream.next,
+					  struct sn9c20x_buffer, stream);
+			if (!sn9c20x_buffer_ready(buf) ||
+			    !sn9c20x_buffer_ready(next))
+				break;
+			__sn9c20x_queue_recycle(queue, buf);
+			buf = next;
+		}
+		spin_unlock_irqrestore(&queue->irqlock, flags);
 
-	ret = sn9c20x_queue_waiton(buf, nonblocking);
-	if (ret < 0)
-		goto done;
+		ret = sn9c20x_queue_waiton(buf, nonblocking);
+		if (ret < 0)
+			goto done;
+
+		spin_lock_irqsave(&queue->irqlock, flags);
+		if (buf->state != SN9C20X_BUF_STATE_QUEUED &&
+		    buf->state != SN9C20X_BUF_STATE_ACTIVE) {
+			list_del(&buf->stream);
+			spin_unlock_irqrestore(&queue->irqlock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&queue->irqlock, flags);
+	}
 
 	UDIA_DEBUG("Dequeuing buffer %u (%u, %u bytes).\n",
 		buf->buf.index, buf->state, buf->buf.bytesused);
 
 	switch (buf->state) {
 	case SN9C20X_BUF_STATE_ERROR:
-		UDIA_WARNING("[W] Corrupted data (transmission error).\n");
-		ret = -EIO;
+		/* Frames with lost or overflowed payload are handed out
+		 * flagged, only cancelled transfers fail */
+		if (buf->lost || buf->overflow) {
+			UDIA_STREAM("Frame %u lost %u transfers, %u bytes "
+				    "overflowed\n", buf->buf.sequence,
+				    buf->lost, buf->overflow);
+		} else {
+			UDIA_WARNING("[W] Corrupted data (transmission error).\n");
+			ret = -EIO;
+		}
 	case SN9C20X_BUF_STATE_DONE:
 		buf->state = SN9C20X_BUF_STATE_IDLE;
 		break;
@@ -394,7 +642,6 @@ int sn9c20x_dequeue_buffer(struct sn9c20x_video_queue *queue,
 		goto done;
 	}
 
-	list_del(&buf->stream);
 	__sn9c20x_query_buffer(buf, v4l2_buf);
 
 done:
@@ -416,6 +663,7 @@ unsigned int sn9c20x_queue_poll(struct sn9c20x_video_queue *queue,
 	struct file *file, poll_table *wait)
 {
 	struct sn9c20x_buffer *buf;
+	unsigned long flags;
 	unsigned int mask = 0;
 
 	mutex_lock(&queue->mutex);
@@ -423,8 +671,10 @@ unsigned int sn9c20x_queue_poll(struct sn9c20x_video_queue *queue,
 		mask |= POLLERR;
 		goto done;
 	}
+	spin_lock_irqsave(&queue->irqlock, flags);
 	buf = list_first_entry(&queue->mainqueue, struct sn9c20x_buffer,
 			       stream);
+	spin_unlock_irqrestore(&queue->irqlock, flags);
 
 	poll_wait(file, &buf->wait, wait);
 	if (buf->state == SN9C20X_BUF_STATE_DONE ||
@@ -470,10 +720,15 @@ int sn9c20x_queue_enable(struct sn9c20x_video_queue *queue, int enable)
 			goto done;
 		}
 		queue->sequence = 0;
+		queue->last_stamp = ktime_set(0, 0);
+		queue->interval = 0;
+		queue->jitter = 0;
+		queue->jitter_max = 0;
 		queue->flags |= SN9C20X_QUEUE_STREAMING;
 	} else {
 		sn9c20x_queue_cancel(queue, 0);
 		INIT_LIST_HEAD(&queue->mainqueue);
+		queue->read_buffer = NULL;
 
 		for (i = 0; i < queue->count; ++i)
 			queue->buffer[i].state = SN9C20X_BUF_STATE_IDLE;
@@ -486,6 +741,36 @@ done:
 	return ret;
 }
 
+/**
+ * @brief Update the frame timing statistics
+ *
+ * @param queue
+ * @param stamp Timestamp of the frame just completed
+ *
+ * Keeps running averages (1/16 weight) of the interval between frame
+ * timestamps and of its deviation, the latter being the timestamp jitter.
+ * Must be called with the irq lock held.
+ */
+static void sn9c20x_queue_update_timing(struct sn9c20x_video_queue *queue,
+	ktime_t stamp)
+{
+	s64 delta, deviation;
+
+	if (ktime_to_ns(queue->last_stamp) != 0) {
+		delta = ktime_to_ns(ktime_sub(stamp, queue->last_stamp));
+		if (queue->interval == 0)
+			queue->interval = delta;
+		deviation = delta - queue->interval;
+		if (deviation < 0)
+			deviation = -deviation;
+		queue->interval += (delta - queue->interval) >> 4;
+		queue->jitter += (deviation - queue->jitter) >> 4;
+		if (deviation > queue->jitter_max)
+			queue->jitter_max = deviation;
+	}
+	queue->last_stamp = stamp;
+}
+
 /**
  * @brief Cancel the video buffers queue.
  *
@@ -539,25 +824,84 @@ struct sn9c20x_buffer *sn9c20x_queue_next_buffer(
 	struct sn9c20x_buffer *nextbuf;
 	unsigned long flags;
 
-	if ((queue->flags & SN9C20X_QUEUE_DROP_INCOMPLETE) &&
-	    buf->buf.length != buf->buf.bytesused) {
+	/* Recycled frames still use up a sequence number so that the
+	 * gap can be seen by the application. */
+	if (((queue->flags & SN9C20X_QUEUE_DROP_INCOMPLETE) &&
+	     buf->buf.length != buf->buf.bytesused) ||
+	    ((queue->flags & SN9C20X_QUEUE_DROP_CORRUPTED) &&
+	     (buf->lost || buf->overflow))) {
 		buf->state = SN9C20X_BUF_STATE_QUEUED;
 		buf->buf.bytesused = 0;
+		buf->lost = 0;
+		buf->overflow = 0;
+		queue->sequence++;
 		return buf;
 	}
 
+	if (buf->lost || buf->overflow)
+		buf->state = SN9C20X_BUF_STATE_ERROR;
+
 	spin_lock_irqsave(&queue->irqlock, flags);
 	list_del(&buf->queue);
-	if (!list_empty(&queue->irqqueue))
-		nextbuf = list_first_entry(&queue->irqqueue,
-					   struct sn9c20x_buffer, queue);
-	else
-		nextbuf = NULL;
+	nextbuf = __sn9c20x_queue_reclaim(queue);
+	sn9c20x_queue_update_timing(queue, buf->stamp);
+	/* URBs still receiving into the buffer past the end of the frame
+	 * hold it back, sn9c20x_queue_release_window() hands it over. */
+	if (buf->windows) {
+		buf->deferred = buf->state;
+		buf->state = SN9C20X_BUF_STATE_ACTIVE;
+	}
 	spin_unlock_irqrestore(&queue->irqlock, flags);
 
 	buf->buf.sequence = queue->sequence++;
-	do_gettimeofday(&buf->buf.timestamp);
+	buf->buf.timestamp = ktime_to_timeval(buf->stamp);
 
-	wake_up(&buf->wait);
+	if (buf->deferred == SN9C20X_BUF_STATE_IDLE)
+		wake_up(&buf->wait);
 	return nextbuf;
 }
+
+/**
+ * @param queue
+ * @param buf Buffer an URB received into
+ *
+ * @brief Account for the completion of a zero-copy receive window
+ *
+ * Hands the buffer over to the application if its frame was completed
+ * while the window was in flight. Must be called with the irqlock held.
+ */
+void sn9c20x_queue_release_window(struct sn9c20x_video_queue *queue,
+	struct sn9c20x_buffer *buf)
+{
+	if (--buf->windows != 0)
+		return;
+
+	buf->window_end = 0;
+	if (buf->deferred != SN9C20X_BUF_STATE_IDLE) {
+		buf->state = buf->deferred;
+		buf->deferred = SN9C20X_BUF_STATE_IDLE;
+		wake_up(&buf->wait);
+	}
+}
+
+/**
+ * @param queue
+ *
+ * @brief Forget all the zero-copy receive windows
+ *
+ * Called once the URBs have been killed, their windows won't complete.
+ */
+void sn9c20x_queue_reset_windows(struct sn9c20x_video_queue *queue)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	for (i = 0; i < queue->count; ++i) {
+		if (queue->buffer[i].windows == 0)
+			continue;
+		queue->buffer[i].windows = 1;
+		sn9c20x_queue_release_window(queue, &queue->buffer[i]);
+	}
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+}
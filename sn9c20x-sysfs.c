@@ -118,10 +118,16 @@ static ssize_t show_videostatus(struct device *class, struct device_attribute *a
 	return sprintf(buf,
 		"Overflow frames    : %d\n"
 		"Incomplete frames  : %d\n"
-		"Dropped frames     : %d\n",
+		"Dropped frames     : %d\n"
+		"Overwritten frames : %u\n"
+		"Lost transfers     : %d\n"
+		"Time to 1st frame  : %d us\n",
 		dev->vframes_overflow,
 		dev->vframes_incomplete,
-		dev->vframes_dropped);
+		dev->vframes_dropped,
+		dev->queue.reclaimed,
+		dev->vpackets_lost,
+		dev->ttff);
 }
 
 
@@ -205,6 +211,46 @@ static ssize_t show_information(struct device *class, struct device_attribute *a
 }
 
 
+/**
+ * @brief show_sensor
+ *
+ * @param class Class device
+ * @param attr
+ * @retval buf Adress of buffer with the sensor name and I2C address
+ *
+ * @returns Size of buffer
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+static ssize_t show_sensor(struct class_device *class, char *buf)
+#else
+static ssize_t show_sensor(struct device *class, struct device_attribute *attr, char *buf)
+#endif
+{
+	static const char * const names[] = {
+		[PROBE_SENSOR] = "none",
+		[OV9650_SENSOR] = "OV9650",
+		[OV9655_SENSOR] = "OV9655",
+		[SOI968_SENSOR] = "SOI968",
+		[OV7660_SENSOR] = "OV7660",
+		[OV7670_SENSOR] = "OV7670",
+		[MT9M111_SENSOR] = "MT9M111",
+		[MT9V111_SENSOR] = "MT9V111",
+		[MT9V011_SENSOR] = "MT9V011",
+		[MT9M001_SENSOR] = "MT9M001",
+		[HV7131R_SENSOR] = "HV7131R",
+		[MT9V112_SENSOR] = "MT9V112",
+	};
+	struct video_device *vdev = to_video_device(class);
+	struct usb_sn9c20x *dev = video_get_drvdata(vdev);
+	int sensor = dev->camera.sensor;
+
+	if (sensor < 0 || sensor >= ARRAY_SIZE(names) || names[sensor] == NULL)
+		return sprintf(buf, "unknown 0x%02x\n", dev->camera.address);
+
+	return sprintf(buf, "%s 0x%02x\n", names[sensor], dev->camera.address);
+}
+
+
 /**
  * @brief show_fps
  *
@@ -931,10 +977,67 @@ static ssize_t store_autowhitebalance(struct device *class, struct device_attrib
 	return strlen(buf);
 }
 
+
+/**
+ * @brief show_standby_timeout
+ *
+ * @param class Class device
+ * @param attr
+ * @retval buf Adress of buffer with the 'standby_timeout' value
+ *
+ * @returns Size of buffer
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+static ssize_t show_standby_timeout(struct class_device *class, char *buf)
+#else
+static ssize_t show_standby_timeout(struct device *class, struct device_attribute *attr, char *buf)
+#endif
+{
+	struct video_device *vdev = to_video_device(class);
+	struct usb_sn9c20x *dev = video_get_drvdata(vdev);
+
+	return sprintf(buf, "%u\n", dev->standby_timeout);
+}
+
+
+/**
+ * @brief store_standby_timeout
+ *
+ * @param class Class device
+ * @param buf Buffer
+ * @param count Counter
+ * @param attr
+ *
+ * @returns Size of buffer
+ *
+ * Writing 0 disables the warm standby and leaves it at once if the
+ * device is currently in standby.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+static ssize_t store_standby_timeout(struct class_device *class, const char *buf, size_t count)
+#else
+static ssize_t store_standby_timeout(struct device *class, struct device_attribute *attr, const char *buf, size_t count)
+#endif
+{
+	unsigned long value;
+	struct video_device *vdev = to_video_device(class);
+	struct usb_sn9c20x *dev = video_get_drvdata(vdev);
+
+	if (strict_strtoul(buf, 10, &value) < 0)
+		return -EINVAL;
+
+	dev->standby_timeout = value;
+	if (value == 0)
+		flush_delayed_work(&dev->standby_work);
+
+	return strlen(buf);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
 static CLASS_DEVICE_ATTR(release, S_IRUGO, show_release, NULL);							/**< Release value */
 static CLASS_DEVICE_ATTR(videostatus, S_IRUGO, show_videostatus, NULL);						/**< Video status */
 static CLASS_DEVICE_ATTR(information, S_IRUGO, show_information, NULL);						/**< Information */
+static CLASS_DEVICE_ATTR(sensor, S_IRUGO, show_sensor, NULL);							/**< Sensor and I2C address */
 static CLASS_DEVICE_ATTR(fps, S_IRUGO, show_fps, NULL);								/**< FPS value */
 static CLASS_DEVICE_ATTR(brightness, S_IRUGO | S_IWUGO, show_brightness, store_brightness);			/**< Brightness value */
 static CLASS_DEVICE_ATTR(exposure, S_IRUGO | S_IWUGO, show_exposure, store_exposure);				/**< Exposure value */
@@ -948,10 +1051,12 @@ static CLASS_DEVICE_ATTR(hflip, S_IRUGO | S_IWUGO, show_hflip, store_hflip);
 static CLASS_DEVICE_ATTR(vflip, S_IRUGO | S_IWUGO, show_vflip, store_vflip);					/**< Vertical flip value */
 static CLASS_DEVICE_ATTR(auto_exposure, S_IRUGO | S_IWUGO, show_autoexposure, store_autoexposure);		/**< Automatic exposure control value */
 static CLASS_DEVICE_ATTR(auto_whitebalance, S_IRUGO | S_IWUGO, show_autowhitebalance, store_autowhitebalance);	/**< Automatic whitebalance control value */
+static CLASS_DEVICE_ATTR(standby_timeout, S_IRUGO | S_IWUSR, show_standby_timeout, store_standby_timeout);	/**< Warm standby timeout (ms) */
 #else
 static DEVICE_ATTR(release, S_IRUGO, show_release, NULL);							/**< Release value */
 static DEVICE_ATTR(videostatus, S_IRUGO, show_videostatus, NULL);						/**< Video status */
 static DEVICE_ATTR(information, S_IRUGO, show_information, NULL);						/**< Information */
+static DEVICE_ATTR(sensor, S_IRUGO, show_sensor, NULL);								/**< Sensor and I2C address */
 static DEVICE_ATTR(fps, S_IRUGO, show_fps, NULL);								/**< FPS value */
 static DEVICE_ATTR(brightness, S_IRUGO | S_IWUGO, show_brightness, store_brightness);				/**< Brightness value */
 static DEVICE_ATTR(exposure, S_IRUGO | S_IWUGO, show_exposure, store_exposure);					/**< Exposure value */
@@ -965,6 +1070,7 @@ static DEVICE_ATTR(hflip, S_IRUGO | S_IWUGO, show_hflip, store_hflip);						/**<
 static DEVICE_ATTR(vflip, S_IRUGO | S_IWUGO, show_vflip, store_vflip);						/**< Vertical flip value */
 static DEVICE_ATTR(auto_exposure, S_IRUGO | S_IWUGO, show_autoexposure, store_autoexposure);			/**< Automatic exposure control value */
 static DEVICE_ATTR(auto_whitebalance, S_IRUGO | S_IWUGO, show_autowhitebalance, store_autowhitebalance);	/**< Automatic whitebalance control value */
+static DEVICE_ATTR(standby_timeout, S_IRUGO | S_IWUSR, show_standby_timeout, store_standby_timeout);	/**< Warm standby timeout (ms) */
 #endif
 
 
@@ -985,6 +1091,7 @@ int sn9c20x_create_sysfs_files(struct video_device *vdev)
 	ret = video_device_create_file(vdev, &class_device_attr_release);
 	ret = video_device_create_file(vdev, &class_device_attr_videostatus);
 	ret = video_device_create_file(vdev, &class_device_attr_information);
+	ret = video_device_create_file(vdev, &class_device_attr_sensor);
 	ret = video_device_create_file(vdev, &class_device_attr_fps);
 	ret = video_device_create_file(vdev, &class_device_attr_brightness);
 	ret = video_device_create_file(vdev, &class_device_attr_exposure);
@@ -998,10 +1105,12 @@ int sn9c20x_create_sysfs_files(struct video_device *vdev)
 	ret = video_device_create_file(vdev, &class_device_attr_vflip);
 	ret = video_device_create_file(vdev, &class_device_attr_auto_exposure);
 	ret = video_device_create_file(vdev, &class_device_attr_auto_whitebalance);
+	ret = video_device_create_file(vdev, &class_device_attr_standby_timeout);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 27)
 	ret = video_device_create_file(vdev, &dev_attr_release);
 	ret = video_device_create_file(vdev, &dev_attr_videostatus);
 	ret = video_device_create_file(vdev, &dev_attr_information);
+	ret = video_device_create_file(vdev, &dev_attr_sensor);
 	ret = video_device_create_file(vdev, &dev_attr_fps);
 	ret = video_device_create_file(vdev, &dev_attr_brightness);
 	ret = video_device_create_file(vdev, &dev_attr_exposure);
@@ -1015,10 +1124,12 @@ int sn9c20x_create_sysfs_files(struct video_device *vdev)
 	ret = video_device_create_file(vdev, &dev_attr_vflip);
 	ret = video_device_create_file(vdev, &dev_attr_auto_exposure);
 	ret = video_device_create_file(vdev, &dev_attr_auto_whitebalance);
+	ret = video_device_create_file(vdev, &dev_attr_standby_timeout);
 #else
 	ret = device_create_file(&vdev->dev, &dev_attr_release);
 	ret = device_create_file(&vdev->dev, &dev_attr_videostatus);
 	ret = device_create_file(&vdev->dev, &dev_attr_information);
+	ret = device_create_file(&vdev->dev, &dev_attr_sensor);
 	ret = device_create_file(&vdev->dev, &dev_attr_fps);
 	ret = device_create_file(&vdev->dev, &dev_attr_brightness);
 	ret = device_create_file(&vdev->dev, &dev_attr_exposure);
@@ -1032,6 +1143,7 @@ int sn9c20x_create_sysfs_files(struct video_device *vdev)
 	ret = device_create_file(&vdev->dev, &dev_attr_vflip);
 	ret = device_create_file(&vdev->dev, &dev_attr_auto_exposure);
 	ret = device_create_file(&vdev->dev, &dev_attr_auto_whitebalance);
+	ret = device_create_file(&vdev->dev, &dev_attr_standby_timeout);
 #endif
 	return ret;
 }
@@ -1052,6 +1164,7 @@ void sn9c20x_remove_sysfs_files(struct video_device *vdev)
 	video_device_remove_file(vdev, &class_device_attr_release);
 	video_device_remove_file(vdev, &class_device_attr_videostatus);
 	video_device_remove_file(vdev, &class_device_attr_information);
+	video_device_remove_file(vdev, &class_device_attr_sensor);
 	video_device_remove_file(vdev, &class_device_attr_fps);
 	video_device_remove_file(vdev, &class_device_attr_brightness);
 	video_device_remove_file(vdev, &class_device_attr_exposure);
@@ -1065,10 +1178,12 @@ void sn9c20x_remove_sysfs_files(struct video_device *vdev)
 	video_device_remove_file(vdev, &class_device_attr_vflip);
 	video_device_remove_file(vdev, &class_device_attr_auto_exposure);
 	video_device_remove_file(vdev, &class_device_attr_auto_whitebalance);
+	video_device_remove_file(vdev, &class_device_attr_standby_timeout);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 27)
 	video_device_remove_file(vdev, &dev_attr_release);
 	video_device_remove_file(vdev, &dev_attr_videostatus);
 	video_device_remove_file(vdev, &dev_attr_information);
+	video_device_remove_file(vdev, &dev_attr_sensor);
 	video_device_remove_file(vdev, &dev_attr_fps);
 	video_device_remove_file(vdev, &dev_attr_brightness);
 	video_device_remove_file(vdev, &dev_attr_exposure);
@@ -1082,10 +1197,12 @@ void sn9c20x_remove_sysfs_files(struct video_device *vdev)
 	video_device_remove_file(vdev, &dev_attr_vflip);
 	video_device_remove_file(vdev, &dev_attr_auto_exposure);
 	video_device_remove_file(vdev, &dev_attr_auto_whitebalance);
+	video_device_remove_file(vdev, &dev_attr_standby_timeout);
 #else
 	device_remove_file(&vdev->dev, &dev_attr_release);
 	device_remove_file(&vdev->dev, &dev_attr_videostatus);
 	device_remove_file(&vdev->dev, &dev_attr_information);
+	device_remove_file(&vdev->dev, &dev_attr_sensor);
 	device_remove_file(&vdev->dev, &dev_attr_fps);
 	device_remove_file(&vdev->dev, &dev_attr_brightness);
 	device_remove_file(&vdev->dev, &dev_attr_exposure);
@@ -1099,6 +1216,7 @@ void sn9c20x_remove_sysfs_files(struct video_device *vdev)
 	device_remove_file(&vdev->dev, &dev_attr_vflip);
 	device_remove_file(&vdev->dev, &dev_attr_auto_exposure);
 	device_remove_file(&vdev->dev, &dev_attr_auto_whitebalance);
+	device_remove_file(&vdev->dev, &dev_attr_standby_timeout);
 #endif
 }
 
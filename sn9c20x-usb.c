@@ -37,11 +37,11 @@
 #include <linux/kref.h>
 #include <linux/stat.h>
 #include <linux/usb.h>
+#include <linux/vmalloc.h>
+#include <linux/scatterlist.h>
 #include <media/v4l2-common.h>
 
 #ifdef CONFIG_SN9C20X_EVDEV
-#include <linux/kthread.h>
-#include <linux/freezer.h>
 #include <linux/usb/input.h>
 #endif
 
@@ -62,6 +62,21 @@ static __u8 fps = 25;
  */
 static __u8 bulk;
 
+/**
+ * @var bulk_size
+ *   Module parameter to set the size (in KB) of the bulk URBs on hosts
+ *   supporting scatter-gather (0 sizes them from the frame size)
+ */
+static unsigned int bulk_size;
+
+/**
+ * @var zero_copy
+ *   Module parameter to receive uncompressed bulk streams straight into the
+ *   video buffers, the host controller must accept scatter-gather elements
+ *   of any length (xHCI does). Ignored before Linux 3.13.
+ */
+static __u8 zero_copy;
+
 /**
  * @var jpeg
  *  Module parameter to enable/disable JPEG format
@@ -164,6 +179,28 @@ static __u8 min_buffers = 2;
  */
 static __u8 max_buffers = 5;
 
+/**
+ * @var drop_corrupted
+ *   Module parameter to drop the frames which lost payload instead of
+ *   handing them out flagged as erroneous
+ */
+static __u8 drop_corrupted;
+
+/**
+ * @var standby_timeout
+ *   Module parameter to set the time (in ms) the URBs and image buffers
+ *   are kept after the stream stopped (0 disables the warm standby)
+ */
+static unsigned int standby_timeout;
+
+/**
+ * @var watchdog
+ *   Module parameter to set the number of frame intervals without a frame
+ *   after which the stream is recovered (0 disables the watchdog). An
+ *   exposure longer than the nominal interval counts as the interval.
+ */
+static __u8 watchdog = 10;
+
 /**
  * @var auto_exposure
  *   Module parameter to set the exposure
@@ -179,9 +216,17 @@ static __u8 auto_gain;
 
 /**
  * @var auto_whitebalance
- *   Module parameter to set the auto-whitebalance
+ *   Module parameter to set the auto-whitebalance, 2 turns it on only for
+ *   sensors balancing themselves
+ */
+static __u8 auto_whitebalance = 2;
+
+/**
+ * @var power_line
+ *   Module parameter to set the mains frequency flicker is avoided for,
+ *   -1 leaves the banding filter of the sensor init table
  */
-static __u8 auto_whitebalance = 1;
+static int power_line = -1;
 
 /**
  * @var log_level
@@ -287,8 +332,6 @@ static struct usb_device_id sn9c20x_table[] = {
 
 MODULE_DEVICE_TABLE(usb, sn9c20x_table);		/**< Define the supported devices */
 
-DEFINE_MUTEX(open_lock); /**< Define global mutex */
-
 struct usb_endpoint_descriptor *find_endpoint(struct usb_host_interface *alts,
 		__u8 epaddr)
 {
@@ -305,6 +348,27 @@ struct usb_endpoint_descriptor *find_endpoint(struct usb_host_interface *alts,
 
 	return NULL;
 }
+/**
+ * @param surb URB descriptor
+ *
+ * @brief Free the transfer buffer of an URB
+ */
+static void usb_sn9c20x_free_urb_data(struct sn9c20x_urb *surb)
+{
+	if (surb->data == NULL)
+		return;
+
+	if (is_vmalloc_addr(surb->data)) {
+		sg_free_table(&surb->sgt);
+		sg_free_table(&surb->wsgt);
+		vfree(surb->data);
+	} else {
+		kfree(surb->data);
+	}
+	surb->data = NULL;
+	surb->size = 0;
+}
+
 /**
  * @param dev Device structure
  * @param ep Usb endpoint structure
@@ -354,6 +418,8 @@ int usb_sn9c20x_isoc_init(struct usb_sn9c20x *dev,
 			urb->iso_frame_desc[j].length = iso_max_frame_size;
 		}
 
+		if (dev->urbs[i].size != urb->transfer_buffer_length)
+			usb_sn9c20x_free_urb_data(&dev->urbs[i]);
 		if (dev->urbs[i].data == NULL) {
 			dev->urbs[i].data = kzalloc(urb->transfer_buffer_length,
 						    GFP_KERNEL);
@@ -361,6 +427,7 @@ int usb_sn9c20x_isoc_init(struct usb_sn9c20x *dev,
 				usb_sn9c20x_uninit_urbs(dev, 1);
 				return -ENOMEM;
 			}
+			dev->urbs[i].size = urb->transfer_buffer_length;
 		}
 		urb->transfer_buffer = dev->urbs[i].data;
 		dev->urbs[i].urb = urb;
@@ -369,6 +436,89 @@ int usb_sn9c20x_isoc_init(struct usb_sn9c20x *dev,
 	return 0;
 }
 
+/**
+ * @param surb URB descriptor
+ * @param size Size of the transfer buffer, multiple of PAGE_SIZE
+ *
+ * @returns 0 or negative error code
+ *
+ * @brief Allocate a large transfer buffer as a scatter-gather list
+ *
+ * The buffer is virtually contiguous so that the stream parser can walk
+ * it, the host controller gets the list of its pages. A second list is
+ * kept for the zero-copy receive windows.
+ */
+static int usb_sn9c20x_alloc_sg_data(struct sn9c20x_urb *surb,
+	unsigned int size)
+{
+	struct scatterlist *sg;
+	unsigned int npages = size >> PAGE_SHIFT;
+	unsigned int i;
+	int ret;
+
+	surb->data = vmalloc(size);
+	if (surb->data == NULL)
+		return -ENOMEM;
+
+	ret = sg_alloc_table(&surb->sgt, npages, GFP_KERNEL);
+	if (ret < 0) {
+		vfree(surb->data);
+		surb->data = NULL;
+		return ret;
+	}
+
+	/* A window in a video buffer doesn't start on a page boundary */
+	ret = sg_alloc_table(&surb->wsgt, npages + 1, GFP_KERNEL);
+	if (ret < 0) {
+		sg_free_table(&surb->sgt);
+		vfree(surb->data);
+		surb->data = NULL;
+		return ret;
+	}
+
+	for_each_sg(surb->sgt.sgl, sg, npages, i)
+		sg_set_page(sg, vmalloc_to_page(surb->data + i * PAGE_SIZE),
+			    PAGE_SIZE, 0);
+
+	surb->size = size;
+	return 0;
+}
+
+/**
+ * @param dev Device structure
+ * @param psize Maximum packet size of the bulk endpoint
+ *
+ * @returns Size of the bulk URBs
+ *
+ * @brief Choose the size of the bulk URBs
+ *
+ * Hosts able to do scatter-gather get large URBs, sized from the
+ * bulk_size parameter or else from a quarter of the frame size, to cut
+ * down the number of completions per frame. Other hosts keep small
+ * contiguous buffers.
+ */
+static unsigned int usb_sn9c20x_bulk_size(struct usb_sn9c20x *dev,
+	__u16 psize)
+{
+	unsigned int min_size = psize * ISO_FRAMES_PER_DESC;
+	unsigned int size;
+
+	if (dev->udev->bus->sg_tablesize == 0)
+		return min_size;
+
+	if (bulk_size)
+		size = bulk_size * 1024;
+	else
+		size = dev->vsettings.format.sizeimage / 4;
+
+	size = PAGE_ALIGN(clamp_t(unsigned int, size, min_size,
+				  BULK_URB_MAX_SIZE));
+	if ((size >> PAGE_SHIFT) > dev->udev->bus->sg_tablesize)
+		return min_size;
+
+	return size;
+}
+
 int usb_sn9c20x_bulk_init(struct usb_sn9c20x *dev,
 	struct usb_endpoint_descriptor *ep)
 {
@@ -376,21 +526,35 @@ int usb_sn9c20x_bulk_init(struct usb_sn9c20x *dev,
 	unsigned int pipe, i;
 	__u16 psize;
 	__u32 size;
+	int ret;
 	psize = max_packet_sz(le16_to_cpu(ep->wMaxPacketSize));
-	size = psize * ISO_FRAMES_PER_DESC;
+	size = usb_sn9c20x_bulk_size(dev, psize);
 	pipe = usb_rcvbulkpipe(dev->udev, ep->bEndpointAddress);
 
+	UDIA_DEBUG("Bulk URBs of %u bytes\n", size);
+
 	for (i = 0; i < MAX_URBS; ++i) {
 		urb = usb_alloc_urb(0, GFP_KERNEL);
 		if (urb == NULL) {
 			usb_sn9c20x_uninit_urbs(dev, 1);
 			return -ENOMEM;
 		}
+		dev->urbs[i].urb = urb;
+
+		if (dev->urbs[i].size != size)
+			usb_sn9c20x_free_urb_data(&dev->urbs[i]);
 		if (dev->urbs[i].data == NULL) {
-			dev->urbs[i].data = kzalloc(size, GFP_KERNEL);
-			if (dev->urbs[i].data == NULL) {
+			if (size > psize * ISO_FRAMES_PER_DESC) {
+				ret = usb_sn9c20x_alloc_sg_data(&dev->urbs[i],
+								size);
+			} else {
+				dev->urbs[i].data = kzalloc(size, GFP_KERNEL);
+				dev->urbs[i].size = size;
+				ret = dev->urbs[i].data ? 0 : -ENOMEM;
+			}
+			if (ret < 0) {
 				usb_sn9c20x_uninit_urbs(dev, 1);
-				return -ENOMEM;
+				return ret;
 			}
 		}
 
@@ -398,13 +562,179 @@ int usb_sn9c20x_bulk_init(struct usb_sn9c20x *dev,
 				  dev->urbs[i].data, size,
 				  usb_sn9c20x_completion_handler,
 				  dev);
-
-		dev->urbs[i].urb = urb;
+		if (is_vmalloc_addr(dev->urbs[i].data)) {
+			urb->sg = dev->urbs[i].sgt.sgl;
+			urb->num_sgs = dev->urbs[i].sgt.nents;
+		}
 	}
 
 	return 0;
 }
 
+/**
+ * @param dev Device structure
+ *
+ * @returns 1 if the bulk URBs can receive into the video buffers
+ */
+static int usb_sn9c20x_use_zero_copy(struct usb_sn9c20x *dev)
+{
+	if (!zero_copy || !bulk || dev->urbs[0].wsgt.sgl == NULL)
+		return 0;
+
+	/* The offset of the data in the frame is only known in advance
+	 * for frames of a fixed size. */
+	if (dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG)
+		return 0;
+
+	if (dev->urbs[0].wsgt.orig_nents > SG_MAX_SINGLE_ALLOC)
+		return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+	if (!dev->udev->bus->no_sg_constraint)
+		return 0;
+	return 1;
+#else
+	/* Older kernels can't tell whether the host controller needs
+	 * elements aligned on the packet size */
+	UDIA_DEBUG("Zero-copy needs Linux 3.13 or newer\n");
+	return 0;
+#endif
+}
+
+/**
+ * @param surb URB to point at its own transfer buffer
+ */
+static void usb_sn9c20x_bounce(struct sn9c20x_urb *surb)
+{
+	surb->urb->transfer_buffer = surb->data;
+	surb->urb->sg = surb->sgt.sgl;
+	surb->urb->num_sgs = surb->sgt.nents;
+}
+
+/**
+ * @param dev Device structure
+ * @param surb URB to point at the video buffer
+ * @param buf Buffer to receive into
+ * @param pos Offset in the buffer
+ */
+static void usb_sn9c20x_map_window(struct usb_sn9c20x *dev,
+	struct sn9c20x_urb *surb, struct sn9c20x_buffer *buf,
+	unsigned int pos)
+{
+	struct scatterlist *sg = surb->wsgt.sgl;
+	void *addr = dev->queue.mem + buf->buf.m.offset + pos;
+	unsigned int len = surb->size;
+	unsigned int n = 0;
+	unsigned int chunk;
+
+	sg_init_table(sg, surb->wsgt.orig_nents);
+	surb->urb->transfer_buffer = addr;
+
+	while (len) {
+		chunk = min_t(unsigned int, len,
+			      PAGE_SIZE - offset_in_page(addr));
+		sg_set_page(&sg[n++], vmalloc_to_page(addr), chunk,
+			    offset_in_page(addr));
+		addr += chunk;
+		len -= chunk;
+	}
+	sg_mark_end(&sg[n - 1]);
+
+	surb->urb->sg = sg;
+	surb->urb->num_sgs = n;
+}
+
+/**
+ * @param dev Device structure
+ * @param surb URB about to be resubmitted
+ *
+ * @brief Point a bulk URB at the part of a video buffer it will receive
+ *
+ * Frames in uncompressed formats have a fixed size, so where the data of
+ * an URB lands in the frames can be predicted from the position of the
+ * parser and the URBs already in flight. An URB whose data falls inside
+ * the frame of a queued buffer receives straight into it, the others
+ * (frame headers, no buffer queued) use their own transfer buffer. A wrong
+ * guess only costs a copy, the parser moves the data where it belongs.
+ *
+ * Windows into a buffer never overlap, and a buffer completed while
+ * windows into it are in flight is only handed over once they completed.
+ */
+static void usb_sn9c20x_next_window(struct usb_sn9c20x *dev,
+	struct sn9c20x_urb *surb)
+{
+	struct sn9c20x_video_queue *queue = &dev->queue;
+	struct sn9c20x_buffer *buf = NULL;
+	unsigned int frame = dev->vsettings.format.sizeimage;
+	unsigned int pos;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	if (surb->window != NULL) {
+		sn9c20x_queue_release_window(queue, surb->window);
+		surb->window = NULL;
+	}
+
+	if (list_empty(&queue->irqqueue))
+		goto unlock;
+
+	buf = list_first_entry(&queue->irqqueue, struct sn9c20x_buffer,
+			       queue);
+	if (dev->parser.header_len)
+		pos = frame + dev->parser.header_len;
+	else
+		pos = buf->buf.bytesused + dev->parser.match;
+	pos += (MAX_URBS - 1) * surb->size;
+
+	while (pos >= frame + SN9C20X_HEADER_SIZE) {
+		pos -= frame + SN9C20X_HEADER_SIZE;
+		if (list_is_last(&buf->queue, &queue->irqqueue)) {
+			buf = NULL;
+			goto unlock;
+		}
+		buf = list_entry(buf->queue.next, struct sn9c20x_buffer,
+				 queue);
+	}
+
+	if (pos + surb->size > frame || pos < buf->window_end) {
+		buf = NULL;
+		goto unlock;
+	}
+
+	buf->windows++;
+	buf->window_end = pos + surb->size;
+	surb->window = buf;
+unlock:
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
+	if (buf != NULL)
+		usb_sn9c20x_map_window(dev, surb, buf, pos);
+	else
+		usb_sn9c20x_bounce(surb);
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @brief Forget the receive windows of killed URBs
+ */
+static void usb_sn9c20x_drop_windows(struct usb_sn9c20x *dev)
+{
+	int i, dropped = 0;
+
+	for (i = 0; i < MAX_URBS; i++) {
+		if (dev->urbs[i].window == NULL)
+			continue;
+		dev->urbs[i].window = NULL;
+		if (dev->urbs[i].urb != NULL)
+			usb_sn9c20x_bounce(&dev->urbs[i]);
+		dropped = 1;
+	}
+
+	if (dropped)
+		sn9c20x_queue_reset_windows(&dev->queue);
+}
+
 int usb_sn9c20x_init_urbs(struct usb_sn9c20x *dev)
 {
 	int ret, i;
@@ -412,9 +742,18 @@ int usb_sn9c20x_init_urbs(struct usb_sn9c20x *dev)
 	struct usb_endpoint_descriptor *ep;
 	struct usb_interface *intf = dev->interface;
 
+	/* URBs left over by a warm standby only need to be resubmitted,
+	 * the bridge and the alternate setting are still configured. */
+	if (dev->urbs[0].urb != NULL) {
+		UDIA_DEBUG("Resubmitting URBs kept in standby\n");
+		dev->profile.cur.warm = 1;
+		goto submit;
+	}
+
 	ret = usb_sn9c20x_control_read(dev, 0x1061, &value, 1);
 	if (ret < 0)
 		return ret;
+	usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_BRIDGE);
 
 	if (!bulk) {
 		if (bandwidth > 8)
@@ -424,14 +763,16 @@ int usb_sn9c20x_init_urbs(struct usb_sn9c20x *dev)
 		if (ep == NULL)
 			return -EIO;
 
-		ret = usb_set_interface(dev->udev, 0, bandwidth);
+		ret = usb_sn9c20x_set_interface(dev, bandwidth);
 		if (ret < 0)
 			return ret;
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_ALTSETTING);
 
 		value |= 0x01;
 		ret = usb_sn9c20x_control_write(dev, 0x1061, &value, 1);
 		if (ret < 0)
 			return ret;
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_BRIDGE);
 
 		ret = usb_sn9c20x_isoc_init(dev, ep);
 	} else {
@@ -439,26 +780,35 @@ int usb_sn9c20x_init_urbs(struct usb_sn9c20x *dev)
 		if (ep == NULL)
 			return -EIO;
 
-		ret = usb_set_interface(dev->udev, 0, 0);
+		ret = usb_sn9c20x_set_interface(dev, 0);
 		if (ret < 0)
 			return ret;
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_ALTSETTING);
 
 		value &= ~0x01;
 		ret = usb_sn9c20x_control_write(dev, 0x1061, &value, 1);
 		if (ret < 0)
 			return ret;
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_BRIDGE);
 
 		ret = usb_sn9c20x_bulk_init(dev, ep);
 	}
 
 	if (ret < 0)
 		return ret;
+	usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_URB_ALLOC);
 
+submit:
+	memset(&dev->parser, 0, sizeof(dev->parser));
+	dev->zero_copy = usb_sn9c20x_use_zero_copy(dev);
+	if (dev->zero_copy)
+		UDIA_DEBUG("Receiving into the video buffers\n");
 	for (i = 0; i < MAX_URBS; i++) {
 		ret = usb_submit_urb(dev->urbs[i].urb, GFP_KERNEL);
 		if (ret)
 			UDIA_ERROR("isoc_init() submit_urb %d failed with error %d\n", i, ret);
 	}
+	usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_URB_SUBMIT);
 
 	return 0;
 }
@@ -487,202 +837,779 @@ void usb_sn9c20x_uninit_urbs(struct usb_sn9c20x *dev, int free_buffers)
 		usb_kill_urb(urb);
 		usb_free_urb(urb);
 		dev->urbs[i].urb = NULL;
-		if (free_buffers) {
-			kfree(dev->urbs[i].data);
-			dev->urbs[i].data = NULL;
-		}
+		if (free_buffers)
+			usb_sn9c20x_free_urb_data(&dev->urbs[i]);
 	}
+	usb_sn9c20x_drop_windows(dev);
 }
 
-int usb_sn9c20x_detect_frame(unsigned char *buf, unsigned int buf_length)
+/**
+ * @param dev Device structure
+ *
+ * @brief Stop all the URBs without releasing them
+ *
+ * The URBs are killed but stay allocated together with their transfer
+ * buffers and the alternate setting, so that a following call to
+ * usb_sn9c20x_init_urbs() only has to resubmit them.
+ */
+void usb_sn9c20x_stop_urbs(struct usb_sn9c20x *dev)
 {
-	static unsigned char frame_header[] = {0xff, 0xff, 0x00, 0xc4, 0xc4, 0x96};
-	int index;
-	if (buf_length < 64)
-		return -1;
-	if (buf_length == 64) {
-		if (memcmp(buf, frame_header, 6) == 0)
-			return 0;
-		else
-			return -1;
-	}
-	if (bulk) {
-		for (index = 0; index < buf_length - 63; index++) {
-			if (memcmp(buf + index, frame_header, 6) == 0) {
-				UDIA_DEBUG("Found Header at %d\n", index);
-				return index;
-			}
-		}
+	int i;
+
+	for (i = 0; i < MAX_URBS; i++) {
+		if (dev->urbs[i].urb != NULL)
+			usb_kill_urb(dev->urbs[i].urb);
 	}
-	return -1;
+	usb_sn9c20x_drop_windows(dev);
 }
 
-void usb_sn9c20x_assemble_video(struct usb_sn9c20x *dev,
-	unsigned char *transfer, unsigned int transfer_length,
-	struct sn9c20x_buffer **buffer)
+/**
+ * @param dev Device structure
+ *
+ * @brief Start recording the phases of a stream start
+ */
+void usb_sn9c20x_profile_start(struct usb_sn9c20x *dev)
 {
-	void *mem = NULL;
-	unsigned char *header;
-	int header_index;
-	int yavg;
-	struct sn9c20x_buffer *buf = *buffer;
-	struct sn9c20x_video_queue *queue = &dev->queue;
+	struct sn9c20x_profiler *prof = &dev->profile;
+	unsigned long flags;
 
-	if (buf->state != SN9C20X_BUF_STATE_ACTIVE)
-		buf->state = SN9C20X_BUF_STATE_ACTIVE;
+	spin_lock_irqsave(&prof->lock, flags);
+	memset(&prof->cur, 0, sizeof(prof->cur));
+	prof->start = ktime_get();
+	prof->last = prof->start;
+	prof->seen = 0;
+	prof->active = 1;
+	spin_unlock_irqrestore(&prof->lock, flags);
 
-	header_index = usb_sn9c20x_detect_frame(transfer, transfer_length);
-	if (header_index >= 0) {
-		if (header_index + buf->buf.bytesused > buf->buf.length) {
-			UDIA_WARNING("Frame Buffer overflow!\n");
-			dev->vframes_overflow++;
-			buf->state = SN9C20X_BUF_STATE_DONE;
-		}
-		header_index = min(buf->buf.length - buf->buf.bytesused,
-					(unsigned int)header_index);
-		mem = queue->mem + buf->buf.m.offset + buf->buf.bytesused;
-		memcpy(mem, transfer, header_index);
-		buf->buf.bytesused += header_index;
-		header = transfer+header_index;
-/*		UDIA_INFO("color window: %dx%d\n",
-			    header[0x3a] << 4,
-			    header[0x3b] << 3);
-		UDIA_INFO("Frame Size: %d\n", buf->buf.bytesused);*/
-		yavg = ((header[35] >> 2) & 3)|(header[20] << 2)|(header[19] << 10);
-		yavg += ((header[35] >> 4) & 3)|(header[22] << 2)|(header[21] << 10);
-		yavg += ((header[35] >> 6) & 3)|(header[24] << 2)|(header[23] << 10);
-		yavg += (header[36] & 3)|(header[26] << 2)|(header[25] << 10);
-		yavg += ((header[36] >> 2) & 3)|(header[28] << 2)|(header[27] << 10);
-		yavg += ((header[36] >> 4) & 3)|(header[30] << 2)|(header[29] << 10);
-		yavg += ((header[36] >> 6) & 3)|(header[32] << 2)|(header[31] << 10);
-		yavg += ((header[44] >> 4) & 3)|(header[34] << 2)|(header[33] << 10);
-		UDIA_DEBUG("AVGY Total: %d (%d)\n", yavg, yavg >> 9);
-		yavg >>= 9;
-		atomic_set(&dev->camera.yavg, yavg);
-
-		if (buf->buf.bytesused != 0)
-			buf->state = SN9C20X_BUF_STATE_DONE;
-	} else {
-		if (transfer_length + buf->buf.bytesused > buf->buf.length) {
-			UDIA_WARNING("Frame Buffer overflow!\n");
-			dev->vframes_overflow++;
-			buf->state = SN9C20X_BUF_STATE_DONE;
-		}
-		transfer_length = min(buf->buf.length - buf->buf.bytesused,
-				      transfer_length);
-		mem = queue->mem + buf->buf.m.offset + buf->buf.bytesused;
-		memcpy(mem, transfer, transfer_length);
-		buf->buf.bytesused += transfer_length;
-	}
-	if (buf->state == SN9C20X_BUF_STATE_DONE ||
-	    buf->state == SN9C20X_BUF_STATE_ERROR) {
-		buf = sn9c20x_queue_next_buffer(queue, buf);
-		*buffer = buf;
-		if (buf == NULL) {
-			dev->vframes_dropped++;
-		} else {
-			if (header_index + 64 < transfer_length) {
-				memcpy(queue->mem + buf->buf.m.offset,
-				       transfer + header_index + 64,
-				       transfer_length - (header_index + 64));
-				buf->buf.bytesused +=
-				       transfer_length - (header_index + 64);
-			}
-		}
-	}
+	dev->ttff = -1;
 }
+
 /**
- * @param urb URB structure
+ * @param dev Device structure
+ * @param phase Phase that just ended
  *
- * @brief ISOC handler
+ * @brief Account the time elapsed since the previous mark to a phase
  *
- * This function is called as an URB transfert is complete (Isochronous pipe).
- * So, the traitement is done in interrupt time, so it has be fast, not crash,
- * and not stall. Neat.
+ * The bridge setup is split in several steps, so the time of a phase
+ * accumulates over all its marks. The first header and the first frame
+ * are only accounted once. The stream start is recorded in the history
+ * when the first frame is complete.
+ *
+ * This function can be called in interrupt context.
  */
-void usb_sn9c20x_completion_handler(struct urb *urb)
+void usb_sn9c20x_profile_mark(struct usb_sn9c20x *dev,
+			      enum sn9c20x_start_phase phase)
 {
-	int i;
-	int ret;
+	struct sn9c20x_profiler *prof = &dev->profile;
 	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&prof->lock, flags);
+	if (!prof->active || (prof->seen & (1 << phase)))
+		goto done;
+
+	prof->cur.phase[phase] += ktime_to_ns(ktime_sub(now, prof->last));
+	prof->last = now;
+	if (phase >= SN9C20X_PHASE_FIRST_HEADER)
+		prof->seen |= 1 << phase;
+
+	if (phase == SN9C20X_PHASE_FIRST_FRAME) {
+		prof->history[prof->count % SN9C20X_PROFILE_DEPTH] = prof->cur;
+		prof->count++;
+		prof->active = 0;
+		dev->ttff = ktime_us_delta(now, prof->start);
+	}
+done:
+	spin_unlock_irqrestore(&prof->lock, flags);
+}
 
-	unsigned char *transfer = NULL;
-	unsigned int transfer_length;
+/**
+ * @param dev Device structure
+ *
+ * @returns Time without a frame after which the stream is stalled
+ *
+ * The sensor can't send frames faster than it exposes them, a long
+ * exposure set by the soft AE (close to a second on the HV7131R) lowers
+ * the frame rate below the nominal one. The longest of the frame interval
+ * and the exposure time is used. Sensors whose exposure step isn't known
+ * only get the frame interval.
+ */
+static unsigned long usb_sn9c20x_watchdog_timeout(struct usb_sn9c20x *dev)
+{
+	unsigned int interval = 1000 / dev->vsettings.fps;
+	unsigned int exposure;
 
-	struct sn9c20x_buffer *buf = NULL;
-	struct usb_sn9c20x *dev = urb->context;
-	struct sn9c20x_video_queue *queue = &dev->queue;
+	exposure = div_u64((u64)dev->vsettings.exposure *
+			   dev->camera.exposure_unit_ns, NSEC_PER_MSEC);
+	interval = max(interval, exposure);
 
-	UDIA_STREAM("Isoc handler\n");
+	return msecs_to_jiffies(watchdog * interval);
+}
 
-	switch (urb->status) {
-	case 0:
-		break;
+/**
+ * @param work Watchdog work of the device
+ *
+ * @brief Recover the stream when no frame came during the last timeout
+ *
+ * Each timeout without a frame takes the next step: the URBs are killed
+ * and resubmitted, then the alternate setting is selected again with new
+ * URBs, then the device is reset. The reset goes through pre_reset and
+ * post_reset, which restore the device from its register shadow. If the
+ * frames still don't come, the queued buffers are returned with an error
+ * so that the application doesn't wait forever.
+ */
+static void usb_sn9c20x_watchdog_work(struct work_struct *work)
+{
+	struct usb_sn9c20x *dev;
+	struct sn9c20x_watchdog *wd;
+	unsigned int frames;
+	ktime_t start;
+	s64 t;
+	int shot;
+	int ret = 0;
+
+	dev = container_of(work, struct usb_sn9c20x, watchdog.work.work);
+	wd = &dev->watchdog;
+
+	mutex_lock(&dev->ctrl_mutex);
+	if (dev->disconnected || !sn9c20x_queue_streaming(&dev->queue)) {
+		mutex_unlock(&dev->ctrl_mutex);
+		return;
+	}
 
-	default:
-		UDIA_WARNING("Non-zero status (%d) in video "
-			"completion handler.\n", urb->status);
+	/* A single-shot stream only sends frames once triggered */
+	frames = wd->frames;
+	shot = atomic_read(&dev->shot);
+	if (frames != wd->last || shot == SN9C20X_SHOT_IDLE ||
+	    shot == SN9C20X_SHOT_DONE) {
+		if (wd->step > 0 && frames != wd->last) {
+			t = ktime_to_ns(ktime_sub(ktime_get(), wd->stall));
+			wd->fixed[wd->step - 1]++;
+			wd->recovery += t;
+			wd->recovery_max = max(wd->recovery_max, t);
+			UDIA_INFO("Stream recovered after %lld ms\n",
+				  div_s64(t, 1000000));
+		}
+		wd->step = 0;
+		wd->last = frames;
+		goto done;
+	}
 
-	case -ENOENT:		/* usb_kill_urb() called. */
-		if (dev->frozen)
-			return;
+	/* The exposure grew since the check was scheduled, give the frames
+	 * the longer timeout */
+	if (wd->step == 0 && usb_sn9c20x_watchdog_timeout(dev) > wd->timeout)
+		goto done;
 
-	case -ECONNRESET:	/* usb_unlink_urb() called. */
-	case -ESHUTDOWN:	/* The endpoint is being disabled. */
-		sn9c20x_queue_cancel(queue, urb->status == -ESHUTDOWN);
+	if (wd->step == SN9C20X_RECOVERIES) {
+		UDIA_ERROR("Stream still stalled, giving up\n");
+		wd->failed++;
+		mutex_unlock(&dev->ctrl_mutex);
+		sn9c20x_queue_cancel(&dev->queue, 0);
 		return;
 	}
 
-	spin_lock_irqsave(&queue->irqlock, flags);
-	if (!list_empty(&queue->irqqueue))
-		buf = list_first_entry(&queue->irqqueue, struct sn9c20x_buffer,
-				       queue);
-	spin_unlock_irqrestore(&queue->irqlock, flags);
-	if (!bulk) {
-		for (i = 0; i < urb->number_of_packets; i++) {
-			if (urb->iso_frame_desc[i].status != 0) {
-				/*UDIA_ERROR("Iso frame %d of USB has error %d\n",
-					   i, urb->iso_frame_desc[i].status);*/
-				mdelay(1);
-				continue;
-			}
-			transfer_length = urb->iso_frame_desc[i].actual_length;
-			transfer = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
-			if (buf == NULL)
-				continue;
-
-			usb_sn9c20x_assemble_video(dev, transfer, transfer_length, &buf);
-		}
-	} else {
-		if (buf != NULL) {
-			usb_sn9c20x_assemble_video(dev, urb->transfer_buffer,
-						    urb->actual_length, &buf);
-		}
+	if (wd->step == 0)
+		wd->stall = ktime_get();
+	UDIA_WARNING("Stream stalled, recovery step %d\n", wd->step);
+
+	start = ktime_get();
+	switch (wd->step) {
+	case SN9C20X_RECOVER_RESUBMIT:
+		/* Frozen, the killed URBs must not cancel the queue */
+		dev->frozen = 1;
+		usb_sn9c20x_stop_urbs(dev);
+		dev->frozen = 0;
+		ret = usb_sn9c20x_init_urbs(dev);
+		break;
+	case SN9C20X_RECOVER_ALTSETTING:
+		dev->frozen = 1;
+		usb_sn9c20x_uninit_urbs(dev, 0);
+		dev->frozen = 0;
+		ret = usb_sn9c20x_set_interface(dev, 0);
+		if (ret == 0)
+			ret = usb_sn9c20x_init_urbs(dev);
+		if (ret == 0)
+			ret = sn9c20x_enable_video(dev, 1);
+		break;
+	case SN9C20X_RECOVER_RESET:
+		usb_queue_reset_device(dev->interface);
+		break;
 	}
-	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret < 0)
+		UDIA_ERROR("Recovery step %d failed (%d)\n", wd->step, ret);
+
+	wd->spent[wd->step] += ktime_to_ns(ktime_sub(ktime_get(), start));
+	wd->count[wd->step]++;
+	wd->step++;
+	wd->last = wd->frames;
+done:
+	wd->timeout = usb_sn9c20x_watchdog_timeout(dev);
+	mutex_unlock(&dev->ctrl_mutex);
+	schedule_delayed_work(&wd->work, wd->timeout);
+}
 
-	if (ret != 0) {
-		UDIA_ERROR("Error (%d) re-submitting urb in "
-			   "sn9c20x_isoc_handler.\n", ret);
-	}
+/**
+ * @param dev Device structure
+ *
+ * @brief Start watching the stream
+ *
+ * The first check waits twice the timeout, the first frame of a stream
+ * takes longer than the next ones.
+ */
+void usb_sn9c20x_watchdog_start(struct usb_sn9c20x *dev)
+{
+	if (watchdog == 0)
+		return;
+
+	dev->watchdog.last = dev->watchdog.frames;
+	dev->watchdog.timeout = 2 * usb_sn9c20x_watchdog_timeout(dev);
+	schedule_delayed_work(&dev->watchdog.work, dev->watchdog.timeout);
 }
 
 /**
  * @param dev Device structure
- * @param value register to write to
- * @param data
- * @param length number of bytes
  *
- * @returns 0 if all is OK
+ * @brief Stop watching the stream
  *
- * @brief Write a 16-bit value to a 16-bit register
+ * The next stream starts over with the first recovery step.
+ */
+void usb_sn9c20x_watchdog_stop(struct usb_sn9c20x *dev)
+{
+	cancel_delayed_work_sync(&dev->watchdog.work);
+	dev->watchdog.step = 0;
+}
+
+/**
+ * @param dev Device structure
+ * @param header Frame header
+ * @param window Luma sums of the windows, filled in
  *
- * This function permits to write a 16-bit value to a 16-bit register on the USB bus.
+ * @brief Extract the frame statistics from a frame header
  */
-int usb_sn9c20x_control_write(struct usb_sn9c20x *dev, __u16 value, __u8 *data, __u16 length)
+static void usb_sn9c20x_parse_header(struct usb_sn9c20x *dev,
+	const unsigned char *header, __u32 *window)
 {
-	int result;
-	struct usb_device *udev = dev->udev;
+	/* Byte and shift of the two low bits of each window sum */
+	static const unsigned char low[SN9C20X_META_WINDOWS][2] = {
+		{35, 2}, {35, 4}, {35, 6}, {36, 0},
+		{36, 2}, {36, 4}, {36, 6}, {44, 4},
+	};
+	const __u8 *weight = dev->camera.window_weight;
+	__u32 weighted = 0;
+	int total = 0;
+	int yavg = 0;
+	int i;
+
+/*	UDIA_INFO("color window: %dx%d\n",
+		    header[0x3a] << 4,
+		    header[0x3b] << 3);*/
+	for (i = 0; i < SN9C20X_META_WINDOWS; i++) {
+		window[i] = ((header[low[i][0]] >> low[i][1]) & 3) |
+			(header[20 + 2 * i] << 2) | (header[19 + 2 * i] << 10);
+		yavg += window[i];
+		weighted += weight[i] * window[i];
+		total += weight[i];
+	}
+	UDIA_DEBUG("AVGY Total: %d (%d)\n", yavg, yavg >> 9);
+
+	/* Meter on the weighted windows, scaled back to eight of them */
+	if (total)
+		yavg = weighted * SN9C20X_META_WINDOWS / total;
+	yavg >>= 9;
+	atomic_set(&dev->camera.yavg, yavg);
+}
+
+/**
+ * @param dev Device structure
+ * @param buf Buffer holding a finished frame
+ *
+ * @returns The next buffer to fill or NULL
+ *
+ * @brief Hand a finished frame over to the video queue
+ */
+static struct sn9c20x_buffer *usb_sn9c20x_complete_frame(
+	struct usb_sn9c20x *dev, struct sn9c20x_buffer *buf)
+{
+	if ((dev->queue.flags & SN9C20X_QUEUE_DROP_INCOMPLETE) &&
+	    buf->buf.bytesused != buf->buf.length)
+		dev->vframes_incomplete++;
+	if (unlikely(dev->profile.active))
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_FIRST_FRAME);
+	return sn9c20x_queue_next_buffer(&dev->queue, buf);
+}
+
+/**
+ * @param dev Device structure
+ * @param buf Buffer to fill
+ * @param data Frame data
+ * @param len Length of the frame data
+ * @param stamp Arrival time of the frame data
+ * @param fixed Non-zero for formats with frames of a fixed size
+ *
+ * @brief Append frame data to a buffer
+ *
+ * Data that does not fit in the buffer anymore is discarded until the next
+ * frame header and the frame is marked as overflowed. Frames of a fixed
+ * size only overflow when the stream lost its sync, JPEG frames when they
+ * are larger than the estimate of sn9c20x_jpeg_size(), a truncated JPEG
+ * frame can't be decoded either. Frames of a fixed size are the only ones
+ * received through zero-copy windows or published in slices, the data is
+ * only moved if it didn't land in the right place. JPEG frames keep room
+ * for the header added on dequeue.
+ *
+ * Always inlined, so that each format gets a copy without the checks of
+ * the other.
+ */
+static __always_inline void __usb_sn9c20x_store(struct usb_sn9c20x *dev,
+	struct sn9c20x_buffer *buf, const unsigned char *data,
+	unsigned int len, ktime_t stamp, const int fixed)
+{
+	struct sn9c20x_video_queue *queue = &dev->queue;
+	unsigned char *dst;
+	unsigned int room;
+
+	room = buf->buf.length - buf->buf.bytesused;
+	if (!fixed)
+		room -= SN9C20X_JPEG_HEADER_SIZE;
+
+	if (unlikely(len > room)) {
+		if (room != 0) {
+			UDIA_WARNING("Frame Buffer overflow!\n");
+			dev->vframes_overflow++;
+			if (!fixed && dev->jpeg_scale < SN9C20X_JPEG_SCALE_MAX)
+				dev->jpeg_scale += 50;
+		}
+		buf->overflow += len - room;
+		len = room;
+		if (len == 0)
+			return;
+	}
+
+	if (buf->buf.bytesused == 0) {
+		buf->stamp = stamp;
+		if (fixed)
+			queue->slice_next = queue->slice_bytes;
+	}
+	buf->state = SN9C20X_BUF_STATE_ACTIVE;
+
+	dst = queue->mem + buf->buf.m.offset + buf->buf.bytesused;
+	if (!fixed) {
+		memcpy(dst, data, len);
+		buf->buf.bytesused += len;
+		return;
+	}
+
+	/* Data received in place by a zero-copy window is already there.
+	 * Moving received data forward could be overwritten by windows
+	 * still in flight, which only happens if the stream lost bytes. */
+	if (dst != data) {
+		if (unlikely(buf->windows && dst > data &&
+			     (void *)data >= queue->mem &&
+			     (void *)data < queue->mem +
+					    queue->count * queue->buf_size))
+			buf->lost++;
+		memmove(dst, data, len);
+	}
+	buf->buf.bytesused += len;
+
+	if (queue->slice_bytes && buf->buf.bytesused >= queue->slice_next)
+		sn9c20x_queue_progress(queue, buf);
+}
+
+/**
+ * @param dev Device structure
+ * @param buf Buffer to fill, can be NULL
+ * @param data Frame data
+ * @param len Length of the frame data
+ * @param stamp Arrival time of the frame data
+ *
+ * @brief Append frame data to a buffer
+ *
+ * Only JPEG streams keep incomplete frames.
+ */
+static void usb_sn9c20x_store(struct usb_sn9c20x *dev,
+	struct sn9c20x_buffer *buf, const unsigned char *data,
+	unsigned int len, ktime_t stamp)
+{
+	if (buf == NULL || len == 0)
+		return;
+
+	if (dev->queue.flags & SN9C20X_QUEUE_DROP_INCOMPLETE)
+		__usb_sn9c20x_store(dev, buf, data, len, stamp, 1);
+	else
+		__usb_sn9c20x_store(dev, buf, data, len, stamp, 0);
+}
+
+/**
+ * @param dev Device structure
+ * @param header Frame header
+ * @param buffer Buffer being filled, can point to NULL
+ *
+ * @brief Finish the current frame once its header is complete
+ *
+ * A header seen without a buffer to fill means one more dropped frame,
+ * its sequence number is skipped. The header also marks the start of the
+ * next frame, which is signalled to the applications.
+ *
+ * In single-shot mode the video may have been enabled in the middle of a
+ * frame. Unless the queue drops incomplete frames anyway, the data before
+ * the first header is discarded. The stream is idled again as soon as a
+ * frame has been handed over, and the software auto-exposure is left alone.
+ */
+static void usb_sn9c20x_frame_end(struct usb_sn9c20x *dev,
+	const unsigned char *header, struct sn9c20x_buffer **buffer)
+{
+	struct sn9c20x_buffer *buf = *buffer;
+	__u32 window[SN9C20X_META_WINDOWS];
+	int shot = atomic_read(&dev->shot);
+
+	dev->watchdog.frames++;
+	if (unlikely(dev->profile.active))
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_FIRST_HEADER);
+	usb_sn9c20x_parse_header(dev, header, window);
+
+	if (shot == SN9C20X_SHOT_DONE)
+		return;
+	if (shot == SN9C20X_SHOT_WAIT) {
+		atomic_set(&dev->shot, SN9C20X_SHOT_CAPTURE);
+		if (!(dev->queue.flags & SN9C20X_QUEUE_DROP_INCOMPLETE)) {
+			if (buf != NULL) {
+				buf->buf.bytesused = 0;
+				buf->lost = 0;
+				buf->overflow = 0;
+			}
+			return;
+		}
+	}
+
+	if (shot == SN9C20X_SHOT_OFF)
+		dev_sn9c20x_schedule_auto(dev, buf);
+	sn9c20x_meta_frame(dev, header, window, dev->queue.sequence,
+			   buf == NULL ? SN9C20X_META_DROPPED : 0,
+			   buf == NULL ? ktime_get() : buf->stamp);
+
+	if (buf == NULL) {
+		dev->vframes_dropped++;
+		dev->queue.sequence++;
+	} else if (buf->buf.bytesused != 0) {
+		buf->state = SN9C20X_BUF_STATE_DONE;
+		*buffer = usb_sn9c20x_complete_frame(dev, buf);
+		if (shot != SN9C20X_SHOT_OFF && *buffer != buf) {
+			atomic_set(&dev->shot, SN9C20X_SHOT_DONE);
+			*buffer = NULL;
+			schedule_work(&dev->shot_work);
+		}
+	}
+
+	v4l2_notify_frame_sync(dev, dev->queue.sequence);
+}
+
+/**
+ * @param dev Device structure
+ * @param urb Isochronous URB
+ * @param now Completion time of the URB
+ * @param buffer Buffer being filled, can point to NULL
+ *
+ * @brief Assemble the frame data carried by an isochronous URB
+ *
+ * Each run of contiguous packets found by sn9c20x_isoc_next() is copied
+ * at once. The URB completes after its last packet, earlier packets
+ * arrived one (micro)frame apart from each other.
+ */
+static void usb_sn9c20x_assemble_isoc(struct usb_sn9c20x *dev,
+	struct urb *urb, ktime_t now, struct sn9c20x_buffer **buffer)
+{
+	struct sn9c20x_isoc_walk walk = {
+		.buffer = urb->transfer_buffer,
+		.desc = urb->iso_frame_desc,
+		.packets = urb->number_of_packets,
+	};
+	const unsigned char *chunk;
+	unsigned int len;
+	u64 period;
+
+	period = urb->interval *
+		(dev->udev->speed == USB_SPEED_HIGH ? 125000 : 1000000);
+
+	for (;;) {
+		switch (sn9c20x_isoc_next(&walk, &chunk, &len)) {
+		case SN9C20X_ISOC_DATA:
+			usb_sn9c20x_store(dev, *buffer, chunk, len,
+				ktime_sub_ns(now, (urb->number_of_packets -
+						   1 - walk.first) * period));
+			break;
+		case SN9C20X_ISOC_HEADER:
+			usb_sn9c20x_frame_end(dev, chunk, buffer);
+			break;
+		case SN9C20X_ISOC_ERROR:
+			UDIA_STREAM("Iso frame %d of USB has error %d\n",
+				    walk.first,
+				    urb->iso_frame_desc[walk.first].status);
+			dev->vpackets_lost++;
+			if (*buffer != NULL)
+				(*buffer)->lost++;
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+/**
+ * @param dev Device structure
+ * @param data Data of the transfer
+ * @param len Length of the transfer
+ * @param stamp Arrival time of the transfer
+ * @param buffer Buffer being filled, can point to NULL
+ *
+ * @brief Hand the frame data and headers of a bulk transfer over
+ *
+ * The stream is parsed even without buffer so that frame boundaries are
+ * never lost.
+ */
+static void usb_sn9c20x_parse_bulk(struct usb_sn9c20x *dev,
+	const unsigned char *data, unsigned int len, ktime_t stamp,
+	struct sn9c20x_buffer **buffer)
+{
+	const unsigned char *end = data + len;
+	const unsigned char *chunk;
+	unsigned int n;
+
+	for (;;) {
+		switch (sn9c20x_bulk_next(&dev->parser, &data, end,
+					  &chunk, &n)) {
+		case SN9C20X_BULK_DATA:
+			usb_sn9c20x_store(dev, *buffer, chunk, n, stamp);
+			break;
+		case SN9C20X_BULK_HEADER:
+			usb_sn9c20x_frame_end(dev, dev->parser.header, buffer);
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+/**
+ * @param urb URB structure
+ *
+ * @brief ISOC handler
+ *
+ * This function is called as an URB transfert is complete (Isochronous pipe).
+ * So, the traitement is done in interrupt time, so it has be fast, not crash,
+ * and not stall. Neat.
+ */
+void usb_sn9c20x_completion_handler(struct urb *urb)
+{
+	int i;
+	int ret;
+	unsigned long flags;
+	ktime_t now;
+
+	struct sn9c20x_buffer *buf = NULL;
+	struct usb_sn9c20x *dev = urb->context;
+	struct sn9c20x_video_queue *queue = &dev->queue;
+
+	now = ktime_get();
+
+	UDIA_STREAM("Isoc handler\n");
+
+	switch (urb->status) {
+	case 0:
+		break;
+
+	case -EPROTO:		/* Transfer errors, the payload is lost. */
+	case -EILSEQ:
+	case -EOVERFLOW:
+	case -ETIME:
+		UDIA_STREAM("Lost transfer (%d)\n", urb->status);
+		dev->vpackets_lost++;
+		spin_lock_irqsave(&queue->irqlock, flags);
+		if (!list_empty(&queue->irqqueue)) {
+			buf = list_first_entry(&queue->irqqueue,
+					       struct sn9c20x_buffer, queue);
+			buf->lost++;
+		}
+		spin_unlock_irqrestore(&queue->irqlock, flags);
+		goto resubmit;
+
+	default:
+		UDIA_WARNING("Non-zero status (%d) in video "
+			"completion handler.\n", urb->status);
+
+	case -ENOENT:		/* usb_kill_urb() called. */
+		/* Suspended, or idling between two single shots */
+		if (dev->frozen ||
+		    atomic_read(&dev->shot) != SN9C20X_SHOT_OFF)
+			return;
+
+	case -ECONNRESET:	/* usb_unlink_urb() called. */
+	case -ESHUTDOWN:	/* The endpoint is being disabled. */
+		sn9c20x_queue_cancel(queue, urb->status == -ESHUTDOWN);
+		return;
+	}
+
+	/* Data past a single shot is discarded */
+	if (atomic_read(&dev->shot) != SN9C20X_SHOT_DONE)
+		buf = sn9c20x_queue_first_buffer(queue);
+	if (!bulk) {
+		usb_sn9c20x_assemble_isoc(dev, urb, now, &buf);
+	} else {
+		if (is_vmalloc_addr(urb->transfer_buffer))
+			invalidate_kernel_vmap_range(urb->transfer_buffer,
+						     urb->actual_length);
+		usb_sn9c20x_parse_bulk(dev, urb->transfer_buffer,
+				       urb->actual_length, now, &buf);
+	}
+resubmit:
+	if (dev->zero_copy) {
+		for (i = 0; dev->urbs[i].urb != urb; i++)
+			;
+		usb_sn9c20x_next_window(dev, &dev->urbs[i]);
+	}
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+
+	if (ret != 0) {
+		UDIA_ERROR("Error (%d) re-submitting urb in "
+			   "sn9c20x_isoc_handler.\n", ret);
+	}
+}
+
+/**
+ * @param dev Device structure
+ * @param reg First register written
+ * @param data Values written
+ * @param length Number of registers written
+ *
+ * @brief Keep the values written to the bridge in the register shadow
+ *
+ * The I2C window and the LEDs take commands rather than keep state, they
+ * are left out. Video is enabled again by the stream restart, so the
+ * enable bit of 0x1061 isn't kept.
+ */
+static void usb_sn9c20x_shadow_store(struct usb_sn9c20x *dev, __u16 reg,
+	const __u8 *data, __u16 length)
+{
+	struct sn9c20x_shadow *shadow = &dev->shadow;
+	__u8 val;
+	int i, j;
+
+	spin_lock(&shadow->lock);
+	for (i = 0; i < length; i++, reg++) {
+		if ((reg >= 0x10c0 && reg <= 0x10c8) ||
+		    reg == 0x1006 || reg == 0x1007)
+			continue;
+
+		val = data[i];
+		if (reg == 0x1061)
+			val &= ~0x02;
+
+		if (reg >= SN9C20X_SHADOW_BASE &&
+		    reg < SN9C20X_SHADOW_BASE + SN9C20X_SHADOW_SIZE) {
+			shadow->reg[reg - SN9C20X_SHADOW_BASE] = val;
+			set_bit(reg - SN9C20X_SHADOW_BASE, shadow->valid);
+			continue;
+		}
+
+		for (j = 0; j < shadow->others; j++)
+			if (shadow->other_reg[j] == reg)
+				break;
+		if (j == SN9C20X_SHADOW_OTHERS) {
+			shadow->lost = 1;
+			continue;
+		}
+		if (j == shadow->others)
+			shadow->others++;
+		shadow->other_reg[j] = reg;
+		shadow->other_val[j] = val;
+	}
+	spin_unlock(&shadow->lock);
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Write the bridge registers back from the register shadow
+ *
+ * Consecutive registers are written in a single transfer of up to 64
+ * bytes, in the order of their addresses. The registers outside the
+ * shadow window follow. The writes go through the shadow again, so they
+ * are made from a copy taken under the lock.
+ */
+int usb_sn9c20x_shadow_replay(struct usb_sn9c20x *dev)
+{
+	struct sn9c20x_shadow *shadow;
+	unsigned long start, end;
+	__u8 value;
+	int ret = 0, i;
+
+	shadow = kmalloc(sizeof(*shadow), GFP_KERNEL);
+	if (shadow == NULL)
+		return -ENOMEM;
+
+	spin_lock(&dev->shadow.lock);
+	memcpy(shadow->reg, dev->shadow.reg, sizeof(shadow->reg));
+	memcpy(shadow->valid, dev->shadow.valid, sizeof(shadow->valid));
+	memcpy(shadow->other_reg, dev->shadow.other_reg,
+	       sizeof(shadow->other_reg));
+	memcpy(shadow->other_val, dev->shadow.other_val,
+	       sizeof(shadow->other_val));
+	shadow->others = dev->shadow.others;
+	shadow->lost = dev->shadow.lost;
+	spin_unlock(&dev->shadow.lock);
+
+	/* Nothing useful without the clock and sensor power setup */
+	if (shadow->lost || !test_bit(0, shadow->valid)) {
+		ret = -ENODATA;
+		goto done;
+	}
+
+	start = find_next_bit(shadow->valid, SN9C20X_SHADOW_SIZE, 0);
+	while (start < SN9C20X_SHADOW_SIZE) {
+		end = find_next_zero_bit(shadow->valid, SN9C20X_SHADOW_SIZE,
+					 start);
+		end = min(end, start + 64);
+
+		ret = usb_sn9c20x_control_write(dev,
+			SN9C20X_SHADOW_BASE + start, &shadow->reg[start],
+			end - start);
+		if (ret < 0)
+			goto done;
+
+		start = find_next_bit(shadow->valid, SN9C20X_SHADOW_SIZE, end);
+	}
+
+	for (i = 0; i < shadow->others; i++) {
+		value = shadow->other_val[i];
+		ret = usb_sn9c20x_control_write(dev, shadow->other_reg[i],
+						&value, 1);
+		if (ret < 0)
+			goto done;
+	}
+
+done:
+	kfree(shadow);
+	return ret;
+}
+
+/**
+ * @param dev Device structure
+ * @param value register to write to
+ * @param data
+ * @param length number of bytes
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Write a 16-bit value to a 16-bit register
+ *
+ * This function permits to write a 16-bit value to a 16-bit register on the USB bus.
+ */
+int usb_sn9c20x_control_write(struct usb_sn9c20x *dev, __u16 value, __u8 *data, __u16 length)
+{
+	int result;
+	struct usb_device *udev = dev->udev;
 
 	result = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
 			0x08,
@@ -698,6 +1625,8 @@ int usb_sn9c20x_control_write(struct usb_sn9c20x *dev, __u16 value, __u8 *data,
 		return result;
 	}
 
+	usb_sn9c20x_shadow_store(dev, value, data, length);
+
 	return 0;
 }
 
@@ -754,9 +1683,14 @@ static int usb_sn9c20x_default_settings(struct usb_sn9c20x *dev)
 	dev->vframes_overflow = 0;
 	dev->vframes_incomplete = 0;
 	dev->vframes_dropped = 0;
+	dev->vpackets_lost = 0;
+	dev->jpeg_scale = 100;
 
 	dev->queue.min_buffers = min_buffers;
+	if (drop_corrupted)
+		dev->queue.flags |= SN9C20X_QUEUE_DROP_CORRUPTED;
 	dev->queue.max_buffers = max_buffers;
+	dev->standby_timeout = standby_timeout;
 
 	dev->vsettings.fps = fps;
 
@@ -773,8 +1707,25 @@ static int usb_sn9c20x_default_settings(struct usb_sn9c20x *dev)
 	v4l2_set_control_default(dev, V4L2_CID_BLUE_BALANCE, blue_gain);
 	v4l2_set_control_default(dev, V4L2_CID_EXPOSURE_AUTO, auto_exposure);
 	v4l2_set_control_default(dev, V4L2_CID_AUTOGAIN, auto_gain);
-	v4l2_set_control_default(dev, V4L2_CID_AUTO_WHITE_BALANCE, auto_whitebalance);
+	/* The software white balance overrides red_gain and blue_gain, it
+	 * isn't on unless asked for */
+	v4l2_set_control_default(dev, V4L2_CID_AUTO_WHITE_BALANCE,
+				 auto_whitebalance == 2 ?
+				 dev->camera.set_auto_whitebalance != NULL :
+				 auto_whitebalance);
 	v4l2_set_control_default(dev, V4L2_CID_EXPOSURE, exposure);
+	/* Some init tables turn the sensor banding filter on */
+	if (power_line < 0)
+		dev->vsettings.power_line = dev->camera.power_line;
+	else
+		v4l2_set_control_default(dev, V4L2_CID_POWER_LINE_FREQUENCY,
+					 power_line);
+	v4l2_set_control_default(dev, V4L2_CID_SN9C20X_METER_LEFT, 25);
+	v4l2_set_control_default(dev, V4L2_CID_SN9C20X_METER_TOP, 25);
+	v4l2_set_control_default(dev, V4L2_CID_SN9C20X_METER_WIDTH, 50);
+	v4l2_set_control_default(dev, V4L2_CID_SN9C20X_METER_HEIGHT, 50);
+	v4l2_set_control_default(dev, V4L2_CID_SN9C20X_METERING,
+				 SN9C20X_METERING_AVERAGE);
 
 	if (jpeg == 2) {
 		if (dev->udev->speed == USB_SPEED_HIGH && bandwidth == 8)
@@ -791,40 +1742,254 @@ static int usb_sn9c20x_default_settings(struct usb_sn9c20x *dev)
 }
 
 
-static int input_thread(void *data)
+/**
+ * @param dev Device structure
+ *
+ * @returns Non zero if the GPIO state changed
+ *
+ * @brief Read the GPIO and report the changes
+ *
+ * Buttons are reported on the input device, a flip switch through the
+ * sensor's flip detection.
+ */
+static int usb_sn9c20x_gpio_read(struct usb_sn9c20x *dev)
 {
-	struct usb_sn9c20x *dev = (struct usb_sn9c20x *)data;
+	int changed = 0;
 	__u8 gpio;
-	int ret, i;
+#ifdef CONFIG_SN9C20X_EVDEV
+	__u8 diff;
+	int i;
+#endif
 
-	DECLARE_WAIT_QUEUE_HEAD(wait);
-	set_freezable();
-	for (;;) {
-		if (kthread_should_stop())
-			break;
+	if (usb_sn9c20x_control_read(dev, 0x1005, &gpio, 1) >= 0 &&
+	    gpio != dev->gpio_state) {
+#ifdef CONFIG_SN9C20X_EVDEV
+		diff = (gpio ^ dev->gpio_state) & dev->input_gpio;
+		for (i = 0; i < 8 && dev->input_dev != NULL; i++) {
+			if (diff & (1 << i))
+				input_report_key(dev->input_dev, BTN_0 + i,
+						 gpio & (1 << i));
+		}
+		if (diff && dev->input_dev != NULL)
+			input_sync(dev->input_dev);
 
-		ret = usb_sn9c20x_control_read(dev, 0x1005, &gpio, 1);
-		if (ret < 0)
-			continue;
+		/* A button press triggers a single shot */
+		if ((diff & gpio) &&
+		    atomic_read(&dev->shot) != SN9C20X_SHOT_OFF)
+			v4l2_trigger_shot(dev);
+#endif
+		dev->gpio_state = gpio;
+		changed = 1;
+	}
 
-		for (i = 0; i < 8; i++) {
-			if (!(dev->input_gpio & (1 << i)))
-				continue;
+	if (flip_detect) {
+		mutex_lock(&dev->ctrl_mutex);
+		if (dev_sn9c20x_flip_detection(dev) > 0)
+			changed = 1;
+		mutex_unlock(&dev->ctrl_mutex);
+	}
 
-			input_report_key(dev->input_dev,
-					 BTN_0 + i,
-					 gpio & (1 << i));
-			input_sync(dev->input_dev);
-		}
+	return changed;
+}
+
+/**
+ * @param work Work structure of the device
+ *
+ * @brief Check the GPIO after an interrupt or when the poll is due
+ *
+ * Without the interrupt endpoint the polling interval doubles up to
+ * SN9C20X_GPIO_POLL_MAX while nothing changes and drops back to
+ * SN9C20X_GPIO_POLL_MIN on the first change.
+ */
+static void usb_sn9c20x_gpio_work(struct work_struct *work)
+{
+	struct usb_sn9c20x *dev;
+
+	dev = container_of(work, struct usb_sn9c20x, gpio_work.work);
+
+	if (usb_sn9c20x_gpio_read(dev))
+		dev->gpio_interval = SN9C20X_GPIO_POLL_MIN;
+	else if (dev->gpio_interval < SN9C20X_GPIO_POLL_MAX)
+		dev->gpio_interval *= 2;
+
+	if (dev->int_urb == NULL && dev->gpio_running)
+		schedule_delayed_work(&dev->gpio_work,
+				      msecs_to_jiffies(dev->gpio_interval));
+}
+
+/**
+ * @param urb URB of the interrupt endpoint
+ *
+ * @brief Completion handler of the interrupt endpoint
+ *
+ * The bridge signals a GPIO change on its interrupt endpoint. The state
+ * itself is read by the work as control transfers can't be done here.
+ */
+static void usb_sn9c20x_int_complete(struct urb *urb)
+{
+	struct usb_sn9c20x *dev = urb->context;
+	int ret;
+
+	switch (urb->status) {
+	case 0:
+		if (urb->actual_length > 0)
+			schedule_delayed_work(&dev->gpio_work, 0);
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		return;
+	default:
+		UDIA_DEBUG("Interrupt URB status %d\n", urb->status);
+		break;
+	}
+
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret < 0)
+		UDIA_ERROR("Resubmitting the interrupt URB failed (%d)\n", ret);
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @brief Start watching the GPIO
+ */
+static void usb_sn9c20x_gpio_start(struct usb_sn9c20x *dev)
+{
+	int ret;
+
+	if (!dev->gpio_watch || dev->gpio_running)
+		return;
+
+	dev->gpio_running = 1;
+	dev->gpio_interval = SN9C20X_GPIO_POLL_MIN;
+
+	/* Catch up on what changed while nobody was watching */
+	schedule_delayed_work(&dev->gpio_work, 0);
+
+	if (dev->int_urb == NULL)
+		return;
+
+	ret = usb_submit_urb(dev->int_urb, GFP_KERNEL);
+	if (ret < 0)
+		UDIA_ERROR("Submitting the interrupt URB failed (%d)\n", ret);
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @brief Stop watching the GPIO
+ */
+static void usb_sn9c20x_gpio_stop(struct usb_sn9c20x *dev)
+{
+	if (!dev->gpio_running)
+		return;
+
+	dev->gpio_running = 0;
+	usb_kill_urb(dev->int_urb);
+	cancel_delayed_work_sync(&dev->gpio_work);
+}
+
+/**
+ * @param dev Device structure
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Set up the GPIO watch
+ *
+ * Nothing is watched unless there are buttons or a flip switch to report.
+ * Changes are signalled on the interrupt endpoint, only bridges without
+ * one fall back to polling.
+ */
+static int usb_sn9c20x_gpio_init(struct usb_sn9c20x *dev)
+{
+	struct usb_endpoint_descriptor *ep;
+	int size;
+
+	INIT_DELAYED_WORK(&dev->gpio_work, usb_sn9c20x_gpio_work);
+
+#ifdef CONFIG_SN9C20X_EVDEV
+	dev->gpio_watch = dev->input_dev != NULL;
+#endif
+	if (flip_detect && dev->camera.flip_detect != NULL)
+		dev->gpio_watch = 1;
+
+	if (!dev->gpio_watch)
+		return 0;
 
-		wait_event_freezable_timeout(wait,
-					     kthread_should_stop(),
-					     msecs_to_jiffies(100));
+	usb_sn9c20x_control_read(dev, 0x1005, &dev->gpio_state, 1);
+
+	ep = find_endpoint(dev->interface->cur_altsetting, SN9C20X_INT);
+	if (ep == NULL || !usb_endpoint_is_int_in(ep)) {
+		UDIA_INFO("No interrupt endpoint, polling the GPIO\n");
+		goto start;
+	}
+
+	size = le16_to_cpu(ep->wMaxPacketSize);
+	dev->int_buffer = kmalloc(size, GFP_KERNEL);
+	if (dev->int_buffer == NULL)
+		return -ENOMEM;
+
+	dev->int_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (dev->int_urb == NULL) {
+		kfree(dev->int_buffer);
+		dev->int_buffer = NULL;
+		return -ENOMEM;
 	}
+
+	usb_fill_int_urb(dev->int_urb, dev->udev,
+			 usb_rcvintpipe(dev->udev, ep->bEndpointAddress),
+			 dev->int_buffer, size, usb_sn9c20x_int_complete,
+			 dev, ep->bInterval);
+
+start:
+	usb_sn9c20x_gpio_start(dev);
 	return 0;
 }
 
+/**
+ * @param dev Device structure
+ *
+ * @brief Stop watching the GPIO and free the interrupt URB
+ */
+static void usb_sn9c20x_gpio_cleanup(struct usb_sn9c20x *dev)
+{
+	usb_sn9c20x_gpio_stop(dev);
+
+	usb_free_urb(dev->int_urb);
+	dev->int_urb = NULL;
+	kfree(dev->int_buffer);
+	dev->int_buffer = NULL;
+}
 
+/**
+ * @param dev Device structure
+ * @param alt Alternate setting
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Select an alternate setting of the interface
+ *
+ * Changing the alternate setting flushes the interrupt endpoint as well,
+ * its URB is resubmitted once the new setting is in place.
+ */
+int usb_sn9c20x_set_interface(struct usb_sn9c20x *dev, int alt)
+{
+	int ret;
+
+	if (dev->gpio_running)
+		usb_kill_urb(dev->int_urb);
+
+	ret = usb_set_interface(dev->udev, 0, alt);
+
+	if (dev->gpio_running && dev->int_urb != NULL &&
+	    usb_submit_urb(dev->int_urb, GFP_KERNEL) < 0)
+		UDIA_ERROR("Submitting the interrupt URB failed\n");
+
+	return ret;
+}
+
+#ifdef CONFIG_SN9C20X_EVDEV
 static int sn9c20x_input_init(struct usb_sn9c20x *dev)
 {
 	int ret;
@@ -839,8 +2004,11 @@ static int sn9c20x_input_init(struct usb_sn9c20x *dev)
 					 dev->udev->bus->bus_name,
 					 dev->udev->devpath);
 
-	if (!dev->input_dev->phys)
+	if (!dev->input_dev->phys) {
+		input_free_device(dev->input_dev);
+		dev->input_dev = NULL;
 		return -ENOMEM;
+	}
 
 	usb_to_input_id(dev->udev, &dev->input_dev->id);
 	dev->input_dev->dev.parent = &dev->udev->dev;
@@ -856,30 +2024,110 @@ static int sn9c20x_input_init(struct usb_sn9c20x *dev)
 	set_bit(BTN_7, dev->input_dev->keybit);
 
 	ret = input_register_device(dev->input_dev);
-	if (ret)
-		return ret;
-
-	dev->input_task = kthread_run(input_thread, dev, "sn9c20x/%d",
-				      dev->vdev->minor);
-
-	if (IS_ERR(dev->input_task))
-		return -EINVAL;
-
-	return 0;
+	if (ret < 0) {
+		kfree(dev->input_dev->phys);
+		input_free_device(dev->input_dev);
+		dev->input_dev = NULL;
+	}
+	return ret;
 }
 
 static void sn9c20x_input_cleanup(struct usb_sn9c20x *dev)
 {
-	if (!IS_ERR(dev->input_task))
-		kthread_stop(dev->input_task);
+	const char *phys;
 
+	/* Unregistering drops the last reference on the input device */
 	if (dev->input_dev != NULL) {
+		phys = dev->input_dev->phys;
 		input_unregister_device(dev->input_dev);
-		kfree(dev->input_dev->phys);
-		input_free_device(dev->input_dev);
+		kfree(phys);
 		dev->input_dev = NULL;
 	}
 }
+#endif
+
+/**
+ * @param dev Device structure
+ *
+ * @brief Take the device away from user space
+ *
+ * Marks the device as disconnected and removes the video devices, their
+ * files and the input device. The video devices are released, and drop
+ * their reference on the device, once the last file using them is closed.
+ * Only the first call does anything.
+ */
+static void usb_sn9c20x_unregister(struct usb_sn9c20x *dev)
+{
+	int disconnected;
+
+	mutex_lock(&dev->open_lock);
+	disconnected = dev->disconnected;
+	dev->disconnected = 1;
+	mutex_unlock(&dev->open_lock);
+
+	if (disconnected)
+		return;
+
+	flush_delayed_work(&dev->standby_work);
+	usb_sn9c20x_watchdog_stop(dev);
+	usb_sn9c20x_gpio_stop(dev);
+
+	if (dev->init_error == 0) {
+		sn9c20x_remove_sysfs_files(dev->vdev);
+		sn9c20x_remove_debugfs_files(dev);
+	}
+	sn9c20x_meta_unregister(dev);
+	v4l_sn9c20x_unregister_video_device(dev);
+#ifdef CONFIG_SN9C20X_EVDEV
+	sn9c20x_input_cleanup(dev);
+#endif
+}
+
+/**
+ * @param work Initialization work of the device
+ *
+ * @brief Initialize the hardware of a newly plugged device
+ *
+ * The bridge and sensor setup, the sensor probe in particular, takes a
+ * while. It runs here rather than in the probe so that several cameras
+ * get initialized in parallel. Opening the device waits for it, a device
+ * that fails to initialize is taken away again.
+ */
+static void usb_sn9c20x_init_work(struct work_struct *work)
+{
+	struct usb_sn9c20x *dev;
+	int ret;
+
+	dev = container_of(work, struct usb_sn9c20x, init_work);
+
+	ret = sn9c20x_initialize(dev);
+	if (ret < 0)
+		goto done;
+
+	usb_sn9c20x_default_settings(dev);
+
+#ifdef CONFIG_SN9C20X_EVDEV
+	ret = sn9c20x_input_init(dev);
+	if (ret < 0)
+		goto done;
+#endif
+
+	ret = usb_sn9c20x_gpio_init(dev);
+	if (ret < 0)
+		goto done;
+
+	/* Create the entries in the sys filesystem */
+	sn9c20x_create_sysfs_files(dev->vdev);
+
+	sn9c20x_create_debugfs_files(dev);
+done:
+	dev->init_error = ret;
+	if (ret < 0) {
+		UDIA_ERROR("Initialization failed (%d)\n", ret);
+		usb_sn9c20x_unregister(dev);
+	}
+	complete_all(&dev->init_done);
+}
 
 /**
  * @brief Load the driver
@@ -928,8 +2176,16 @@ static int usb_sn9c20x_probe(struct usb_interface *interface, const struct usb_d
 	}
 
 	kref_init(&dev->vopen);
-
-	dev->udev = udev;
+	mutex_init(&dev->open_lock);
+	INIT_WORK(&dev->init_work, usb_sn9c20x_init_work);
+	init_completion(&dev->init_done);
+	INIT_DELAYED_WORK(&dev->watchdog.work, usb_sn9c20x_watchdog_work);
+	mutex_init(&dev->ctrl_mutex);
+	spin_lock_init(&dev->profile.lock);
+	spin_lock_init(&dev->shadow.lock);
+
+	/* The USB device outlives its disconnection as long as we need it */
+	dev->udev = usb_get_dev(udev);
 	dev->interface = interface;
 
 	/* Read the product release */
@@ -943,11 +2199,6 @@ static int usb_sn9c20x_probe(struct usb_interface *interface, const struct usb_d
 	dev->camera.sensor = id->driver_info & 0xFF;
 	dev->camera.address = (id->driver_info >> 8) & 0xFF;
 
-	/* Initialize the camera */
-	ret = sn9c20x_initialize(dev);
-	if (ret < 0)
-		goto error;
-
 	/* Initialize the video device */
 	dev->vdev = video_device_alloc();
 
@@ -959,25 +2210,21 @@ static int usb_sn9c20x_probe(struct usb_interface *interface, const struct usb_d
 	/* Register the video device */
 	ret = v4l_sn9c20x_register_video_device(dev);
 
-	if (ret)
+	if (ret) {
+		video_device_release(dev->vdev);
+		dev->vdev = NULL;
 		goto free_dev;
+	}
 
-	/* Create the entries in the sys filesystem */
-	sn9c20x_create_sysfs_files(dev->vdev);
-
-	sn9c20x_create_debugfs_files(dev);
-
-#ifdef CONFIG_SN9C20X_EVDEV
-	ret = sn9c20x_input_init(dev);
-	if (ret < 0)
-		goto free_dev;
-#endif
+	/* The frame statistics are optional, go on without them */
+	if (sn9c20x_meta_register(dev) < 0)
+		UDIA_WARNING("No frame metadata device\n");
 
 	/* Save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
 
-	usb_sn9c20x_default_settings(dev);
-
+	/* The hardware is initialized in the background */
+	schedule_work(&dev->init_work);
 
 	return 0;
 
@@ -987,19 +2234,21 @@ error:
 	return ret;
 }
 
+/**
+ * @param kref Reference count of the device
+ *
+ * @brief Free the device once its last reference is dropped
+ *
+ * The video devices hold a reference until they are released, as do the
+ * opened files, so everything but the device structure is gone already.
+ */
 void usb_sn9c20x_delete(struct kref *kref)
 {
 	struct usb_sn9c20x *dev;
 	dev = container_of(kref, struct usb_sn9c20x, vopen);
 
-	if (dev->vdev != NULL) {
-		sn9c20x_remove_sysfs_files(dev->vdev);
-		sn9c20x_remove_debugfs_files(dev);
-		v4l_sn9c20x_unregister_video_device(dev);
-	}
-#ifdef CONFIG_SN9C20X_EVDEV
-	sn9c20x_input_cleanup(dev);
-#endif
+	usb_sn9c20x_gpio_cleanup(dev);
+	usb_put_dev(dev->udev);
 	kfree(dev);
 }
 
@@ -1008,6 +2257,9 @@ void usb_sn9c20x_delete(struct kref *kref)
  *
  * @brief This function is called when the device is disconnected
  *   or when the kernel module is unloaded.
+ *
+ * Only this device is locked. Files still open get -ENODEV from then on,
+ * the device is freed when the last of them is closed.
  */
 static void usb_sn9c20x_disconnect(struct usb_interface *interface)
 {
@@ -1017,9 +2269,14 @@ static void usb_sn9c20x_disconnect(struct usb_interface *interface)
 
 	usb_set_intfdata(interface, NULL);
 
-	mutex_lock(&open_lock);
+	/* Let a running initialization finish, a pending one never runs */
+	if (cancel_work_sync(&dev->init_work)) {
+		dev->init_error = -ENODEV;
+		complete_all(&dev->init_done);
+	}
+
+	usb_sn9c20x_unregister(dev);
 	kref_put(&dev->vopen, usb_sn9c20x_delete);
-	mutex_unlock(&open_lock);
 }
 
 static int usb_sn9c20x_suspend(struct usb_interface *intf, pm_message_t message)
@@ -1032,12 +2289,21 @@ static int usb_sn9c20x_suspend(struct usb_interface *intf, pm_message_t message)
 	if (dev->interface != intf)
 		return -EINVAL;
 
+	flush_work(&dev->init_work);
+	cancel_delayed_work_sync(&dev->watchdog.work);
+	usb_sn9c20x_gpio_stop(dev);
+
+	/* Don't keep URBs in standby across a suspend */
+	flush_delayed_work(&dev->standby_work);
+
 	if (!sn9c20x_queue_streaming(&dev->queue))
 		return 0;
 
 	dev->frozen = 1;
 	usb_sn9c20x_uninit_urbs(dev, 0);
-	usb_set_interface(dev->udev, 0, 0);
+	cancel_work_sync(&dev->auto_work);
+	cancel_work_sync(&dev->shot_work);
+	usb_sn9c20x_set_interface(dev, 0);
 	return 0;
 }
 
@@ -1046,6 +2312,7 @@ static int usb_sn9c20x_suspend(struct usb_interface *intf, pm_message_t message)
 static int _usb_sn9c20x_resume(struct usb_interface *intf, int reset)
 {
 	struct usb_sn9c20x *dev = usb_get_intfdata(intf);
+	int streaming;
 
 	UDIA_INFO("Resuming interface: %u\n",
 		  intf->cur_altsetting->desc.bInterfaceNumber);
@@ -1053,17 +2320,39 @@ static int _usb_sn9c20x_resume(struct usb_interface *intf, int reset)
 	if (dev->interface != intf)
 		return -EINVAL;
 
-	if (reset && sn9c20x_reset_device(dev) < 0)
+	/* Time from the resume to the first frame */
+	streaming = sn9c20x_queue_streaming(&dev->queue);
+	if (streaming)
+		usb_sn9c20x_profile_start(dev);
+
+	if (reset && sn9c20x_restore_device(dev) < 0)
 		return -EINVAL;
 
-	if (!sn9c20x_queue_streaming(&dev->queue))
+	usb_sn9c20x_gpio_start(dev);
+
+	if (!streaming)
 		return 0;
+	usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_RESTORE);
+	usb_sn9c20x_watchdog_start(dev);
 
 	dev->frozen = 0;
 	if (usb_sn9c20x_init_urbs(dev) < 0)
 		sn9c20x_queue_enable(&dev->queue, 0);
 
+	/* A single-shot stream goes on waiting for its trigger or frame */
+	switch (atomic_read(&dev->shot)) {
+	case SN9C20X_SHOT_IDLE:
+	case SN9C20X_SHOT_DONE:
+		atomic_set(&dev->shot, SN9C20X_SHOT_IDLE);
+		usb_sn9c20x_stop_urbs(dev);
+		return 0;
+	case SN9C20X_SHOT_CAPTURE:
+		atomic_set(&dev->shot, SN9C20X_SHOT_WAIT);
+		break;
+	}
+
 	sn9c20x_enable_video(dev, 1);
+	usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_ENABLE);
 	return 0;
 }
 
@@ -1080,6 +2369,41 @@ static int usb_sn9c20x_reset_resume(struct usb_interface *intf)
 	return _usb_sn9c20x_resume(intf, 1);
 }
 
+/**
+ * @param intf USB interface
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Stop the stream before the device is reset
+ *
+ * Resets are queued by the stream watchdog, the stream is stopped as for
+ * a suspend.
+ */
+static int usb_sn9c20x_pre_reset(struct usb_interface *intf)
+{
+	UDIA_DEBUG("usb_sn9c20x_pre_reset()\n");
+
+	if (usb_get_intfdata(intf) == NULL)
+		return 0;
+	return usb_sn9c20x_suspend(intf, PMSG_SUSPEND);
+}
+
+/**
+ * @param intf USB interface
+ *
+ * @returns 0 if all is OK
+ *
+ * @brief Restore the device and restart the stream after a reset
+ */
+static int usb_sn9c20x_post_reset(struct usb_interface *intf)
+{
+	UDIA_DEBUG("usb_sn9c20x_post_reset()\n");
+
+	if (usb_get_intfdata(intf) == NULL)
+		return 0;
+	return _usb_sn9c20x_resume(intf, 1);
+}
+
 /**
  * @var usb_sn9c20x_driver
  *
@@ -1092,11 +2416,15 @@ static struct usb_driver usb_sn9c20x_driver = {
 	.suspend = usb_sn9c20x_suspend,
 	.resume	= usb_sn9c20x_resume,
 	.reset_resume = usb_sn9c20x_reset_resume,
+	.pre_reset = usb_sn9c20x_pre_reset,
+	.post_reset = usb_sn9c20x_post_reset,
 	.id_table = sn9c20x_table,
 };
 
 module_param(fps, byte, 0444);			/**< @brief Module parameter frames per second */
 module_param(bulk, byte, 0444);
+module_param(bulk_size, uint, 0444);
+module_param(zero_copy, byte, 0444);
 module_param(jpeg, byte, 0444);
 module_param(bandwidth, byte, 0444);
 module_param(hflip, byte, 0444);		/**< @brief Module parameter horizontal flip process */
@@ -1105,6 +2433,7 @@ module_param(flip_detect, byte, 0444);		/**< @brief Module parameter flip detect
 module_param(auto_exposure, byte, 0444);	/**< @brief Module parameter automatic exposure control */
 module_param(auto_gain, byte, 0444);		/**< @brief Module parameter automatic gain control */
 module_param(auto_whitebalance, byte, 0444);	/**< @brief Module parameter automatic whitebalance control */
+module_param(power_line, int, 0444);		/**< @brief Module parameter power line frequency */
 module_param(brightness, ushort, 0444);		/**< @brief Module parameter brightness */
 module_param(gamma, ushort, 0444);		/**< @brief Module parameter gamma */
 module_param(saturation, ushort, 0444);		/**< @brief Module parameter saturation */
@@ -1118,6 +2447,9 @@ module_param(gain, ushort, 0444);		/**< @brief Module parameter gain */
 
 module_param(min_buffers, byte, 0444);
 module_param(max_buffers, byte, 0444);
+module_param(drop_corrupted, byte, 0444);
+module_param(standby_timeout, uint, 0444);
+module_param(watchdog, byte, 0444);
 
 module_param(log_level, byte, 0444);
 
@@ -1199,10 +2531,16 @@ static int __init usb_sn9c20x_init(void)
 		auto_gain = 0;
 	}
 
-	if (auto_whitebalance != 0 && auto_whitebalance != 1) {
-		UDIA_WARNING("Automatic whitebalance should be 0 or 1! "
-			     "Defaulting to 1\n");
-		auto_whitebalance = 1;
+	if (auto_whitebalance > 2) {
+		UDIA_WARNING("Automatic whitebalance should be 0, 1 or 2! "
+			     "Defaulting to 2\n");
+		auto_whitebalance = 2;
+	}
+
+	if (power_line < -1 || power_line > 2) {
+		UDIA_WARNING("Power line frequency should be -1, 0, 1 or 2! "
+			     "Defaulting to -1\n");
+		power_line = -1;
 	}
 
 	if (min_buffers < 2) {
@@ -1254,13 +2592,16 @@ module_exit(usb_sn9c20x_exit);	/**< @brief Module exit */
 MODULE_PARM_DESC(fps, "Frames per second [10-30]");		/**< @brief Description of 'fps' parameter */
 MODULE_PARM_DESC(jpeg, "Enable JPEG support (default is auto-detect)");
 MODULE_PARM_DESC(bulk, "Enable Bulk transfer (default is to use ISOC)");
+MODULE_PARM_DESC(bulk_size, "Size of the bulk transfers in KB (default is from the frame size)");
+MODULE_PARM_DESC(zero_copy, "Receive uncompressed bulk streams straight into the video buffers (Linux 3.13 or newer)");
 MODULE_PARM_DESC(bandwidth, "Bandwidth Setting (only for ISOC)");
 MODULE_PARM_DESC(hflip, "Horizontal image flip");		/**< @brief Description of 'hflip' parameter */
 MODULE_PARM_DESC(vflip, "Vertical image flip");			/**< @brief Description of 'vflip' parameter */
 MODULE_PARM_DESC(flip_detect, "Image flip detection");		/**< @brief Description of 'vflip_detect' parameter */
 MODULE_PARM_DESC(auto_exposure, "Automatic exposure control");	/**< @brief Description of 'auto_exposure' parameter */
 MODULE_PARM_DESC(auto_gain, "Automatic gain control");		/**< @brief Description of 'auto_gain' parameter */
-MODULE_PARM_DESC(auto_whitebalance, "Automatic whitebalance");	/**< @brief Description of 'auto_whitebalance' parameter */
+MODULE_PARM_DESC(auto_whitebalance, "Automatic whitebalance: 0 off, 1 on (in software without a sensor AWB), 2 on for sensors with AWB (default)");	/**< @brief Description of 'auto_whitebalance' parameter */
+MODULE_PARM_DESC(power_line, "Power line frequency: 0 none, 1 50 Hz, 2 60 Hz (default is the sensor setting)");	/**< @brief Description of 'power_line' parameter */
 MODULE_PARM_DESC(brightness, "Brightness setting");		/**< @brief Description of 'brightness' parameter */
 MODULE_PARM_DESC(gamma, "Gamma setting");			/**< @brief Description of 'gamma' parameter */
 MODULE_PARM_DESC(saturation, "Saturation setting");		/**< @brief Description of 'saturation' parameter */
@@ -1274,6 +2615,9 @@ MODULE_PARM_DESC(blue_gain, "Blue Gain setting"); 		/**< @brief Description of '
 
 MODULE_PARM_DESC(min_buffers, "Minimum number of image buffers");
 MODULE_PARM_DESC(max_buffers, "Maximum number of image buffers");
+MODULE_PARM_DESC(drop_corrupted, "Drop frames with lost payload instead of flagging them as erroneous");
+MODULE_PARM_DESC(standby_timeout, "Time in ms the URBs and buffers are kept after the stream stopped (0 disables it)");
+MODULE_PARM_DESC(watchdog, "Frame intervals without a frame before a stalled stream is recovered (0 disables it)");
 MODULE_PARM_DESC(log_level, " <n>\n"
 			    "Driver log level\n"
 			    "1  = info (default)\n"
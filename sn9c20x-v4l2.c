@@ -41,6 +41,15 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
 #include <media/v4l2-ioctl.h>
 #endif
+#ifdef SN9C20X_EVENTS
+#include <media/v4l2-fh.h>
+#include <media/v4l2-event.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+#define SN9C20X_SUB_CONST const
+#else
+#define SN9C20X_SUB_CONST
+#endif
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
 static struct file_operations v4l_sn9c20x_fops;
@@ -179,6 +188,104 @@ static struct v4l2_queryctrl sn9c20x_controls[] = {
 		.maximum = 1,
 		.step	 = 1,
 	},
+	{
+		.id	 = V4L2_CID_POWER_LINE_FREQUENCY,
+		.type	 = V4L2_CTRL_TYPE_MENU,
+		.name	 = "Power line frequency",
+		.minimum = V4L2_CID_POWER_LINE_FREQUENCY_DISABLED,
+		.maximum = V4L2_CID_POWER_LINE_FREQUENCY_60HZ,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_LATEST_FRAME,
+		.type	 = V4L2_CTRL_TYPE_BOOLEAN,
+		.name	 = "Latest frame only",
+		.minimum = 0,
+		.maximum = 1,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_SLICE_LINES,
+		.type	 = V4L2_CTRL_TYPE_INTEGER,
+		.name	 = "Progress update lines",
+		.minimum = 0,
+		.maximum = 1024,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_METERING,
+		.type	 = V4L2_CTRL_TYPE_MENU,
+		.name	 = "Metering",
+		.minimum = SN9C20X_METERING_AVERAGE,
+		.maximum = SN9C20X_METERING_RECT,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_METER_LEFT,
+		.type	 = V4L2_CTRL_TYPE_INTEGER,
+		.name	 = "Metering left (%)",
+		.minimum = 0,
+		.maximum = 100,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_METER_TOP,
+		.type	 = V4L2_CTRL_TYPE_INTEGER,
+		.name	 = "Metering top (%)",
+		.minimum = 0,
+		.maximum = 100,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_METER_WIDTH,
+		.type	 = V4L2_CTRL_TYPE_INTEGER,
+		.name	 = "Metering width (%)",
+		.minimum = 0,
+		.maximum = 100,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_METER_HEIGHT,
+		.type	 = V4L2_CTRL_TYPE_INTEGER,
+		.name	 = "Metering height (%)",
+		.minimum = 0,
+		.maximum = 100,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_SINGLE_SHOT,
+		.type	 = V4L2_CTRL_TYPE_BOOLEAN,
+		.name	 = "Single shot",
+		.minimum = 0,
+		.maximum = 1,
+		.step	 = 1,
+	},
+	{
+		.id	 = V4L2_CID_SN9C20X_TRIGGER,
+		.type	 = V4L2_CTRL_TYPE_BUTTON,
+		.name	 = "Trigger",
+		.minimum = 0,
+		.maximum = 0,
+		.step	 = 0,
+	},
+};
+
+/**
+ * @var sn9c20x_menus
+ *   Item names of the menu controls
+ */
+static const struct {
+	__u32 id;
+	const char *items[4];
+} sn9c20x_menus[] = {
+	{
+		V4L2_CID_POWER_LINE_FREQUENCY,
+		{"Disabled", "50 Hz", "60 Hz"},
+	},
+	{
+		V4L2_CID_SN9C20X_METERING,
+		{"Average", "Centre weighted", "Spot", "Rectangle"},
+	},
 };
 
 void v4l2_set_control_default(struct usb_sn9c20x *dev, __u32 ctrl, __u16 value)
@@ -195,10 +302,68 @@ void v4l2_set_control_default(struct usb_sn9c20x *dev, __u32 ctrl, __u16 value)
 	}
 }
 
+/**
+ * @param dev Device structure
+ * @param sequence Sequence number of the frame starting
+ *
+ * @brief Signal the start of a frame to the subscribed file handles
+ *
+ * Called from the completion handler when a frame header is received.
+ */
+void v4l2_notify_frame_sync(struct usb_sn9c20x *dev, __u32 sequence)
+{
+#if defined(SN9C20X_EVENTS) && defined(V4L2_EVENT_FRAME_SYNC)
+	struct v4l2_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_FRAME_SYNC;
+	ev.u.frame_sync.frame_sequence = sequence;
+	v4l2_event_queue(dev->vdev, &ev);
+#endif
+}
+
+/**
+ * @param dev Device structure
+ * @param ctrl Control ID
+ * @param value New value of the control
+ *
+ * @brief Signal a control change to the subscribed file handles
+ *
+ * Applications following the controls the driver changes by itself (soft
+ * auto-exposure, flip detection) get notified instead of polling them.
+ */
+void v4l2_notify_control(struct usb_sn9c20x *dev, __u32 ctrl, __s32 value)
+{
+#ifdef SN9C20X_EVENTS
+	struct v4l2_event ev;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sn9c20x_controls); i++) {
+		if (sn9c20x_controls[i].id == ctrl)
+			break;
+	}
+	if (i == ARRAY_SIZE(sn9c20x_controls) || dev->vdev == NULL ||
+	    !video_is_registered(dev->vdev))
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_CTRL;
+	ev.id = ctrl;
+	ev.u.ctrl.changes = V4L2_EVENT_CTRL_CH_VALUE;
+	ev.u.ctrl.type = sn9c20x_controls[i].type;
+	ev.u.ctrl.value = value;
+	ev.u.ctrl.minimum = sn9c20x_controls[i].minimum;
+	ev.u.ctrl.maximum = sn9c20x_controls[i].maximum;
+	ev.u.ctrl.step = sn9c20x_controls[i].step;
+	ev.u.ctrl.default_value = sn9c20x_controls[i].default_value;
+	v4l2_event_queue(dev->vdev, &ev);
+#endif
+}
+
 void v4l_add_jpegheader(struct usb_sn9c20x *dev, __u8 *buffer,
 	__u32 buffer_size)
 {
-	static __u8 jpeg_header[589] = {
+	static __u8 jpeg_header[SN9C20X_JPEG_HEADER_SIZE] = {
 		0xff, 0xd8, 0xff, 0xdb, 0x00, 0x84, 0x00, 0x06, 0x04, 0x05,
 		0x06, 0x05, 0x04, 0x06, 0x06, 0x05, 0x06, 0x07, 0x07, 0x06,
 		0x08, 0x0a, 0x10, 0x0a, 0x0a, 0x09, 0x09, 0x0a, 0x14, 0x0e,
@@ -259,37 +424,19 @@ void v4l_add_jpegheader(struct usb_sn9c20x *dev, __u8 *buffer,
 		0x11, 0x01, 0x03, 0x11, 0x01, 0xff, 0xda, 0x00, 0x0c, 0x03,
 		0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00
 	};
-	static __u8 qtable1[128] = {
-		0x0d, 0x08, 0x08, 0x0d, 0x08, 0x08, 0x0d, 0x0d,
-		0x0d, 0x0d, 0x11, 0x0d, 0x0d, 0x11, 0x15, 0x21,
-		0x15, 0x15, 0x11, 0x11, 0x15, 0x2a, 0x1d, 0x1d,
-		0x19, 0x21, 0x32, 0x2a, 0x32, 0x32, 0x2e, 0x2a,
-		0x2e, 0x2e, 0x36, 0x3a, 0x4b, 0x43, 0x36, 0x3a,
-		0x47, 0x3a, 0x2e, 0x2e, 0x43, 0x5c, 0x43, 0x47,
-		0x4f, 0x54, 0x58, 0x58, 0x58, 0x32, 0x3f, 0x60,
-		0x64, 0x5c, 0x54, 0x64, 0x4b, 0x54, 0x58, 0x54,
-		0x0d, 0x11, 0x11, 0x15, 0x11, 0x15, 0x26, 0x15,
-		0x15, 0x26, 0x54, 0x36, 0x2e, 0x36, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
-		0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54
-	};
 
 	jpeg_header[6] = 0x00;
 	jpeg_header[71] = 0x01;
-	memcpy(jpeg_header + 7, qtable1, 64);
-	memcpy(jpeg_header + 8 + 64, qtable1+64, 64);
+	memcpy(jpeg_header + 7, sn9c20x_qtables, 64);
+	memcpy(jpeg_header + 8 + 64, sn9c20x_qtables + 64, 64);
 	jpeg_header[564] = dev->vsettings.format.width & 0xFF;
 	jpeg_header[563] = (dev->vsettings.format.width >> 8) & 0xFF;
 	jpeg_header[562] = dev->vsettings.format.height & 0xFF;
 	jpeg_header[561] = (dev->vsettings.format.height >> 8) & 0xFF;
 	jpeg_header[567] = 0x21;
 
-	memmove(buffer+589, buffer, buffer_size);
-	memcpy(buffer, jpeg_header, 589);
+	memmove(buffer + SN9C20X_JPEG_HEADER_SIZE, buffer, buffer_size);
+	memcpy(buffer, jpeg_header, SN9C20X_JPEG_HEADER_SIZE);
 }
 /**
  * @brief Get V4L privileges
@@ -309,14 +456,14 @@ int v4l_get_privileges(struct file *file)
 	if (dev->owner == file)
 		return 0;
 
-	mutex_lock(&open_lock);
+	mutex_lock(&dev->open_lock);
 	if (dev->owner != NULL) {
 		ret = -EBUSY;
 		goto done;
 	}
 	dev->owner = file;
 done:
-	mutex_unlock(&open_lock);
+	mutex_unlock(&dev->open_lock);
 	return ret;
 }
 
@@ -357,6 +504,110 @@ void v4l_drop_privileges(struct file *file)
 		dev->owner = NULL;
 }
 
+/**
+ * @brief Leave the warm standby
+ *
+ * @param work Standby work of the device
+ *
+ * Runs once the standby timeout expired without the stream being restarted.
+ * The URBs and the bandwidth of the alternate setting are released, as are
+ * the video buffers if nobody owns the device anymore. Nothing is torn
+ * down if a stream was started in the meantime.
+ */
+static void v4l2_standby_work(struct work_struct *work)
+{
+	struct usb_sn9c20x *dev;
+
+	dev = container_of(work, struct usb_sn9c20x, standby_work.work);
+
+	/* Streams enable the queue under its mutex before the URBs */
+	mutex_lock(&dev->queue.mutex);
+	if (dev->mode != SN9C20X_MODE_IDLE ||
+	    sn9c20x_queue_streaming(&dev->queue)) {
+		mutex_unlock(&dev->queue.mutex);
+		return;
+	}
+
+	UDIA_DEBUG("Leaving warm standby\n");
+
+	usb_sn9c20x_uninit_urbs(dev, 1);
+	usb_sn9c20x_set_interface(dev, 0);
+
+	if (dev->owner == NULL)
+		sn9c20x_free_buffers(&dev->queue);
+	mutex_unlock(&dev->queue.mutex);
+}
+
+/**
+ * @brief Idle a single-shot stream once its frame is captured
+ *
+ * @param work Shot work of the device
+ *
+ * The video is disabled and the URBs killed, they stay allocated together
+ * with the alternate setting for the next trigger.
+ */
+static void v4l2_shot_work(struct work_struct *work)
+{
+	struct usb_sn9c20x *dev;
+
+	dev = container_of(work, struct usb_sn9c20x, shot_work);
+
+	mutex_lock(&dev->ctrl_mutex);
+	if (atomic_read(&dev->shot) == SN9C20X_SHOT_DONE) {
+		sn9c20x_enable_video(dev, 0);
+		usb_sn9c20x_stop_urbs(dev);
+		atomic_set(&dev->shot, SN9C20X_SHOT_IDLE);
+	}
+	mutex_unlock(&dev->ctrl_mutex);
+}
+
+/**
+ * @brief Capture a single frame
+ *
+ * @param dev Pointer to device structure
+ *
+ * @returns 0 or negative error value
+ *
+ * Resubmits the URBs kept by the single-shot stream and enables the video
+ * until a complete frame was received. The exposure and gain are left as
+ * they are between the shots. The start profiler runs from the trigger,
+ * so the time to the first frame is the trigger to frame latency.
+ */
+int v4l2_trigger_shot(struct usb_sn9c20x *dev)
+{
+	int ret;
+
+	mutex_lock(&dev->ctrl_mutex);
+
+	switch (atomic_read(&dev->shot)) {
+	case SN9C20X_SHOT_OFF:
+		ret = -EINVAL;
+		goto done;
+	case SN9C20X_SHOT_IDLE:
+		break;
+	default:
+		ret = -EBUSY;
+		goto done;
+	}
+
+	usb_sn9c20x_profile_start(dev);
+	atomic_set(&dev->shot, SN9C20X_SHOT_WAIT);
+
+	ret = usb_sn9c20x_init_urbs(dev);
+	if (ret == 0)
+		ret = sn9c20x_enable_video(dev, 1);
+
+	if (ret < 0) {
+		atomic_set(&dev->shot, SN9C20X_SHOT_IDLE);
+		usb_sn9c20x_stop_urbs(dev);
+	} else {
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_ENABLE);
+	}
+done:
+	mutex_unlock(&dev->ctrl_mutex);
+	return ret;
+}
+
 /**
  * @brief Enable video stream
  *
@@ -365,14 +616,35 @@ void v4l_drop_privileges(struct file *file)
  *
  * @returns 0 or negative error value
  *
+ * When a standby timeout is set, stopping the stream only kills the URBs.
+ * They are kept allocated, together with the alternate setting, until the
+ * timeout expires so that a stream restarted in the meantime produces its
+ * first frame without going through the whole setup again.
+ *
+ * A stream started in single-shot mode is set up the same way but idles
+ * with its URBs killed until v4l2_trigger_shot() is called.
  */
 int v4l2_enable_video(struct usb_sn9c20x *dev, int mode)
 {
 	int ret;
 
 	if (mode == SN9C20X_MODE_IDLE) {
+		usb_sn9c20x_watchdog_stop(dev);
+
+		mutex_lock(&dev->ctrl_mutex);
+		atomic_set(&dev->shot, SN9C20X_SHOT_OFF);
+		mutex_unlock(&dev->ctrl_mutex);
+		cancel_work_sync(&dev->shot_work);
+
 		sn9c20x_enable_video(dev, 0);
-		usb_sn9c20x_uninit_urbs(dev, 1);
+		if (dev->standby_timeout) {
+			usb_sn9c20x_stop_urbs(dev);
+			schedule_delayed_work(&dev->standby_work,
+				msecs_to_jiffies(dev->standby_timeout));
+		} else {
+			usb_sn9c20x_uninit_urbs(dev, 1);
+		}
+		cancel_work_sync(&dev->auto_work);
 		sn9c20x_queue_enable(&dev->queue, 0);
 		dev->mode = mode;
 		return 0;
@@ -381,21 +653,38 @@ int v4l2_enable_video(struct usb_sn9c20x *dev, int mode)
 	if (dev->mode != SN9C20X_MODE_IDLE)
 		return -EBUSY;
 
+	cancel_delayed_work_sync(&dev->standby_work);
+
+	usb_sn9c20x_profile_start(dev);
+
+	sn9c20x_queue_slices(&dev->queue, dev->queue.slice_lines,
+		dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG ?
+		0 : dev->vsettings.format.bytesperline);
+
+	/* Chooses how the completion handler stores the frames */
+	if (dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG)
+		dev->queue.flags &= ~SN9C20X_QUEUE_DROP_INCOMPLETE;
+	else
+		dev->queue.flags |= SN9C20X_QUEUE_DROP_INCOMPLETE;
+
 	if (sn9c20x_queue_enable(&dev->queue, 1) < 0)
 		return -EBUSY;
+	usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_QUEUE);
 
 	ret = usb_sn9c20x_init_urbs(dev);
 
 	if (ret)
 		return ret;
 
-	sn9c20x_enable_video(dev, 1);
+	if (mode == SN9C20X_MODE_STREAM && dev->single_shot) {
+		atomic_set(&dev->shot, SN9C20X_SHOT_IDLE);
+		usb_sn9c20x_stop_urbs(dev);
+	} else {
+		sn9c20x_enable_video(dev, 1);
+		usb_sn9c20x_profile_mark(dev, SN9C20X_PHASE_ENABLE);
+	}
 	dev->mode = mode;
-
-	if (dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG)
-		dev->queue.flags &= ~SN9C20X_QUEUE_DROP_INCOMPLETE;
-	else
-		dev->queue.flags |= SN9C20X_QUEUE_DROP_INCOMPLETE;
+	usb_sn9c20x_watchdog_start(dev);
 
 	return 0;
 }
@@ -420,17 +709,41 @@ static int v4l_sn9c20x_open(struct file *fp)
 
 	struct usb_sn9c20x *dev;
 	struct video_device *vdev;
-
-	mutex_lock(&open_lock);
+#ifdef SN9C20X_EVENTS
+	struct v4l2_fh *fh;
+#endif
 
 	vdev = video_devdata(fp);
 	dev = video_get_drvdata(video_devdata(fp));
 
+	/* The hardware is initialized in the background after the probe */
+	ret = wait_for_completion_interruptible(&dev->init_done);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&dev->open_lock);
+
+	if (dev->disconnected) {
+		mutex_unlock(&dev->open_lock);
+		return -ENODEV;
+	}
+
+#ifdef SN9C20X_EVENTS
+	fh = kzalloc(sizeof(*fh), GFP_KERNEL);
+	if (fh == NULL) {
+		mutex_unlock(&dev->open_lock);
+		return -ENOMEM;
+	}
+	v4l2_fh_init(fh, vdev);
+	v4l2_fh_add(fh);
+	fp->private_data = fh;
+#else
 	fp->private_data = vdev;
+#endif
 
 	kref_get(&dev->vopen);
 
-	mutex_unlock(&open_lock);
+	mutex_unlock(&dev->open_lock);
 	return ret;
 }
 
@@ -454,24 +767,35 @@ static int v4l_sn9c20x_release(struct file *fp)
 	struct usb_sn9c20x *dev;
 	struct video_device *vdev;
 
-	mutex_lock(&open_lock);
-
 	vdev = video_devdata(fp);
 	dev = video_get_drvdata(video_devdata(fp));
 
+	mutex_lock(&dev->open_lock);
+
 	if (v4l_has_privileges(fp)) {
 		v4l2_enable_video(dev, SN9C20X_MODE_IDLE);
 
-		mutex_lock(&dev->queue.mutex);
-		sn9c20x_free_buffers(&dev->queue);
-		mutex_unlock(&dev->queue.mutex);
+		/* In standby the buffers are released by the standby work */
+		if (!dev->standby_timeout) {
+			mutex_lock(&dev->queue.mutex);
+			sn9c20x_free_buffers(&dev->queue);
+			mutex_unlock(&dev->queue.mutex);
+		}
 	}
 
 	v4l_drop_privileges(fp);
 
-	kref_put(&dev->vopen, usb_sn9c20x_delete);
+#ifdef SN9C20X_EVENTS
+	v4l2_fh_del(fp->private_data);
+	v4l2_fh_exit(fp->private_data);
+	kfree(fp->private_data);
+	fp->private_data = NULL;
+#endif
+
+	mutex_unlock(&dev->open_lock);
 
-	mutex_unlock(&open_lock);
+	/* Can free the device, its lock included */
+	kref_put(&dev->vopen, usb_sn9c20x_delete);
 	return 0;
 }
 
@@ -510,6 +834,11 @@ static ssize_t v4l_sn9c20x_read(struct file *fp, char __user *buf,
 	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	buffer.memory = V4L2_MEMORY_MMAP;
 	if (dev->mode == SN9C20X_MODE_IDLE) {
+		if (dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG)
+			dev->vsettings.format.sizeimage = sn9c20x_jpeg_size(dev,
+				dev->vsettings.format.width,
+				dev->vsettings.format.height);
+
 		nbuffers = sn9c20x_alloc_buffers(&dev->queue, 2,
 					     dev->vsettings.format.sizeimage);
 		if (nbuffers < 0)
@@ -525,8 +854,6 @@ static ssize_t v4l_sn9c20x_read(struct file *fp, char __user *buf,
 			return ret;
 	}
 
-	dev_sn9c20x_call_constantly(dev);
-
 	if (dev->queue.read_buffer == NULL) {
 		ret = sn9c20x_dequeue_buffer(&dev->queue, &buffer,
 					      fp->f_flags & O_NONBLOCK);
@@ -537,7 +864,7 @@ static ssize_t v4l_sn9c20x_read(struct file *fp, char __user *buf,
 			UDIA_DEBUG("Adding JPEG Header\n");
 			v4l_add_jpegheader(dev, dev->queue.mem + buffer.m.offset,
 					   buffer.bytesused);
-			buffer.bytesused += 589;
+			buffer.bytesused += SN9C20X_JPEG_HEADER_SIZE;
 		}
 
 		dev->queue.read_buffer = &dev->queue.buffer[buffer.index];
@@ -571,6 +898,11 @@ static unsigned int v4l_sn9c20x_poll(struct file *fp, poll_table *wait)
 {
 	struct usb_sn9c20x *dev;
 	struct video_device *vdev;
+#ifdef SN9C20X_EVENTS
+	struct v4l2_fh *fh = fp->private_data;
+	unsigned long req_events = poll_requested_events(wait);
+	unsigned int mask = 0;
+#endif
 
 	vdev = video_devdata(fp);
 	dev = video_get_drvdata(video_devdata(fp));
@@ -580,7 +912,19 @@ static unsigned int v4l_sn9c20x_poll(struct file *fp, poll_table *wait)
 	if (vdev == NULL || dev == NULL)
 		return -EFAULT;
 
+#ifdef SN9C20X_EVENTS
+	/* Applications only waiting for events don't need buffers */
+	if (req_events & POLLPRI) {
+		poll_wait(fp, &fh->wait, wait);
+		if (v4l2_event_pending(fh))
+			mask |= POLLPRI;
+	}
+	if (req_events & (POLLIN | POLLRDNORM))
+		mask |= sn9c20x_queue_poll(&dev->queue, fp, wait);
+	return mask;
+#else
 	return sn9c20x_queue_poll(&dev->queue, fp, wait);
+#endif
 }
 
 /**
@@ -640,6 +984,22 @@ static int v4l_sn9c20x_mmap(struct file *fp, struct vm_area_struct *vma)
 
 	mutex_lock(&dev->queue.mutex);
 
+	/* The progress page is shared read-only */
+	if (vma->vm_pgoff == (SN9C20X_PROGRESS_OFFSET >> PAGE_SHIFT)) {
+		if (dev->queue.progress == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		if (size != PAGE_SIZE || (vma->vm_flags & VM_WRITE)) {
+			ret = -EINVAL;
+			goto done;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+		ret = vm_insert_page(vma, start,
+				     virt_to_page(dev->queue.progress));
+		goto done;
+	}
+
 	for (i = 0; i < dev->queue.count; ++i) {
 		buffer = &dev->queue.buffer[i];
 		if ((buffer->buf.m.offset >> PAGE_SHIFT) == vma->vm_pgoff)
@@ -686,7 +1046,7 @@ int sn9c20x_vidioc_querycap(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_QUERYCAP\n");
 
@@ -714,7 +1074,7 @@ int sn9c20x_vidioc_enum_framesizes(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("ENUM_FRAMESIZES\n");
 
@@ -821,7 +1181,7 @@ int sn9c20x_vidioc_queryctrl(struct file *file, void *priv,
 #endif
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_QUERYCTRL id = %d\n", ctrl->id);
 
@@ -871,6 +1231,37 @@ done:
 	return ret;
 }
 
+/**
+ * @param file
+ * @param priv
+ * @param menu
+ *
+ * @return 0 or negative error code
+ *
+ */
+int sn9c20x_vidioc_querymenu(struct file *file, void *priv,
+	struct v4l2_querymenu *menu)
+{
+	int i;
+
+	UDIA_DEBUG("VIDIOC_QUERYMENU id = %d index = %d\n", menu->id,
+		   menu->index);
+
+	for (i = 0; i < ARRAY_SIZE(sn9c20x_menus); i++) {
+		if (sn9c20x_menus[i].id != menu->id)
+			continue;
+		if (menu->index >= ARRAY_SIZE(sn9c20x_menus[i].items) ||
+		    sn9c20x_menus[i].items[menu->index] == NULL)
+			return -EINVAL;
+		strlcpy(menu->name, sn9c20x_menus[i].items[menu->index],
+			sizeof(menu->name));
+		menu->reserved = 0;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
 /**
  * @param file
  * @param priv
@@ -884,7 +1275,7 @@ int sn9c20x_vidioc_g_ctrl(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("GET CTRL id=%d\n", ctrl->id);
 
@@ -949,6 +1340,43 @@ int sn9c20x_vidioc_g_ctrl(struct file *file, void *priv,
 		ctrl->value = dev->vsettings.auto_whitebalance;
 		break;
 
+	case V4L2_CID_SN9C20X_LATEST_FRAME:
+		ctrl->value = !!(dev->queue.flags &
+				 SN9C20X_QUEUE_LATEST_FRAME);
+		break;
+
+	case V4L2_CID_SN9C20X_SLICE_LINES:
+		ctrl->value = dev->queue.slice_lines;
+		break;
+
+	case V4L2_CID_SN9C20X_METERING:
+		ctrl->value = dev->vsettings.metering;
+		break;
+
+	case V4L2_CID_POWER_LINE_FREQUENCY:
+		ctrl->value = dev->vsettings.power_line;
+		break;
+
+	case V4L2_CID_SN9C20X_METER_LEFT:
+		ctrl->value = dev->vsettings.meter_left;
+		break;
+
+	case V4L2_CID_SN9C20X_METER_TOP:
+		ctrl->value = dev->vsettings.meter_top;
+		break;
+
+	case V4L2_CID_SN9C20X_METER_WIDTH:
+		ctrl->value = dev->vsettings.meter_width;
+		break;
+
+	case V4L2_CID_SN9C20X_METER_HEIGHT:
+		ctrl->value = dev->vsettings.meter_height;
+		break;
+
+	case V4L2_CID_SN9C20X_SINGLE_SHOT:
+		ctrl->value = dev->single_shot;
+		break;
+
 	default:
 		return -EINVAL;
 	}
@@ -970,15 +1398,45 @@ int sn9c20x_vidioc_s_ctrl(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("SET CTRL id=%d value=%d\n", ctrl->id, ctrl->value);
 
 	if ((ctrl->id == V4L2_CID_GAIN && dev->vsettings.auto_gain) ||
-	    (ctrl->id == V4L2_CID_EXPOSURE && dev->vsettings.auto_exposure)) {
+	    (ctrl->id == V4L2_CID_EXPOSURE && dev->vsettings.auto_exposure) ||
+	    ((ctrl->id == V4L2_CID_RED_BALANCE ||
+	      ctrl->id == V4L2_CID_BLUE_BALANCE) &&
+	     dev->vsettings.auto_whitebalance)) {
 		return -EBUSY;
 	}
 
+	/* Overwrite frames the application didn't dequeue yet instead of
+	 * dropping new ones */
+	if (ctrl->id == V4L2_CID_SN9C20X_LATEST_FRAME) {
+		sn9c20x_queue_latest_frame(&dev->queue, ctrl->value);
+		return 0;
+	}
+
+	/* Publish the progress of the frame every so many lines */
+	if (ctrl->id == V4L2_CID_SN9C20X_SLICE_LINES) {
+		if (ctrl->value < 0 || ctrl->value > 1024)
+			return -ERANGE;
+		sn9c20x_queue_slices(&dev->queue, ctrl->value,
+				     dev->queue.bytesperline);
+		return 0;
+	}
+
+	/* Only capture a frame when triggered, takes effect on STREAMON */
+	if (ctrl->id == V4L2_CID_SN9C20X_SINGLE_SHOT) {
+		if (dev->mode != SN9C20X_MODE_IDLE)
+			return -EBUSY;
+		dev->single_shot = !!ctrl->value;
+		return 0;
+	}
+
+	if (ctrl->id == V4L2_CID_SN9C20X_TRIGGER)
+		return v4l2_trigger_shot(dev);
+
 	return sn9c20x_set_camera_control(dev,
 					  ctrl->id,
 					  ctrl->value);
@@ -997,7 +1455,7 @@ int sn9c20x_vidioc_enum_fmt_cap(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_ENUM_FMT %d\n", fmt->index);
 
@@ -1029,7 +1487,7 @@ int sn9c20x_vidioc_try_fmt_cap(struct file *file, void *priv,
 	int index;
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 	UDIA_DEBUG("TRY FMT %d\n", fmt->type);
 
 /*	when this code is used prevents mplayer from setting outfmt
@@ -1058,6 +1516,9 @@ int sn9c20x_vidioc_try_fmt_cap(struct file *file, void *priv,
 
 	fmt->fmt.pix.sizeimage = fmt->fmt.pix.height *
 			fmt->fmt.pix.bytesperline;
+	if (fmt->fmt.pix.pixelformat == V4L2_PIX_FMT_JPEG)
+		fmt->fmt.pix.sizeimage = sn9c20x_jpeg_size(dev,
+			fmt->fmt.pix.width, fmt->fmt.pix.height);
 
 	fmt->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
 	fmt->fmt.pix.priv = index;
@@ -1078,7 +1539,7 @@ int sn9c20x_vidioc_g_fmt_cap(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("GET FMT %d\n", fmt->type);
 
@@ -1102,7 +1563,7 @@ int sn9c20x_vidioc_s_fmt_cap(struct file *file, void *priv,
 	struct usb_sn9c20x *dev;
 	int ret;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("SET FMT %d : %d\n", fmt->type, fmt->fmt.pix.pixelformat);
 
@@ -1116,6 +1577,9 @@ int sn9c20x_vidioc_s_fmt_cap(struct file *file, void *priv,
 	if (ret)
 		return -EINVAL;
 
+	/* URBs kept in standby are sized for the previous format */
+	flush_delayed_work(&dev->standby_work);
+
 	sn9c20x_set_resolution(dev, fmt->fmt.pix.width, fmt->fmt.pix.height);
 	sn9c20x_set_format(dev, fmt->fmt.pix.pixelformat);
 	memcpy(&(dev->vsettings.format), &(fmt->fmt.pix), sizeof(fmt->fmt.pix));
@@ -1137,7 +1601,7 @@ int sn9c20x_vidioc_reqbufs(struct file *file, void *priv,
 	int ret = 0;
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	if (v4l_get_privileges(file) < 0) {
 		ret = -EBUSY;
@@ -1155,6 +1619,12 @@ int sn9c20x_vidioc_reqbufs(struct file *file, void *priv,
 		goto done;
 	}
 
+	/* The JPEG estimate grows with the frames that overflowed */
+	if (dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG)
+		dev->vsettings.format.sizeimage = sn9c20x_jpeg_size(dev,
+			dev->vsettings.format.width,
+			dev->vsettings.format.height);
+
 	ret = sn9c20x_alloc_buffers(&dev->queue, request->count,
 				     dev->vsettings.format.sizeimage);
 	if (ret < 0)
@@ -1180,7 +1650,7 @@ int sn9c20x_vidioc_querybuf(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("QUERY BUFFERS %d %d\n", buffer->index, dev->queue.count);
 
@@ -1206,7 +1676,7 @@ int sn9c20x_vidioc_qbuf(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_QBUF\n");
 
@@ -1228,9 +1698,11 @@ int sn9c20x_vidioc_dqbuf(struct file *file, void *priv,
 	struct v4l2_buffer *buffer)
 {
 	struct usb_sn9c20x *dev;
+	ktime_t start;
+	s64 us;
 	int ret = 0;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_DQBUF\n");
 
@@ -1242,14 +1714,19 @@ int sn9c20x_vidioc_dqbuf(struct file *file, void *priv,
 	if (ret < 0)
 		return ret;
 
+	start = ktime_get();
+
 	if (dev->vsettings.format.pixelformat == V4L2_PIX_FMT_JPEG) {
 		UDIA_DEBUG("Adding JPEG Header\n");
 		v4l_add_jpegheader(dev, dev->queue.mem + buffer->m.offset,
 				   buffer->bytesused);
-		buffer->bytesused += 589;
+		buffer->bytesused += SN9C20X_JPEG_HEADER_SIZE;
 	}
 
-	dev_sn9c20x_call_constantly(dev);
+	/* Time spent returning a frame that is already available */
+	us = ktime_us_delta(ktime_get(), start);
+	dev->dqbuf_latency[min_t(int, fls64(us),
+				 SN9C20X_LATENCY_BUCKETS - 1)]++;
 
 	return ret;
 }
@@ -1267,7 +1744,7 @@ int sn9c20x_vidioc_streamon(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_STREAMON\n");
 
@@ -1293,7 +1770,7 @@ int sn9c20x_vidioc_streamoff(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	UDIA_DEBUG("VIDIOC_STREAMOFF\n");
 
@@ -1317,7 +1794,7 @@ int sn9c20x_vidioc_g_param(struct file *file, void *priv,
 	struct usb_sn9c20x *dev;
 
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	if (param->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
@@ -1345,7 +1822,7 @@ int sn9c20x_vidioc_s_param(struct file *file, void *priv,
 {
 	struct usb_sn9c20x *dev;
 
-	dev = video_get_drvdata(priv);
+	dev = video_get_drvdata(video_devdata(file));
 
 	if (v4l_get_privileges(file))
 		return -EBUSY;
@@ -1414,6 +1891,38 @@ static long v4l_sn9c20x_ioctl(struct file *fp,
 
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+#ifdef SN9C20X_EVENTS
+/**
+ * @param fh File handle
+ * @param sub Event subscription
+ *
+ * @return 0 or negative error code
+ *
+ * @brief Subscribe to frame sync or control events
+ */
+static int sn9c20x_vidioc_subscribe_event(struct v4l2_fh *fh,
+	SN9C20X_SUB_CONST struct v4l2_event_subscription *sub)
+{
+	int i;
+
+	switch (sub->type) {
+#ifdef V4L2_EVENT_FRAME_SYNC
+	case V4L2_EVENT_FRAME_SYNC:
+		return v4l2_event_subscribe(fh, sub, 2, NULL);
+#endif
+	case V4L2_EVENT_CTRL:
+		for (i = 0; i < ARRAY_SIZE(sn9c20x_controls); i++) {
+			if (sn9c20x_controls[i].id == sub->id)
+				return v4l2_event_subscribe(fh, sub, 1, NULL);
+		}
+		return -EINVAL;
+	default:
+		return -EINVAL;
+	}
+}
+
+#endif
+
 static const struct v4l2_ioctl_ops sn9c20x_v4l2_ioctl_ops = {
 	.vidioc_querycap            = sn9c20x_vidioc_querycap,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
@@ -1429,6 +1938,7 @@ static const struct v4l2_ioctl_ops sn9c20x_v4l2_ioctl_ops = {
 	.vidioc_streamon            = sn9c20x_vidioc_streamon,
 	.vidioc_streamoff           = sn9c20x_vidioc_streamoff,
 	.vidioc_queryctrl           = sn9c20x_vidioc_queryctrl,
+	.vidioc_querymenu           = sn9c20x_vidioc_querymenu,
 	.vidioc_g_ctrl              = sn9c20x_vidioc_g_ctrl,
 	.vidioc_s_ctrl              = sn9c20x_vidioc_s_ctrl,
 	.vidioc_g_parm              = sn9c20x_vidioc_g_param,
@@ -1437,9 +1947,43 @@ static const struct v4l2_ioctl_ops sn9c20x_v4l2_ioctl_ops = {
 	.vidioc_qbuf                = sn9c20x_vidioc_qbuf,
 	.vidioc_dqbuf               = sn9c20x_vidioc_dqbuf,
 	.vidioc_querybuf            = sn9c20x_vidioc_querybuf,
+#ifdef SN9C20X_EVENTS
+	.vidioc_subscribe_event     = sn9c20x_vidioc_subscribe_event,
+	.vidioc_unsubscribe_event   = v4l2_event_unsubscribe,
+#endif
 };
 #endif
 
+/**
+ * @param vdev Video device
+ *
+ * @brief Release the video device
+ *
+ * Called once the video device is unregistered and the last file using it
+ * is closed. Nothing can stream anymore, so the URBs, the buffers and the
+ * works go away with the video device. The device structure itself is
+ * freed with its last reference.
+ */
+static void v4l_sn9c20x_release_vdev(struct video_device *vdev)
+{
+	struct usb_sn9c20x *dev = video_get_drvdata(vdev);
+
+	cancel_delayed_work_sync(&dev->standby_work);
+	usb_sn9c20x_watchdog_stop(dev);
+	cancel_work_sync(&dev->shot_work);
+	usb_sn9c20x_uninit_urbs(dev, 1);
+	cancel_work_sync(&dev->auto_work);
+	mutex_lock(&dev->queue.mutex);
+	sn9c20x_free_buffers(&dev->queue);
+	mutex_unlock(&dev->queue.mutex);
+	free_page((unsigned long)dev->queue.progress);
+
+	video_device_release(vdev);
+	dev->vdev = NULL;
+
+	kref_put(&dev->vopen, usb_sn9c20x_delete);
+}
+
 /**
  * @param dev Device structure
  *
@@ -1465,7 +2009,7 @@ int v4l_sn9c20x_register_video_device(struct usb_sn9c20x *dev)
 	dev->vdev->current_norm = 0;
 	dev->vdev->tvnorms = 0;
 	dev->vdev->fops = &v4l_sn9c20x_fops;
-	dev->vdev->release = video_device_release;
+	dev->vdev->release = v4l_sn9c20x_release_vdev;
 	dev->vdev->minor = -1;
 
 	if (log_level & SN9C20X_DEBUG)
@@ -1483,6 +2027,7 @@ int v4l_sn9c20x_register_video_device(struct usb_sn9c20x *dev)
 	dev->vdev->vidioc_streamon        = sn9c20x_vidioc_streamon;
 	dev->vdev->vidioc_streamoff       = sn9c20x_vidioc_streamoff;
 	dev->vdev->vidioc_queryctrl       = sn9c20x_vidioc_queryctrl;
+	dev->vdev->vidioc_querymenu       = sn9c20x_vidioc_querymenu;
 	dev->vdev->vidioc_g_ctrl          = sn9c20x_vidioc_g_ctrl;
 	dev->vdev->vidioc_s_ctrl          = sn9c20x_vidioc_s_ctrl;
 	dev->vdev->vidioc_g_parm          = sn9c20x_vidioc_g_param;
@@ -1496,21 +2041,33 @@ int v4l_sn9c20x_register_video_device(struct usb_sn9c20x *dev)
 #endif
 
 	video_set_drvdata(dev->vdev, dev);
+#ifdef SN9C20X_EVENTS
+	set_bit(V4L2_FL_USES_V4L2_FH, &dev->vdev->flags);
+#endif
 
 	sn9c20x_queue_init(&dev->queue);
+	INIT_DELAYED_WORK(&dev->standby_work, v4l2_standby_work);
+	INIT_WORK(&dev->auto_work, dev_sn9c20x_auto_work);
+	INIT_WORK(&dev->shot_work, v4l2_shot_work);
 
 	err = video_register_device(dev->vdev, VFL_TYPE_GRABBER, -1);
 
-	if (err)
+	if (err) {
 		UDIA_ERROR("Video register fail !\n");
-	else
-		UDIA_INFO("Webcam device %04X:%04X is now controlling video "
-				"device /dev/video%d\n",
-				le16_to_cpu(dev->udev->descriptor.idVendor),
-				le16_to_cpu(dev->udev->descriptor.idProduct),
-				dev->vdev->minor);
+		free_page((unsigned long)dev->queue.progress);
+		return err;
+	}
 
-	return err;
+	/* Dropped by v4l_sn9c20x_release_vdev() */
+	kref_get(&dev->vopen);
+
+	UDIA_INFO("Webcam device %04X:%04X is now controlling video "
+			"device /dev/video%d\n",
+			le16_to_cpu(dev->udev->descriptor.idVendor),
+			le16_to_cpu(dev->udev->descriptor.idProduct),
+			dev->vdev->minor);
+
+	return 0;
 }
 
 
@@ -1528,7 +2085,6 @@ int v4l_sn9c20x_unregister_video_device(struct usb_sn9c20x *dev)
 	UDIA_INFO("SN9C20X USB 2.0 Webcam releases control of video "
 			"device /dev/video%d\n", dev->vdev->minor);
 
-	video_set_drvdata(dev->vdev, NULL);
 	video_unregister_device(dev->vdev);
 
 	return 0;
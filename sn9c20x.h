@@ -27,6 +27,9 @@
 #include <linux/kernel.h>
 #include <linux/version.h>
 #include <linux/usb.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
 /**for kzalloc**/
 #include <linux/slab.h>
 #ifdef CONFIG_SN9C20X_EVDEV
@@ -34,6 +37,10 @@
 #endif
 #include <media/v4l2-common.h>
 
+#include "sn9c20x-api.h"
+#include "sn9c20x-parser.h"
+#include "sn9c20x-ae.h"
+
 #ifndef SN9C20X_H
 #define SN9C20X_H
 
@@ -57,6 +64,36 @@
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 25)
 #define V4L2_CID_SHARPNESS		(V4L2_CID_PRIVATE_BASE + 0)
 #define V4L2_CID_EXPOSURE_AUTO		(V4L2_CID_PRIVATE_BASE + 1)
+#define V4L2_CID_POWER_LINE_FREQUENCY	(V4L2_CID_PRIVATE_BASE + 2)
+#define V4L2_CID_POWER_LINE_FREQUENCY_DISABLED	0
+#define V4L2_CID_POWER_LINE_FREQUENCY_50HZ	1
+#define V4L2_CID_POWER_LINE_FREQUENCY_60HZ	2
+#endif
+
+/** Driver specific V4L2-CONTROLS, numbered on from the compatibility ones
+ * above: applications enumerating the private controls stop at the first
+ * missing one */
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 25)
+#define V4L2_CID_SN9C20X_BASE		(V4L2_CID_PRIVATE_BASE + 3)
+#else
+#define V4L2_CID_SN9C20X_BASE		V4L2_CID_PRIVATE_BASE
+#endif
+#define V4L2_CID_SN9C20X_LATEST_FRAME	(V4L2_CID_SN9C20X_BASE + 0)
+#define V4L2_CID_SN9C20X_SLICE_LINES	(V4L2_CID_SN9C20X_BASE + 1)
+#define V4L2_CID_SN9C20X_METERING	(V4L2_CID_SN9C20X_BASE + 2)
+#define V4L2_CID_SN9C20X_METER_LEFT	(V4L2_CID_SN9C20X_BASE + 3)
+#define V4L2_CID_SN9C20X_METER_TOP	(V4L2_CID_SN9C20X_BASE + 4)
+#define V4L2_CID_SN9C20X_METER_WIDTH	(V4L2_CID_SN9C20X_BASE + 5)
+#define V4L2_CID_SN9C20X_METER_HEIGHT	(V4L2_CID_SN9C20X_BASE + 6)
+#define V4L2_CID_SN9C20X_SINGLE_SHOT	(V4L2_CID_SN9C20X_BASE + 7)
+#define V4L2_CID_SN9C20X_TRIGGER	(V4L2_CID_SN9C20X_BASE + 8)
+
+/**
+ * @def SN9C20X_EVENTS
+ *   Defined when the kernel has V4L2 file handles and events
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
+#define SN9C20X_EVENTS
 #endif
 
 #ifndef V4L2_PIX_FMT_SN9C20X_I420
@@ -73,6 +110,12 @@
 #define MAX_URBS				10
 #define ISO_FRAMES_PER_DESC			10
 
+/**
+ * @def BULK_URB_MAX_SIZE
+ *   Maximal size of a scatter-gather bulk URB
+ */
+#define BULK_URB_MAX_SIZE			(256 * 1024)
+
 /**
  * @def hb_multiplier(wMaxPacketSize)
  *   USB endpoint high bandwidth multiplier
@@ -169,6 +212,32 @@ enum sn9c20x_mode {
 	SN9C20X_MODE_STREAM	= 2,
 };
 
+/**
+ * @enum sn9c20x_shot
+ *   State of a stream in single-shot mode
+ */
+enum sn9c20x_shot {
+	SN9C20X_SHOT_OFF	= 0,	/**< Not in single-shot mode */
+	SN9C20X_SHOT_IDLE	= 1,	/**< Waiting for a trigger, video disabled */
+	SN9C20X_SHOT_WAIT	= 2,	/**< Triggered, waiting for a frame start */
+	SN9C20X_SHOT_CAPTURE	= 3,	/**< Capturing the frame */
+	SN9C20X_SHOT_DONE	= 4,	/**< Frame captured, video being disabled */
+};
+
+/**
+ * @def SN9C20X_BUF_FLAGS
+ *   Timestamp flags of all the video buffers
+ *
+ * Buffers are stamped with the monotonic clock when the first line of the
+ * frame arrives. That is neither the start of the exposure nor the end of
+ * the frame, so no timestamp source is advertised.
+ */
+#if defined(V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+#define SN9C20X_BUF_FLAGS	V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+#else
+#define SN9C20X_BUF_FLAGS	0
+#endif
+
 struct sn9c20x_buffer {
 	unsigned long vma_use_count;
 	struct list_head stream;
@@ -178,11 +247,22 @@ struct sn9c20x_buffer {
 	struct list_head queue;
 	wait_queue_head_t wait;
 	enum sn9c20x_buffer_state state;
+	ktime_t stamp;		/* arrival of the first line of the frame */
+	unsigned int lost;	/* payload transfers lost in this frame */
+	unsigned int overflow;	/* bytes discarded past the end of the buffer */
+
+	/* Zero-copy receive windows, protected by irqlock */
+	unsigned int windows;	/* URBs in flight into the buffer */
+	unsigned int window_end;	/* end offset of the last window */
+	enum sn9c20x_buffer_state deferred;	/* final state, held back
+						 * until the windows completed */
 };
 
 #define SN9C20X_QUEUE_STREAMING	(1 << 0)
 #define SN9C20X_QUEUE_DISCONNECTED	(1 << 1)
 #define SN9C20X_QUEUE_DROP_INCOMPLETE	(1 << 2)
+#define SN9C20X_QUEUE_DROP_CORRUPTED	(1 << 3)
+#define SN9C20X_QUEUE_LATEST_FRAME	(1 << 4)
 
 struct sn9c20x_video_queue {
 	void *mem;
@@ -201,6 +281,73 @@ struct sn9c20x_video_queue {
 
 	struct list_head mainqueue;
 	struct list_head irqqueue;
+
+	/* Frame timing statistics, protected by irqlock */
+	ktime_t last_stamp;	/* timestamp of the previous frame */
+	s64 interval;		/* average frame interval (ns) */
+	s64 jitter;		/* average deviation from the interval (ns) */
+	s64 jitter_max;		/* largest deviation seen (ns) */
+
+	unsigned int reclaimed;	/* ready frames overwritten in latest
+				 * frame mode */
+
+	/* Sub-frame progress, protected by irqlock */
+	struct sn9c20x_progress *progress;	/* page shared with user space */
+	unsigned int slice_lines;	/* lines between updates, 0 if off */
+	unsigned int bytesperline;	/* 0 for compressed formats */
+	unsigned int slice_bytes;	/* bytes between updates */
+	unsigned int slice_next;	/* bytesused of the next update */
+};
+
+/**
+ * @def SN9C20X_BAYER_COLUMN
+ *   The Bayer pattern starts one column later, GBRG instead of BGGR
+ * @def SN9C20X_BAYER_ROW
+ *   The Bayer pattern starts one row later, GRBG instead of BGGR
+ */
+#define SN9C20X_BAYER_COLUMN	0x01
+#define SN9C20X_BAYER_ROW	0x02
+
+/**
+ * @def SN9C20X_AE_FRAMES
+ *   Frames between two runs of software auto-exposure, a new exposure
+ *   needs a frame or two to show in the statistics
+ * @def SN9C20X_LATENCY_BUCKETS
+ *   Power of two microsecond buckets of the DQBUF latency histogram
+ */
+#define SN9C20X_AE_FRAMES	3
+
+/**
+ * @def SN9C20X_GPIO_POLL_MIN
+ *   GPIO polling interval (ms) right after a change, used when the bridge
+ *   has no interrupt endpoint
+ * @def SN9C20X_GPIO_POLL_MAX
+ *   GPIO polling interval (ms) the polling backs off to while nothing changes
+ */
+#define SN9C20X_GPIO_POLL_MIN	100
+#define SN9C20X_GPIO_POLL_MAX	1600
+#define SN9C20X_LATENCY_BUCKETS	16
+
+/**
+ * @def SN9C20X_META_RECORDS
+ *   Number of metadata records kept for the readers
+ */
+#define SN9C20X_META_RECORDS	16
+
+/**
+ * @struct sn9c20x_meta
+ *   Metadata video device and the records waiting to be read
+ */
+struct sn9c20x_meta {
+	struct video_device *vdev;
+	spinlock_t lock;		/* protects the ring and users */
+	wait_queue_head_t wait;
+	struct sn9c20x_meta_record ring[SN9C20X_META_RECORDS];
+	unsigned int head;		/* records written */
+	unsigned int tail;		/* records read */
+	unsigned int overrun;		/* records overwritten unread */
+	int users;			/* open file handles, also under
+					 * open_lock */
 };
 
 /**
@@ -208,9 +355,24 @@ struct sn9c20x_video_queue {
  */
 struct sn9c20x_urb {
 	void *data;
+	unsigned int size;	/**< Size of the transfer buffer */
+	struct sg_table sgt;	/**< Pages of a vmalloc'ed transfer buffer */
+	struct sg_table wsgt;	/**< Pages of the receive window */
+	struct sn9c20x_buffer *window;	/**< Buffer received into, if any */
 	struct urb *urb;
 };
 
+/**
+ * @enum sn9c20x_metering
+ *   Weighting of the header windows for software auto-exposure
+ */
+enum sn9c20x_metering {
+	SN9C20X_METERING_AVERAGE = 0,	/**< All windows alike */
+	SN9C20X_METERING_CENTRE = 1,	/**< Centre windows count more */
+	SN9C20X_METERING_SPOT = 2,	/**< Centre windows only */
+	SN9C20X_METERING_RECT = 3,	/**< Windows under the user rectangle */
+};
+
 /**
  * @struct sn9c20x_video
  */
@@ -234,6 +396,12 @@ struct sn9c20x_video {
 	int auto_exposure;		/**< Automatic exposure */
 	int auto_gain;			/**< Automatic gain */
 	int auto_whitebalance;		/**< Automatic whitebalance */
+	int metering;			/**< Auto-exposure metering mode */
+	int meter_left;			/**< Metering rectangle, percent of the width */
+	int meter_top;			/**< Metering rectangle, percent of the height */
+	int meter_width;		/**< Metering rectangle, percent of the width */
+	int meter_height;		/**< Metering rectangle, percent of the height */
+	int power_line;			/**< Mains frequency to avoid flicker for */
 };
 
 /**
@@ -248,6 +416,14 @@ struct sn9c20x_debugfs {
 	struct dentry *dent_sensor_val8;
 	struct dentry *dent_sensor_val16;
 	struct dentry *dent_sensor_val32;
+	struct dentry *dent_start_profile;
+	struct dentry *dent_timestamps;
+	struct dentry *dent_dqbuf_latency;
+	struct dentry *dent_watchdog;
+	struct dentry *dent_ae_kp;
+	struct dentry *dent_ae_ki;
+	struct dentry *dent_ae_exposure_max;
+	struct dentry *dent_ae_gain_max;
 
 	__u16 bridge_addr;	/**< Current bridge register address */
 	__u8 sensor_addr;	/**< Current sensor register address */
@@ -260,6 +436,112 @@ enum sn9c20x_endpoints {
 	SN9C20X_AUD_ISOC = 4
 };
 
+/**
+ * @enum sn9c20x_start_phase
+ *   Phases of a stream start recorded by the start profiler
+ */
+enum sn9c20x_start_phase {
+	SN9C20X_PHASE_RESTORE		= 0,	/**< Device restore on resume */
+	SN9C20X_PHASE_QUEUE		= 1,	/**< Video queue enabling */
+	SN9C20X_PHASE_BRIDGE		= 2,	/**< Bridge transfer setup (0x1061) */
+	SN9C20X_PHASE_ALTSETTING	= 3,	/**< usb_set_interface() */
+	SN9C20X_PHASE_URB_ALLOC		= 4,	/**< URB and transfer buffer allocation */
+	SN9C20X_PHASE_URB_SUBMIT	= 5,	/**< URB submission */
+	SN9C20X_PHASE_ENABLE		= 6,	/**< Video and LEDs enabling */
+	SN9C20X_PHASE_FIRST_HEADER	= 7,	/**< Wait for the first frame header */
+	SN9C20X_PHASE_FIRST_FRAME	= 8,	/**< Wait for the first complete frame */
+	SN9C20X_PHASES			= 9,
+};
+
+/**
+ * @def SN9C20X_PROFILE_DEPTH
+ *   Number of stream starts kept by the start profiler
+ */
+#define SN9C20X_PROFILE_DEPTH	16
+
+/**
+ * @struct sn9c20x_start_profile
+ */
+struct sn9c20x_start_profile {
+	s64 phase[SN9C20X_PHASES];	/**< Time spent in each phase (ns) */
+	int warm;			/**< The URBs were kept in standby */
+};
+
+/**
+ * @struct sn9c20x_profiler
+ */
+struct sn9c20x_profiler {
+	spinlock_t lock;
+	int active;			/**< A stream start is being recorded */
+	unsigned long seen;		/**< Phases already recorded once */
+	ktime_t start;			/**< Time the stream start began */
+	ktime_t last;			/**< Time of the last recorded phase */
+	struct sn9c20x_start_profile cur;	/**< Stream start being recorded */
+	struct sn9c20x_start_profile history[SN9C20X_PROFILE_DEPTH];
+	unsigned int count;		/**< Number of recorded stream starts */
+};
+
+/**
+ * @enum sn9c20x_recovery
+ *   Steps the stream watchdog takes against a stall, in this order
+ */
+enum sn9c20x_recovery {
+	SN9C20X_RECOVER_RESUBMIT	= 0,	/**< Kill and resubmit the URBs */
+	SN9C20X_RECOVER_ALTSETTING	= 1,	/**< Select the alternate setting again */
+	SN9C20X_RECOVER_RESET		= 2,	/**< Reset and restore the device */
+	SN9C20X_RECOVERIES		= 3,
+};
+
+/**
+ * @struct sn9c20x_watchdog
+ */
+struct sn9c20x_watchdog {
+	struct delayed_work work;	/**< Checks that frames keep coming */
+	unsigned int frames;		/**< Frame headers received */
+	unsigned int last;		/**< Frame headers at the last check */
+	int step;			/**< Next recovery step of the current stall */
+	unsigned long timeout;		/**< Delay of the pending check (jiffies) */
+	ktime_t stall;			/**< Time the current stall was detected */
+	unsigned int count[SN9C20X_RECOVERIES];	/**< Times each step was taken */
+	unsigned int fixed[SN9C20X_RECOVERIES];	/**< Stalls ended by each step */
+	s64 spent[SN9C20X_RECOVERIES];	/**< Time spent in each step (ns) */
+	s64 recovery;			/**< Time from stall to frames, all stalls (ns) */
+	s64 recovery_max;		/**< Longest time from stall to frames (ns) */
+	unsigned int failed;		/**< Stalls the watchdog gave up on */
+};
+
+/**
+ * @def SN9C20X_SHADOW_BASE
+ *   First bridge register kept in the register shadow
+ */
+#define SN9C20X_SHADOW_BASE	0x1000
+
+/**
+ * @def SN9C20X_SHADOW_SIZE
+ *   Number of bridge registers kept in the register shadow
+ */
+#define SN9C20X_SHADOW_SIZE	0x200
+
+/**
+ * @def SN9C20X_SHADOW_OTHERS
+ *   Number of registers outside the shadow window that can be kept
+ */
+#define SN9C20X_SHADOW_OTHERS	4
+
+/**
+ * @struct sn9c20x_shadow
+ *   Last value written to each bridge register, replayed after a reset
+ */
+struct sn9c20x_shadow {
+	spinlock_t lock;		/**< Taken by the writers and the replay */
+	__u8 reg[SN9C20X_SHADOW_SIZE];	/**< Values of the window registers */
+	DECLARE_BITMAP(valid, SN9C20X_SHADOW_SIZE);	/**< Registers written */
+	__u16 other_reg[SN9C20X_SHADOW_OTHERS];	/**< Registers outside the window */
+	__u8 other_val[SN9C20X_SHADOW_OTHERS];	/**< Values of these registers */
+	int others;			/**< Number of registers outside the window */
+	int lost;			/**< A register didn't fit, the shadow is unusable */
+};
+
 enum sn9c20x_sensors {
 	PROBE_SENSOR		= 0,
 	OV9650_SENSOR		= 1,
@@ -313,14 +595,32 @@ struct sn9c20x_camera {
 	__u8 i2c_flags;
 	__u8 address;
 
-	int min_yavg, max_yavg, old_step, older_step;
-	unsigned int exposure_step;
+	int min_yavg, max_yavg;
+
+/* Soft auto-exposure controller, gains in percent */
+	int ae_integral;
+	unsigned int exposure_unit_ns;	/**< Length of an exposure step, 0 if unknown */
+	__u32 ae_kp;
+	__u32 ae_ki;
+	__u32 ae_exposure_max;
+	__u32 ae_gain_max;
+
+/* Soft white balance, channel means of the last sampled frame */
+	unsigned int awb_red;
+	unsigned int awb_green;
+	unsigned int awb_blue;
+	int awb_valid;
 
 	atomic_t yavg;
+	__u8 window_weight[SN9C20X_META_WINDOWS];	/**< Metering weights */
 
 	int vstart;
 	int hstart;
+	__u8 bayer_phase;	/**< SN9C20X_BAYER_* shifts of the window start */
+	__u8 flip_phase;	/**< SN9C20X_BAYER_* shifts of the sensor flips */
+	int power_line;		/**< Banding filter the init table leaves */
 
+	__u8 flip_state;	/**< Last state of the flip switch */
 	int (*flip_detect) (struct usb_sn9c20x *dev);
 	int (*set_hvflip) (struct usb_sn9c20x *dev);
 	void (*set_sxga_mode) (struct usb_sn9c20x *dev, bool sxga);
@@ -330,6 +630,7 @@ struct sn9c20x_camera {
 	int (*set_auto_exposure) (struct usb_sn9c20x *dev);
 	int (*set_auto_gain) (struct usb_sn9c20x *dev);
 	int (*set_auto_whitebalance) (struct usb_sn9c20x *dev);
+	int (*set_power_line) (struct usb_sn9c20x *dev);
 	int (*set_contrast) (struct usb_sn9c20x *dev);
 	int (*set_brightness) (struct usb_sn9c20x *dev);
 	int (*set_gamma) (struct usb_sn9c20x *dev);
@@ -347,7 +648,6 @@ struct usb_sn9c20x {
 #ifdef CONFIG_SN9C20X_EVDEV
 	struct input_dev *input_dev;
 	__u8 input_gpio;
-	struct task_struct *input_task;
 #endif
 	struct video_device *vdev; 	/**< Pointer on a V4L2 video device */
 	struct usb_device *udev;	/**< Pointer on a USB device */
@@ -358,19 +658,53 @@ struct usb_sn9c20x {
 	struct sn9c20x_video vsettings;	/**< Video settings (brightness, whiteness...) */
 	struct sn9c20x_debugfs debug; 	/**< debugfs information structure */
 
-	struct kref vopen;		/**< Video status (Opened or Closed) */
+	struct kref vopen;		/**< References on the device */
+	struct mutex open_lock;		/**< Serializes open, release and disconnect */
+	int disconnected;		/**< The device was unplugged */
+	struct work_struct init_work;	/**< Initializes the hardware after the probe */
+	struct completion init_done;	/**< Completed once init_work is over */
+	int init_error;			/**< Result of init_work */
 	struct file *owner;		/**< file handler of stream owner */
 	enum sn9c20x_mode mode;		/**< camera mode */
 
 	int vframes_overflow;		/**< Buffer overflow frames */
 	int vframes_incomplete;		/**< Incomplete frames */
 	int vframes_dropped;		/**< Dropped frames */
+	int vpackets_lost;		/**< Lost payload transfers */
+
+	struct sn9c20x_profiler profile;	/**< Stream start profiler */
+	struct sn9c20x_shadow shadow;	/**< Bridge registers replayed on reset */
+	struct sn9c20x_watchdog watchdog;	/**< Recovers stalled streams */
+	int ttff;			/**< Time to first frame of the last stream start (us) */
+
+	unsigned int standby_timeout;	/**< Warm standby timeout (ms), 0 disables it */
+	struct delayed_work standby_work; /**< Leaves warm standby once the timeout expired */
+
+	struct mutex ctrl_mutex;	/**< Serializes the camera controls */
+	struct work_struct auto_work;	/**< Runs software auto-exposure and white balance */
+	int single_shot;		/**< Streams only capture a frame when triggered */
+	atomic_t shot;			/**< State of the single-shot stream */
+	struct work_struct shot_work;	/**< Idles the stream after a single shot */
+	unsigned int ae_frames;		/**< Frames since the last auto-exposure run */
+	unsigned int dqbuf_latency[SN9C20X_LATENCY_BUCKETS];	/**< DQBUF latency histogram */
+
+	struct urb *int_urb;		/**< Interrupt URB, NULL without the endpoint */
+	__u8 *int_buffer;		/**< Transfer buffer of the interrupt URB */
+	struct delayed_work gpio_work;	/**< Reads the GPIO after an interrupt or a poll */
+	unsigned int gpio_interval;	/**< Current GPIO polling interval (ms) */
+	__u8 gpio_state;		/**< Last GPIO state read */
 
 	struct sn9c20x_urb urbs[MAX_URBS];
+	struct sn9c20x_bulk_parser parser;	/**< Bulk stream parser state */
+	struct sn9c20x_meta meta;	/**< Per-frame metadata device */
 
 	__u8 jpeg;
+	unsigned int jpeg_scale;	/**< Scale of the JPEG frame size estimate (%) */
 
 	unsigned int frozen:1;
+	unsigned int gpio_watch:1;	/**< Buttons or the flip switch are watched */
+	unsigned int gpio_running:1;	/**< GPIO interrupt URB or polling active */
+	unsigned int zero_copy:1;	/**< Bulk URBs receive into the buffers */
 	struct sn9c20x_video_queue queue;
 	struct sn9c20x_camera camera;
 };
@@ -381,25 +715,42 @@ struct usb_sn9c20x {
  */
 #define SN9C20X_PERCENT(x, y) (((int)x * (int)y) / 100)
 
+/**
+ * @def SN9C20X_JPEG_HEADER_SIZE
+ *   Size of the JPEG header added to the frames on dequeue
+ */
+#define SN9C20X_JPEG_HEADER_SIZE	589
+
+/**
+ * @def SN9C20X_JPEG_SCALE_MAX
+ *   Largest scale (%) of the JPEG frame size estimate
+ */
+#define SN9C20X_JPEG_SCALE_MAX	400
+
 
-extern struct mutex open_lock;
 extern __u8 jpeg;
 
 int usb_sn9c20x_control_write(struct usb_sn9c20x *, __u16, __u8 *, __u16);
 int usb_sn9c20x_control_read(struct usb_sn9c20x *, __u16, __u8 *, __u16);
+int usb_sn9c20x_shadow_replay(struct usb_sn9c20x *);
 
 int usb_sn9c20x_isoc_init(struct usb_sn9c20x *,
 	struct usb_endpoint_descriptor *);
 void usb_sn9c20x_completion_handler(struct urb *);
 int usb_sn9c20x_init_urbs(struct usb_sn9c20x *);
 void usb_sn9c20x_uninit_urbs(struct usb_sn9c20x *, int);
+void usb_sn9c20x_stop_urbs(struct usb_sn9c20x *);
+int usb_sn9c20x_set_interface(struct usb_sn9c20x *, int);
+void usb_sn9c20x_profile_start(struct usb_sn9c20x *);
+void usb_sn9c20x_profile_mark(struct usb_sn9c20x *, enum sn9c20x_start_phase);
+void usb_sn9c20x_watchdog_start(struct usb_sn9c20x *);
+void usb_sn9c20x_watchdog_stop(struct usb_sn9c20x *);
 void usb_sn9c20x_delete(struct kref *);
 
 int sn9c20x_initialize(struct usb_sn9c20x *dev);
 int sn9c20x_initialize_sensor(struct usb_sn9c20x *dev);
 int sn9c20x_enable_video(struct usb_sn9c20x *dev, int enable);
 
-int dev_sn9c20x_call_constantly(struct usb_sn9c20x *dev);
 int dev_sn9c20x_flip_detection(struct usb_sn9c20x *dev);
 int dev_sn9c20x_camera_set_exposure(struct usb_sn9c20x *);
 int dev_sn9c20x_camera_set_gain(struct usb_sn9c20x *);
@@ -408,12 +759,25 @@ int dev_sn9c20x_camera_set_auto_exposure(struct usb_sn9c20x *dev);
 int dev_sn9c20x_camera_set_auto_gain(struct usb_sn9c20x *dev);
 int dev_sn9c20x_camera_set_auto_whitebalance(struct usb_sn9c20x *dev);
 int dev_sn9c20x_perform_soft_ae(struct usb_sn9c20x *dev);
+void dev_sn9c20x_auto_work(struct work_struct *work);
+void dev_sn9c20x_schedule_auto(struct usb_sn9c20x *dev,
+	struct sn9c20x_buffer *buf);
+int dev_sn9c20x_perform_soft_awb(struct usb_sn9c20x *dev);
+int dev_sn9c20x_set_metering(struct usb_sn9c20x *dev);
 
 void v4l2_set_control_default(struct usb_sn9c20x *, __u32, __u16);
+void v4l2_notify_frame_sync(struct usb_sn9c20x *, __u32);
+void v4l2_notify_control(struct usb_sn9c20x *, __u32, __s32);
+int v4l2_trigger_shot(struct usb_sn9c20x *);
 int v4l_sn9c20x_select_video_mode(struct usb_sn9c20x *, int);
 int v4l_sn9c20x_register_video_device(struct usb_sn9c20x *);
 int v4l_sn9c20x_unregister_video_device(struct usb_sn9c20x *);
 
+int sn9c20x_meta_register(struct usb_sn9c20x *);
+void sn9c20x_meta_unregister(struct usb_sn9c20x *);
+void sn9c20x_meta_frame(struct usb_sn9c20x *, const __u8 *, const __u32 *,
+	__u32, __u32, ktime_t);
+
 int sn9c20x_create_sysfs_files(struct video_device *);
 void sn9c20x_remove_sysfs_files(struct video_device *);
 
@@ -449,6 +813,16 @@ int sn9c20x_dequeue_buffer(struct sn9c20x_video_queue *,
 	struct v4l2_buffer *, int);
 struct sn9c20x_buffer *sn9c20x_queue_next_buffer(
 	struct sn9c20x_video_queue *, struct sn9c20x_buffer *);
+void sn9c20x_queue_release_window(struct sn9c20x_video_queue *,
+	struct sn9c20x_buffer *);
+void sn9c20x_queue_reset_windows(struct sn9c20x_video_queue *);
+struct sn9c20x_buffer *sn9c20x_queue_first_buffer(
+	struct sn9c20x_video_queue *);
+void sn9c20x_queue_latest_frame(struct sn9c20x_video_queue *, int);
+void sn9c20x_queue_slices(struct sn9c20x_video_queue *, unsigned int,
+	unsigned int);
+void sn9c20x_queue_progress(struct sn9c20x_video_queue *,
+	struct sn9c20x_buffer *);
 
 static inline int sn9c20x_queue_streaming(struct sn9c20x_video_queue *queue)
 {
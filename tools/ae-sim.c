@@ -0,0 +1,475 @@
+/**
+ * @file tools/ae-sim.c
+ * @author microdia project
+ *
+ * @brief Simulation of the software auto-exposure controller
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * Builds sn9c20x-ae.c in user space and runs it against a scene whose
+ * brightness changes in steps:
+ *
+ *   ae-sim [options]           synthetic scene, fails if a reachable step
+ *                              doesn't settle or the settings leave their
+ *                              range
+ *   ae-sim [options] trace...  scenes recovered from traces, the "Soft AE:
+ *                              yavg Y exposure E gain G" lines the driver
+ *                              logs with log_level=8 (dmesg output can be
+ *                              given as is), or lines of "Y E G"
+ *
+ * The sensor is modelled as yavg = level * exposure * (16 + gain) / 16,
+ * clipped to 255, a setting showing in the statistics of the next run
+ * (plus -l runs). The brightness of a traced scene is recovered from each
+ * sample the same way, and a new step starts where it changes by more
+ * than -t percent. For each step the frames until the luma stays inside
+ * the band and the overshoot past the far edge of the band are printed,
+ * for the trace as recorded and for the simulated controller.
+ *
+ * Options, defaults from sn9c20x_initialize_sensor():
+ *   -k kp -i ki               gains in percent (70, 20)
+ *   -m min_yavg -M max_yavg   target band (80, 130)
+ *   -e exposure_max           (255)
+ *   -g gain_max               (255), -G to leave the gain alone
+ *   -x exposure               first exposure of the synthetic scene (64)
+ *   -l runs                   extra latency of a new setting (0)
+ *   -t percent                step detection threshold of traces (25)
+ *   -R                        only check the range of the settings, for
+ *                             tunables too high to settle
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max_t(type, x, y) ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+#include "../sn9c20x-ae.c"
+
+/**
+ * @def AE_FRAMES
+ *   Frames between two runs, SN9C20X_AE_FRAMES
+ * @def SETTLE_RUNS
+ *   Runs a reachable step of the synthetic scene may take to settle
+ * @def STEP_RUNS
+ *   Runs of each step of the synthetic scene
+ */
+#define AE_FRAMES	3
+#define SETTLE_RUNS	20
+#define STEP_RUNS	40
+
+struct sim {
+	struct sn9c20x_ae_params params;
+	int soft_gain;
+	int lag;
+};
+
+/**
+ * @brief A scene and what was seen of it
+ */
+struct run {
+	double *level;		/**< Brightness of the scene at each run */
+	int *yavg;		/**< Mean luma at each run */
+	int *exposure;		/**< Exposure in effect at each run */
+	int *gain;		/**< Gain in effect at each run */
+	unsigned int runs;
+	unsigned int size;
+	unsigned int *step;	/**< First run of each step */
+	unsigned int steps;
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		perror("realloc");
+		exit(2);
+	}
+	return p;
+}
+
+static void run_init(struct run *r, unsigned int runs)
+{
+	memset(r, 0, sizeof(*r));
+	r->size = runs;
+	r->level = xrealloc(NULL, runs * sizeof(*r->level));
+	r->yavg = xrealloc(NULL, runs * sizeof(*r->yavg));
+	r->exposure = xrealloc(NULL, runs * sizeof(*r->exposure));
+	r->gain = xrealloc(NULL, runs * sizeof(*r->gain));
+	r->step = xrealloc(NULL, runs * sizeof(*r->step));
+}
+
+static void run_free(struct run *r)
+{
+	free(r->level);
+	free(r->yavg);
+	free(r->exposure);
+	free(r->gain);
+	free(r->step);
+}
+
+static int luma(double level, int exposure, int gain)
+{
+	double y = level * exposure * (16 + gain) / 16 + 0.5;
+
+	return y > 255 ? 255 : y < 0 ? 0 : (int)y;
+}
+
+static double brightness(int yavg, int exposure, int gain)
+{
+	if (exposure < 1)
+		exposure = 1;
+	if (yavg < 1)
+		yavg = 1;
+	return (double)yavg * 16 / ((double)exposure * (16 + gain));
+}
+
+/**
+ * @brief Run the controller against the scene of a run
+ *
+ * @param s Controller and sensor
+ * @param r Scene, the levels and steps are read, the rest is written
+ * @param exposure First exposure
+ * @param gain First gain
+ *
+ * @returns 0, or -1 if a setting left its range
+ */
+static int simulate(const struct sim *s, struct run *r, int exposure,
+	int gain)
+{
+	int integral = 0, ret = 0;
+	unsigned int k, j;
+
+	for (k = 0; k < r->runs && k <= (unsigned int)s->lag; k++) {
+		r->exposure[k] = exposure;
+		r->gain[k] = gain;
+	}
+
+	for (k = 0; k < r->runs; k++) {
+		r->yavg[k] = luma(r->level[k], r->exposure[k], r->gain[k]);
+
+		sn9c20x_ae_update(&s->params, &integral, r->yavg[k],
+				  s->soft_gain, &exposure, &gain);
+		if (exposure < 1 ||
+		    exposure > (int)min_t(__u32, s->params.exposure_max,
+					  SN9C20X_AE_SETTING_MAX) ||
+		    gain < 0 ||
+		    gain > (int)min_t(__u32, s->params.gain_max,
+				      SN9C20X_AE_SETTING_MAX)) {
+			printf("run %u: exposure %d gain %d out of range\n",
+			       k, exposure, gain);
+			ret = -1;
+		}
+
+		j = k + 1 + s->lag;
+		if (j < r->runs) {
+			r->exposure[j] = exposure;
+			r->gain[j] = gain;
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Print how each step of a run settled
+ *
+ * @param s Controller, for the target band
+ * @param name Name of the run
+ * @param r Run
+ * @param settle Set to the most runs a step took to settle, -1 if one
+ *   never did
+ */
+static void report(const struct sim *s, const char *name,
+	const struct run *r, int *settle)
+{
+	int lo = s->params.min_yavg, hi = s->params.max_yavg;
+	unsigned int i, k, start, end;
+
+	*settle = 0;
+	for (i = 0; i < r->steps; i++) {
+		int first, last = -1, over = 0;
+
+		start = r->step[i];
+		end = i + 1 < r->steps ? r->step[i + 1] : r->runs;
+		first = r->yavg[start];
+
+		for (k = start; k < end; k++) {
+			if (r->yavg[k] < lo || r->yavg[k] > hi)
+				last = k;
+			if (first < lo && r->yavg[k] - hi > over)
+				over = r->yavg[k] - hi;
+			if (first > hi && lo - r->yavg[k] > over)
+				over = lo - r->yavg[k];
+		}
+
+		printf("%s: run %u, yavg %d, ", name, start, first);
+		if (last == (int)end - 1) {
+			printf("not settled after %u frames, exposure %d "
+			       "gain %d\n", (end - start) * AE_FRAMES,
+			       r->exposure[end - 1], r->gain[end - 1]);
+			*settle = -1;
+			continue;
+		}
+		k = last < 0 ? 0 : last + 1 - start;
+		printf("settled after %u frames, overshoot %d\n",
+		       k * AE_FRAMES, over);
+		if (*settle >= 0 && (int)k > *settle)
+			*settle = k;
+	}
+}
+
+/**
+ * @brief Check whether the band can be reached in a step
+ *
+ * @returns Non-zero if some setting puts the luma inside the band
+ */
+static int reachable(const struct sim *s, double level)
+{
+	int exposure_max = min_t(__u32, s->params.exposure_max,
+				 SN9C20X_AE_SETTING_MAX);
+	int gain_max = s->soft_gain ?
+		min_t(__u32, s->params.gain_max, SN9C20X_AE_SETTING_MAX) : 0;
+
+	return luma(level, 1, 0) <= s->params.max_yavg &&
+	       luma(level, exposure_max, gain_max) >= s->params.min_yavg;
+}
+
+/**
+ * @brief Run the synthetic scene
+ *
+ * @param s Controller and sensor
+ * @param exposure First exposure
+ * @param check_settle Non-zero to fail on reachable steps settling slowly
+ *
+ * @returns Number of failures
+ */
+static int synthetic(const struct sim *s, int exposure, int check_settle)
+{
+	static const double levels[] = {
+		0.5, 4.0, 0.25, 0.35, 2.0, 0.05, 0.6, 0.002, 0.6, 100.0, 0.6,
+	};
+	unsigned int i, k, steps = sizeof(levels) / sizeof(levels[0]);
+	int failed = 0, settle;
+	struct run r;
+
+	run_init(&r, steps * STEP_RUNS);
+	for (i = 0; i < steps; i++) {
+		r.step[r.steps++] = r.runs;
+		for (k = 0; k < STEP_RUNS; k++)
+			r.level[r.runs++] = levels[i];
+	}
+
+	if (simulate(s, &r, exposure, 0) < 0)
+		failed++;
+
+	for (i = 0; i < steps; i++) {
+		struct run one = r;
+		char name[32];
+
+		one.step += i;
+		one.steps = 1;
+		one.runs = i + 1 < steps ? r.step[i + 1] : r.runs;
+		snprintf(name, sizeof(name), "level %g", levels[i]);
+		report(s, name, &one, &settle);
+		if (!check_settle || !reachable(s, levels[i]))
+			continue;
+		if (settle < 0 || settle > SETTLE_RUNS) {
+			printf("%s: settles too slowly\n", name);
+			failed++;
+		}
+	}
+
+	run_free(&r);
+	return failed;
+}
+
+/**
+ * @brief Read a trace
+ *
+ * @returns 0, or -1 if it can't be read or has no sample
+ */
+static int read_trace(const char *path, struct run *r, double threshold)
+{
+	char line[512];
+	double ref = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	run_init(r, 256);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		const char *p = strstr(line, "Soft AE: yavg");
+		int y, e, g;
+		double level;
+
+		if (p != NULL) {
+			if (sscanf(p, "Soft AE: yavg %d exposure %d gain %d",
+				   &y, &e, &g) != 3)
+				continue;
+		} else if (sscanf(line, "%d %d %d", &y, &e, &g) != 3) {
+			continue;
+		}
+
+		if (r->runs == r->size) {
+			unsigned int runs = r->runs;
+			struct run bigger;
+
+			run_init(&bigger, r->size * 2);
+			memcpy(bigger.level, r->level, runs * sizeof(double));
+			memcpy(bigger.yavg, r->yavg, runs * sizeof(int));
+			memcpy(bigger.exposure, r->exposure, runs * sizeof(int));
+			memcpy(bigger.gain, r->gain, runs * sizeof(int));
+			memcpy(bigger.step, r->step, r->steps * sizeof(int));
+			bigger.runs = runs;
+			bigger.steps = r->steps;
+			run_free(r);
+			*r = bigger;
+		}
+
+		level = brightness(y, e, g);
+		if (r->runs == 0 || level > ref * (1 + threshold) ||
+		    level < ref / (1 + threshold)) {
+			r->step[r->steps++] = r->runs;
+			ref = level;
+		}
+		r->level[r->runs] = level;
+		r->yavg[r->runs] = y;
+		r->exposure[r->runs] = e;
+		r->gain[r->runs] = g;
+		r->runs++;
+	}
+	fclose(f);
+
+	if (r->runs == 0) {
+		fprintf(stderr, "%s: no soft AE sample\n", path);
+		run_free(r);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Replay a trace
+ *
+ * @returns Number of failures
+ */
+static int trace(const struct sim *s, const char *path, double threshold)
+{
+	struct run r;
+	char name[300];
+	int settle, ret;
+
+	if (read_trace(path, &r, threshold) < 0)
+		return 1;
+
+	snprintf(name, sizeof(name), "%s recorded", path);
+	report(s, name, &r, &settle);
+
+	ret = simulate(s, &r, r.exposure[0], r.gain[0]) < 0;
+	snprintf(name, sizeof(name), "%s simulated", path);
+	report(s, name, &r, &settle);
+
+	run_free(&r);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-k kp] [-i ki] [-m min_yavg] "
+		"[-M max_yavg] [-e exposure_max]\n"
+		"       [-g gain_max] [-G] [-x exposure] [-l runs] "
+		"[-t percent] [-R] [trace...]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim s = {
+		.params = {
+			.min_yavg = 80,
+			.max_yavg = 130,
+			.kp = 70,
+			.ki = 20,
+			.exposure_max = 0xff,
+			.gain_max = 0xff,
+		},
+		.soft_gain = 1,
+	};
+	double threshold = 0.25;
+	int exposure = 64, check_settle = 1, failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k:i:m:M:e:g:Gx:l:t:R")) != -1) {
+		switch (opt) {
+		case 'k':
+			s.params.kp = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			s.params.ki = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			s.params.min_yavg = atoi(optarg);
+			break;
+		case 'M':
+			s.params.max_yavg = atoi(optarg);
+			break;
+		case 'e':
+			s.params.exposure_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			s.params.gain_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'G':
+			s.soft_gain = 0;
+			break;
+		case 'x':
+			exposure = atoi(optarg);
+			break;
+		case 'l':
+			s.lag = atoi(optarg);
+			break;
+		case 't':
+			threshold = atof(optarg) / 100;
+			break;
+		case 'R':
+			check_settle = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind == argc)
+		return synthetic(&s, exposure, check_settle) != 0;
+
+	for (; optind < argc; optind++)
+		failed += trace(&s, argv[optind], threshold);
+	return failed != 0;
+}
@@ -0,0 +1,692 @@
+/**
+ * @file tools/isoc-bench.c
+ * @author microdia project
+ *
+ * @brief Benchmark of the isochronous frame assembly
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * Builds sn9c20x-parser.c in user space and replays isochronous URBs
+ * through the two ways of assembling them into frames: a packet at a
+ * time, as the driver did before, and a run of packets at a time through
+ * sn9c20x_isoc_next():
+ *
+ *   isoc-bench [options]           synthetic VGA streams, raw and JPEG
+ *   isoc-bench [options] pcap...   URBs recorded with usbmon, for example
+ *                                  "tcpdump -i usbmon1 -w cam.pcap"
+ *                                  (link type DLT_USB_LINUX_MMAPPED)
+ *
+ * Both ways have to give the same frames, byte for byte. The time spent
+ * per frame by each is printed. The frames are stored the way the driver
+ * does, JPEG frames keep room for the header added on dequeue.
+ *
+ * Options:
+ *   -j          the recorded frames are JPEG (raw by default)
+ *   -s size     buffer size, the largest frame found by default
+ *   -D devnum   only the URBs of this USB device
+ *   -n runs     replays timed for each way (50)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+
+static inline unsigned int get_unaligned_le32(const void *p)
+{
+	const unsigned char *b = p;
+
+	return b[0] | b[1] << 8 | b[2] << 16 | (unsigned int)b[3] << 24;
+}
+
+static inline unsigned short get_unaligned_le16(const void *p)
+{
+	const unsigned char *b = p;
+
+	return b[0] | b[1] << 8;
+}
+
+/* Same layout as in <linux/usb.h> */
+struct usb_iso_packet_descriptor {
+	unsigned int offset;
+	unsigned int length;
+	unsigned int actual_length;
+	int status;
+};
+
+#include "../sn9c20x-parser.c"
+
+/**
+ * @def BENCH_JPEG_HEADER_SIZE
+ *   SN9C20X_JPEG_HEADER_SIZE, room kept at the end of JPEG buffers
+ * @def BENCH_BUFFERS
+ *   Buffers the frames are assembled into in turn
+ * @def BENCH_PACKETS
+ *   Packets of a synthetic URB, ISO_FRAMES_PER_DESC
+ * @def BENCH_PACKET_SIZE
+ *   Packet size of the synthetic streams, 3 transactions of 1024 bytes
+ * @def BENCH_FRAMES
+ *   Frames of a synthetic stream
+ */
+#define BENCH_JPEG_HEADER_SIZE	589
+#define BENCH_BUFFERS		4
+#define BENCH_PACKETS		10
+#define BENCH_PACKET_SIZE	3072
+#define BENCH_FRAMES		30
+
+/**
+ * @def PCAP_USB_MMAPPED
+ *   Link type of usbmon captures with the isochronous descriptors
+ * @def USBMON_HEADER_SIZE
+ *   Size of the usbmon header of each packet of such a capture
+ * @def USBMON_ISODESC_SIZE
+ *   Size of an isochronous descriptor in the capture
+ */
+#define PCAP_USB_MMAPPED	220
+#define USBMON_HEADER_SIZE	64
+#define USBMON_ISODESC_SIZE	16
+
+/**
+ * @brief A completed isochronous URB
+ */
+struct bench_urb {
+	unsigned char *buffer;
+	struct usb_iso_packet_descriptor *desc;
+	int packets;
+};
+
+struct bench_urbs {
+	struct bench_urb *urb;
+	unsigned int count;
+	unsigned int size;
+};
+
+/**
+ * @brief Buffers the frames are assembled into
+ */
+struct bench_sink {
+	unsigned char *mem;		/**< BENCH_BUFFERS buffers */
+	unsigned int size;		/**< Size of a buffer */
+	unsigned int index;		/**< Buffer being filled */
+	unsigned int used;		/**< Bytes in the buffer being filled */
+	unsigned int overflow;		/**< Bytes discarded from the frame */
+	unsigned int frames;
+	unsigned int overflowed;	/**< Frames that didn't fit */
+	unsigned int errors;		/**< Packets with an error */
+	unsigned int *sum;		/**< Checksum of each frame, or NULL */
+	unsigned int sums;
+};
+
+typedef void (*bench_path)(struct bench_sink *s, const struct bench_urb *urb);
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		perror("realloc");
+		exit(2);
+	}
+	return p;
+}
+
+static void urbs_free(struct bench_urbs *urbs)
+{
+	unsigned int i;
+
+	for (i = 0; i < urbs->count; i++) {
+		free(urbs->urb[i].buffer);
+		free(urbs->urb[i].desc);
+	}
+	free(urbs->urb);
+	memset(urbs, 0, sizeof(*urbs));
+}
+
+static struct bench_urb *urbs_add(struct bench_urbs *urbs, int packets,
+	size_t length)
+{
+	struct bench_urb *urb;
+
+	if (urbs->count == urbs->size) {
+		urbs->size = urbs->size ? urbs->size * 2 : 256;
+		urbs->urb = xrealloc(urbs->urb,
+				     urbs->size * sizeof(*urbs->urb));
+	}
+	urb = &urbs->urb[urbs->count++];
+	urb->buffer = xrealloc(NULL, length ? length : 1);
+	urb->desc = xrealloc(NULL, packets * sizeof(*urb->desc));
+	urb->packets = packets;
+	return urb;
+}
+
+static unsigned int checksum(const unsigned char *data, unsigned int len)
+{
+	unsigned int sum = 2166136261u ^ len;
+
+	while (len--)
+		sum = (sum ^ *data++) * 16777619u;
+	return sum;
+}
+
+static void bench_frame_end(struct bench_sink *s)
+{
+	if (s->used == 0)
+		return;
+
+	if (s->sum != NULL) {
+		if (s->frames == s->sums) {
+			s->sums = s->sums ? s->sums * 2 : 64;
+			s->sum = xrealloc(s->sum, s->sums * sizeof(*s->sum));
+		}
+		s->sum[s->frames] = checksum(s->mem + s->index * s->size,
+					     s->used);
+	}
+	if (s->overflow)
+		s->overflowed++;
+	s->frames++;
+	s->used = 0;
+	s->overflow = 0;
+	s->index = (s->index + 1) % BENCH_BUFFERS;
+}
+
+/**
+ * @brief Append frame data to the buffer, as __usb_sn9c20x_store() does
+ */
+static inline __attribute__((always_inline)) void bench_store(
+	struct bench_sink *s, const unsigned char *data, unsigned int len,
+	const int fixed)
+{
+	unsigned int room = s->size - s->used;
+
+	if (!fixed)
+		room -= BENCH_JPEG_HEADER_SIZE;
+
+	if (len > room) {
+		s->overflow += len - room;
+		len = room;
+		if (len == 0)
+			return;
+	}
+
+	memcpy(s->mem + s->index * s->size + s->used, data, len);
+	s->used += len;
+}
+
+/**
+ * @brief Assemble a URB a packet at a time
+ *
+ * Every packet is checked and copied on its own, as the completion
+ * handler did before sn9c20x_isoc_next().
+ */
+static inline __attribute__((always_inline)) void bench_packets(
+	struct bench_sink *s, const struct bench_urb *urb, const int fixed)
+{
+	const struct usb_iso_packet_descriptor *desc;
+	const unsigned char *data;
+	int i;
+
+	for (i = 0; i < urb->packets; i++) {
+		desc = &urb->desc[i];
+		if (desc->status != 0) {
+			s->errors++;
+			continue;
+		}
+		data = urb->buffer + desc->offset;
+		if (usb_sn9c20x_detect_frame(data, desc->actual_length) == 0) {
+			bench_frame_end(s);
+			continue;
+		}
+		bench_store(s, data, desc->actual_length, fixed);
+	}
+}
+
+/**
+ * @brief Assemble a URB a run of packets at a time
+ *
+ * As usb_sn9c20x_assemble_isoc() does.
+ */
+static inline __attribute__((always_inline)) void bench_runs(
+	struct bench_sink *s, const struct bench_urb *urb, const int fixed)
+{
+	struct sn9c20x_isoc_walk walk = {
+		.buffer = urb->buffer,
+		.desc = urb->desc,
+		.packets = urb->packets,
+	};
+	const unsigned char *chunk;
+	unsigned int len;
+
+	for (;;) {
+		switch (sn9c20x_isoc_next(&walk, &chunk, &len)) {
+		case SN9C20X_ISOC_DATA:
+			bench_store(s, chunk, len, fixed);
+			break;
+		case SN9C20X_ISOC_HEADER:
+			bench_frame_end(s);
+			break;
+		case SN9C20X_ISOC_ERROR:
+			s->errors++;
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+static void packets_raw(struct bench_sink *s, const struct bench_urb *urb)
+{
+	bench_packets(s, urb, 1);
+}
+
+static void packets_jpeg(struct bench_sink *s, const struct bench_urb *urb)
+{
+	bench_packets(s, urb, 0);
+}
+
+static void runs_raw(struct bench_sink *s, const struct bench_urb *urb)
+{
+	bench_runs(s, urb, 1);
+}
+
+static void runs_jpeg(struct bench_sink *s, const struct bench_urb *urb)
+{
+	bench_runs(s, urb, 0);
+}
+
+static void sink_reset(struct bench_sink *s)
+{
+	s->index = 0;
+	s->used = 0;
+	s->overflow = 0;
+	s->frames = 0;
+	s->overflowed = 0;
+	s->errors = 0;
+}
+
+static void replay(const struct bench_urbs *urbs, bench_path path,
+	struct bench_sink *s)
+{
+	unsigned int i;
+
+	sink_reset(s);
+	for (i = 0; i < urbs->count; i++)
+		path(s, &urbs->urb[i]);
+}
+
+/**
+ * @returns Nanoseconds per frame of a way over the given replays
+ */
+static double replay_time(const struct bench_urbs *urbs, bench_path path,
+	struct bench_sink *s, unsigned int runs)
+{
+	struct timespec start, end;
+	unsigned long long frames = 0;
+	double ns;
+	unsigned int i;
+
+	/* Warm the caches and fault the buffers in */
+	replay(urbs, path, s);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < runs; i++) {
+		replay(urbs, path, s);
+		frames += s->frames;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 +
+	     (end.tv_nsec - start.tv_nsec);
+	return frames ? ns / frames : 0;
+}
+
+/**
+ * @returns Size of the largest frame of the URBs
+ */
+static unsigned int largest_frame(const struct bench_urbs *urbs)
+{
+	const struct usb_iso_packet_descriptor *desc;
+	unsigned int len = 0, largest = 0;
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < urbs->count; i++) {
+		for (j = 0; j < urbs->urb[i].packets; j++) {
+			desc = &urbs->urb[i].desc[j];
+			if (desc->status != 0)
+				continue;
+			if (usb_sn9c20x_detect_frame(urbs->urb[i].buffer +
+					desc->offset, desc->actual_length) == 0) {
+				if (len > largest)
+					largest = len;
+				len = 0;
+				continue;
+			}
+			len += desc->actual_length;
+		}
+	}
+	return largest;
+}
+
+/**
+ * @param name Name of the stream for the messages
+ * @param urbs URBs of the stream
+ * @param size Buffer size, 0 for the largest frame
+ * @param jpeg Non-zero for JPEG frames
+ * @param runs Replays timed for each way
+ *
+ * @returns 0 if both ways gave the same frames
+ */
+static int bench(const char *name, const struct bench_urbs *urbs,
+	unsigned int size, int jpeg, unsigned int runs)
+{
+	struct bench_sink packets = { NULL }, urb = { NULL };
+	double before, after;
+	int ret = 0;
+
+	if (size == 0)
+		size = largest_frame(urbs) + (jpeg ? BENCH_JPEG_HEADER_SIZE : 0);
+	if (size <= BENCH_JPEG_HEADER_SIZE) {
+		printf("%s: no frame found\n", name);
+		return -1;
+	}
+
+	packets.size = urb.size = size;
+	packets.mem = xrealloc(NULL, (size_t)size * BENCH_BUFFERS);
+	urb.mem = xrealloc(NULL, (size_t)size * BENCH_BUFFERS);
+	packets.sum = xrealloc(NULL, sizeof(*packets.sum));
+	urb.sum = xrealloc(NULL, sizeof(*urb.sum));
+	packets.sums = urb.sums = 1;
+
+	replay(urbs, jpeg ? packets_jpeg : packets_raw, &packets);
+	replay(urbs, jpeg ? runs_jpeg : runs_raw, &urb);
+	if (packets.frames != urb.frames ||
+	    packets.overflowed != urb.overflowed ||
+	    packets.errors != urb.errors ||
+	    memcmp(packets.sum, urb.sum,
+		   packets.frames * sizeof(*packets.sum)) != 0) {
+		printf("%s: the frames differ, %u frames a packet at a time, "
+		       "%u a run at a time\n", name, packets.frames,
+		       urb.frames);
+		ret = -1;
+	}
+
+	free(packets.sum);
+	free(urb.sum);
+	packets.sum = urb.sum = NULL;
+
+	before = replay_time(urbs, jpeg ? packets_jpeg : packets_raw,
+			     &packets, runs);
+	after = replay_time(urbs, jpeg ? runs_jpeg : runs_raw, &urb, runs);
+
+	printf("%s: %s, %u URBs, %u frames (%u overflowed), %u bad packets, "
+	       "%u bytes buffers\n", name, jpeg ? "JPEG" : "raw", urbs->count,
+	       urb.frames, urb.overflowed, urb.errors, size);
+	printf("%s: per packet %.0f ns/frame, per URB %.0f ns/frame (%.2fx)\n",
+	       name, before, after, after > 0 ? before / after : 0);
+
+	free(packets.mem);
+	free(urb.mem);
+	return ret;
+}
+
+/**
+ * @brief Add a packet to the stream, in a new URB when the last is full
+ */
+static void synthetic_packet(struct bench_urbs *urbs, const unsigned char *data,
+	unsigned int len, int status)
+{
+	struct bench_urb *urb = NULL;
+	struct usb_iso_packet_descriptor *desc;
+
+	if (urbs->count != 0)
+		urb = &urbs->urb[urbs->count - 1];
+	if (urb == NULL || urb->packets == BENCH_PACKETS) {
+		urb = urbs_add(urbs, BENCH_PACKETS,
+			       BENCH_PACKETS * BENCH_PACKET_SIZE);
+		urb->packets = 0;
+	}
+
+	desc = &urb->desc[urb->packets];
+	desc->offset = urb->packets * BENCH_PACKET_SIZE;
+	desc->length = BENCH_PACKET_SIZE;
+	desc->actual_length = status ? 0 : len;
+	desc->status = status;
+	if (!status)
+		memcpy(urb->buffer + desc->offset, data, len);
+	urb->packets++;
+}
+
+/**
+ * @brief Build a stream of VGA frames
+ *
+ * Raw frames are a byte per pixel, JPEG frames 30 to 80 KB. The frame data
+ * comes in full packets but the last one, some microframes send nothing
+ * and a few packets are lost.
+ */
+static void synthetic_urbs(struct bench_urbs *urbs, int jpeg)
+{
+	unsigned char data[BENCH_PACKET_SIZE];
+	unsigned char header[SN9C20X_HEADER_SIZE];
+	unsigned int frame, len, n;
+	unsigned int packets = 0;
+	unsigned int i;
+
+	srand(1);
+	memset(header, 0, sizeof(header));
+	memcpy(header, frame_magic, sizeof(frame_magic));
+
+	for (frame = 0; frame < BENCH_FRAMES; frame++) {
+		len = jpeg ? 30000 + rand() % 50000 : 640 * 480;
+		while (len) {
+			n = min_t(unsigned int, len, BENCH_PACKET_SIZE);
+			/* Never a header magic by chance */
+			for (i = 0; i < n; i++)
+				data[i] = rand() % 0x96;
+			packets++;
+			if (packets % 50 == 0)
+				synthetic_packet(urbs, NULL, 0, 0);
+			if (packets % 997 == 0)
+				synthetic_packet(urbs, NULL, 0, -18);
+			else
+				synthetic_packet(urbs, data, n, 0);
+			len -= n;
+		}
+		header[SN9C20X_HEADER_SIZE - 1] = frame;
+		synthetic_packet(urbs, header, sizeof(header), 0);
+	}
+}
+
+static unsigned char *read_file(const char *path, size_t *len)
+{
+	unsigned char *data = NULL;
+	size_t size = 0, n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 1 << 20;
+			data = xrealloc(data, size);
+		}
+		n = fread(data + *len, 1, size - *len, f);
+		*len += n;
+	} while (n > 0);
+
+	fclose(f);
+	return data;
+}
+
+/**
+ * @param path Capture file
+ * @param urbs Isochronous IN URBs completed without error
+ * @param devnum USB device number, -1 for any
+ *
+ * @returns 0 or -1 if the capture can't be used
+ *
+ * @brief Read the URBs of a usbmon capture in the pcap format
+ */
+static int read_pcap(const char *path, struct bench_urbs *urbs, int devnum)
+{
+	const unsigned char *rec, *mon, *iso;
+	struct bench_urb *urb;
+	unsigned char *file;
+	unsigned int caplen, ndesc, data_len, end, magic;
+	size_t len, pos;
+	unsigned int i;
+
+	file = read_file(path, &len);
+	if (file == NULL)
+		return -1;
+
+	magic = len >= 24 ? get_unaligned_le32(file) : 0;
+	if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+		printf("%s: not a little endian pcap file\n", path);
+		goto fail;
+	}
+	if (get_unaligned_le32(file + 20) != PCAP_USB_MMAPPED) {
+		printf("%s: link type %u, not a usbmon capture with "
+		       "isochronous descriptors\n", path,
+		       get_unaligned_le32(file + 20));
+		goto fail;
+	}
+
+	for (pos = 24; pos + 16 <= len; pos += 16 + caplen) {
+		rec = file + pos;
+		caplen = get_unaligned_le32(rec + 8);
+		if (pos + 16 + caplen > len)
+			break;
+		mon = rec + 16;
+		if (caplen < USBMON_HEADER_SIZE)
+			continue;
+
+		/* Completions of isochronous IN URBs without error */
+		if (mon[8] != 'C' || mon[9] != 0 || !(mon[10] & 0x80))
+			continue;
+		if (devnum >= 0 && mon[11] != devnum)
+			continue;
+		if (get_unaligned_le32(mon + 28) != 0)
+			continue;
+
+		ndesc = get_unaligned_le32(mon + 60);
+		if (USBMON_HEADER_SIZE + ndesc * USBMON_ISODESC_SIZE > caplen)
+			continue;
+		iso = mon + USBMON_HEADER_SIZE;
+		data_len = caplen - USBMON_HEADER_SIZE -
+			   ndesc * USBMON_ISODESC_SIZE;
+
+		end = 0;
+		for (i = 0; i < ndesc; i++) {
+			unsigned int off = get_unaligned_le32(iso + i * 16 + 4);
+			unsigned int n = get_unaligned_le32(iso + i * 16 + 8);
+
+			if (n && off + n > end)
+				end = off + n;
+		}
+		if (end > data_len) {
+			printf("%s: truncated URB data, capture with a larger "
+			       "snapshot length\n", path);
+			goto fail;
+		}
+
+		urb = urbs_add(urbs, ndesc, end);
+		memcpy(urb->buffer, iso + ndesc * USBMON_ISODESC_SIZE, end);
+		for (i = 0; i < ndesc; i++) {
+			urb->desc[i].status = get_unaligned_le32(iso + i * 16);
+			urb->desc[i].offset =
+				get_unaligned_le32(iso + i * 16 + 4);
+			urb->desc[i].actual_length =
+				get_unaligned_le32(iso + i * 16 + 8);
+			urb->desc[i].length = urb->desc[i].actual_length;
+		}
+	}
+
+	free(file);
+	if (urbs->count == 0) {
+		printf("%s: no isochronous URB\n", path);
+		return -1;
+	}
+	return 0;
+
+fail:
+	free(file);
+	return -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] [-s size] [-D devnum] [-n runs] "
+		"[pcap...]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_urbs urbs = { NULL };
+	unsigned int size = 0, runs = 50;
+	int jpeg = 0, devnum = -1, failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "js:D:n:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jpeg = 1;
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			devnum = atoi(optarg);
+			break;
+		case 'n':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind == argc) {
+		synthetic_urbs(&urbs, 0);
+		failed += bench("synthetic", &urbs, size, 0, runs) != 0;
+		urbs_free(&urbs);
+		synthetic_urbs(&urbs, 1);
+		failed += bench("synthetic", &urbs, size, 1, runs) != 0;
+		urbs_free(&urbs);
+		return failed != 0;
+	}
+
+	for (; optind < argc; optind++) {
+		if (read_pcap(argv[optind], &urbs, devnum) < 0) {
+			urbs_free(&urbs);
+			failed++;
+			continue;
+		}
+		failed += bench(argv[optind], &urbs, size, jpeg, runs) != 0;
+		urbs_free(&urbs);
+	}
+	return failed != 0;
+}
@@ -0,0 +1,393 @@
+/**
+ * @file tools/parser-test.c
+ * @author microdia project
+ *
+ * @brief Replay test of the bulk stream parser
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * Builds sn9c20x-parser.c in user space and replays streams through it,
+ * split into transfers in every possible way around the frame headers:
+ *
+ *   parser-test              synthetic stream with header look-alikes
+ *   parser-test capture...   raw bulk captures (the transfers of the video
+ *                            endpoint written back to back)
+ *
+ * A stream parsed as a single transfer is the reference. Every split has
+ * to give the same frames, byte for byte, and the same headers. The
+ * synthetic stream is also checked against the frames it was built from.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+
+static inline unsigned int get_unaligned_le32(const void *p)
+{
+	const unsigned char *b = p;
+
+	return b[0] | b[1] << 8 | b[2] << 16 | (unsigned int)b[3] << 24;
+}
+
+static inline unsigned short get_unaligned_le16(const void *p)
+{
+	const unsigned char *b = p;
+
+	return b[0] | b[1] << 8;
+}
+
+/* Same layout as in <linux/usb.h> */
+struct usb_iso_packet_descriptor {
+	unsigned int offset;
+	unsigned int length;
+	unsigned int actual_length;
+	int status;
+};
+
+#include "../sn9c20x-parser.c"
+
+/**
+ * @brief Frames and headers found in a stream
+ */
+struct replay {
+	unsigned char *data;		/**< Frame data, frames back to back */
+	size_t len;
+	size_t *frame_end;		/**< End of each frame in data */
+	unsigned char (*header)[SN9C20X_HEADER_SIZE];
+	unsigned int frames;
+	unsigned int size;
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		perror("realloc");
+		exit(2);
+	}
+	return p;
+}
+
+static void replay_reset(struct replay *r, size_t len)
+{
+	r->data = xrealloc(r->data, len ? len : 1);
+	r->len = 0;
+	r->frames = 0;
+}
+
+static void replay_free(struct replay *r)
+{
+	free(r->data);
+	free(r->frame_end);
+	free(r->header);
+	memset(r, 0, sizeof(*r));
+}
+
+/**
+ * @brief Parse a stream split into transfers
+ *
+ * @param r Frames found, the data has room for the whole stream
+ * @param stream Stream
+ * @param len Length of the stream
+ * @param split End of each transfer but the last one, increasing
+ * @param splits Number of splits
+ */
+static void replay_parse(struct replay *r, const unsigned char *stream,
+	size_t len, const size_t *split, unsigned int splits)
+{
+	struct sn9c20x_bulk_parser parser;
+	const unsigned char *data, *end, *chunk;
+	unsigned int i, n;
+	size_t start = 0;
+
+	memset(&parser, 0, sizeof(parser));
+	replay_reset(r, len);
+
+	for (i = 0; i <= splits; i++) {
+		data = stream + start;
+		end = stream + (i < splits ? split[i] : len);
+		start = end - stream;
+
+		for (;;) {
+			int token = sn9c20x_bulk_next(&parser, &data, end,
+						      &chunk, &n);
+
+			if (token == SN9C20X_BULK_END)
+				break;
+			if (token == SN9C20X_BULK_DATA) {
+				memcpy(r->data + r->len, chunk, n);
+				r->len += n;
+				continue;
+			}
+			if (r->frames == r->size) {
+				r->size = r->size ? r->size * 2 : 16;
+				r->frame_end = xrealloc(r->frame_end,
+					r->size * sizeof(*r->frame_end));
+				r->header = xrealloc(r->header,
+					r->size * sizeof(*r->header));
+			}
+			r->frame_end[r->frames] = r->len;
+			memcpy(r->header[r->frames], parser.header,
+			       SN9C20X_HEADER_SIZE);
+			r->frames++;
+		}
+	}
+}
+
+/**
+ * @returns 0 if both replays found the same frames and headers
+ */
+static int replay_compare(const struct replay *a, const struct replay *b)
+{
+	if (a->frames != b->frames || a->len != b->len)
+		return -1;
+	if (memcmp(a->data, b->data, a->len) != 0)
+		return -1;
+	if (memcmp(a->frame_end, b->frame_end,
+		   a->frames * sizeof(*a->frame_end)) != 0)
+		return -1;
+	if (memcmp(a->header, b->header,
+		   a->frames * sizeof(*a->header)) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief Replay a stream split at every offset around its headers
+ *
+ * @param name Name of the stream for the messages
+ * @param stream Stream
+ * @param len Length of the stream
+ * @param expected Frames the stream holds, or NULL
+ *
+ * @returns Number of failed replays
+ *
+ * Every offset close to a header magic (where a boundary matters) is
+ * tried alone and together with a second split anywhere in the same
+ * header, the rest of the stream gets a split every 64 bytes. Short
+ * streams are split at every pair of offsets.
+ */
+static unsigned int replay_stream(const char *name,
+	const unsigned char *stream, size_t len, const struct replay *expected)
+{
+	struct replay ref = { NULL }, r = { NULL };
+	unsigned char *near;
+	unsigned int failed = 0, runs = 0;
+	size_t split[2], i, j;
+	int all_pairs = len <= 4096;
+
+	replay_parse(&ref, stream, len, NULL, 0);
+	if (expected != NULL && replay_compare(&ref, expected) != 0) {
+		printf("%s: single transfer doesn't give the frames "
+		       "the stream was built from\n", name);
+		failed++;
+	}
+
+	/* Mark the offsets where the split touches a header */
+	near = calloc(len + 1, 1);
+	if (near == NULL) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < ref.frames; i++) {
+		size_t h = ref.frame_end[i] + i * SN9C20X_HEADER_SIZE;
+		size_t from = h > 8 ? h - 8 : 0;
+		size_t to = h + SN9C20X_HEADER_SIZE + 8;
+
+		for (j = from; j <= to && j <= len; j++)
+			near[j] = 1;
+	}
+
+	for (i = 1; i < len; i++) {
+		if (!all_pairs && !near[i] && i % 64)
+			continue;
+
+		split[0] = i;
+		replay_parse(&r, stream, len, split, 1);
+		runs++;
+		if (replay_compare(&ref, &r) != 0) {
+			printf("%s: split at %zu differs\n", name, i);
+			failed++;
+		}
+
+		for (j = i + 1; j < len; j++) {
+			if (!all_pairs && !(near[i] && near[j] && j - i <=
+					    SN9C20X_HEADER_SIZE + 8))
+				continue;
+			split[1] = j;
+			replay_parse(&r, stream, len, split, 2);
+			runs++;
+			if (replay_compare(&ref, &r) != 0) {
+				printf("%s: splits at %zu and %zu differ\n",
+				       name, i, j);
+				failed++;
+			}
+		}
+	}
+
+	printf("%s: %zu bytes, %u frames, %u replays, %u failed\n", name,
+	       len, ref.frames, runs, failed);
+
+	free(near);
+	replay_free(&r);
+	replay_free(&ref);
+	return failed;
+}
+
+/**
+ * @brief Build a stream of frames full of header look-alikes
+ *
+ * @param expected Frames and headers of the stream
+ * @param len Length of the stream
+ *
+ * @returns The stream
+ */
+static unsigned char *synthetic_stream(struct replay *expected, size_t *len)
+{
+	static const unsigned char tricky[][8] = {
+		{ 0xff },
+		{ 0xff, 0xff },
+		{ 0xff, 0xff, 0xff, 0x00, 0xc4 },
+		{ 0xff, 0xff, 0x00, 0xc4, 0xc4 },
+		{ 0xff, 0xff, 0x00, 0xc4, 0xc4, 0x95 },
+		{ 0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xc4 },
+	};
+	static const unsigned char tricky_len[] = { 1, 2, 5, 5, 6, 7 };
+	unsigned char *stream;
+	unsigned int frame, k;
+	size_t pos = 0, size = 0;
+
+	srand(1);
+	stream = NULL;
+	expected->data = NULL;
+	replay_reset(expected, 4096);
+
+	for (frame = 0; frame < 6; frame++) {
+		size_t frame_len = 40 + rand() % 200;
+		size_t start = expected->len;
+
+		size += frame_len + 16 + SN9C20X_HEADER_SIZE;
+		stream = xrealloc(stream, size);
+		expected->data = xrealloc(expected->data, size);
+
+		while (expected->len - start < frame_len) {
+			k = rand() % 8;
+			if (k < sizeof(tricky_len)) {
+				memcpy(expected->data + expected->len,
+				       tricky[k], tricky_len[k]);
+				expected->len += tricky_len[k];
+			} else {
+				/* Never complete a magic by chance */
+				expected->data[expected->len++] =
+					rand() % 0x96;
+			}
+		}
+		/* Frames ending with a partial magic right before the
+		 * header */
+		k = frame % sizeof(tricky_len);
+		memcpy(expected->data + expected->len, tricky[k],
+		       tricky_len[k]);
+		expected->len += tricky_len[k];
+
+		memcpy(stream + pos, expected->data + start,
+		       expected->len - start);
+		pos += expected->len - start;
+
+		if (expected->frames == expected->size) {
+			expected->size = expected->size ? expected->size * 2 : 16;
+			expected->frame_end = xrealloc(expected->frame_end,
+				expected->size * sizeof(*expected->frame_end));
+			expected->header = xrealloc(expected->header,
+				expected->size * sizeof(*expected->header));
+		}
+		expected->frame_end[expected->frames] = expected->len;
+		memcpy(expected->header[expected->frames], frame_magic,
+		       sizeof(frame_magic));
+		for (k = sizeof(frame_magic); k < SN9C20X_HEADER_SIZE; k++)
+			expected->header[expected->frames][k] = frame * 16 + k;
+		memcpy(stream + pos, expected->header[expected->frames],
+		       SN9C20X_HEADER_SIZE);
+		pos += SN9C20X_HEADER_SIZE;
+		expected->frames++;
+	}
+
+	/* Data of a frame still being received, a partial magic at the
+	 * end would be held back */
+	memcpy(stream + pos, tricky[4], 6);
+	memcpy(expected->data + expected->len, tricky[4], 6);
+	pos += 6;
+	expected->len += 6;
+
+	*len = pos;
+	return stream;
+}
+
+static unsigned char *read_capture(const char *path, size_t *len)
+{
+	unsigned char *data = NULL;
+	size_t size = 0, n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 1 << 20;
+			data = xrealloc(data, size);
+		}
+		n = fread(data + *len, 1, size - *len, f);
+		*len += n;
+	} while (n > 0);
+
+	fclose(f);
+	return data;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay expected = { NULL };
+	unsigned char *stream;
+	unsigned int failed = 0;
+	size_t len;
+	int i;
+
+	if (argc < 2) {
+		stream = synthetic_stream(&expected, &len);
+		failed += replay_stream("synthetic", stream, len, &expected);
+		replay_free(&expected);
+		free(stream);
+	}
+
+	for (i = 1; i < argc; i++) {
+		stream = read_capture(argv[i], &len);
+		if (stream == NULL)
+			return 2;
+		failed += replay_stream(argv[i], stream, len, NULL);
+		free(stream);
+	}
+
+	return failed != 0;
+}
@@ -0,0 +1,1103 @@
+/**
+ * @file tools/sn9c20x-bench.c
+ * @author microdia project
+ *
+ * @brief Userspace benchmarks for the sn9c20x driver
+ *
+ * @par Licences
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * ------------------------------------------------------------------------
+ *
+ * Each test drives a camera through the V4L2 API and prints the
+ * distribution of the latencies it measured, in microseconds:
+ *
+ *   start   Cycles STREAMON/STREAMOFF. Besides the STREAMON call and the
+ *           first frame seen from userspace, the phases recorded by the
+ *           driver are read back from debugfs (videoN/start_profile)
+ *           after every start.
+ *
+ *   dqbuf   Streams and times each DQBUF of a frame already known to be
+ *           ready, the time the application is held up by the driver.
+ *           The driver histogram (videoN/dqbuf_latency) is printed too.
+ *
+ *   slice   Turns the progress updates on (-l lines, 1 by default) and
+ *           reads the progress page while streaming. Prints how long
+ *           after the start of a frame its first slice and the whole
+ *           frame became visible to the application.
+ *
+ *   shot    Streams in single-shot mode and presses the "Trigger" control
+ *           every -g ms (500 by default). Times the trigger to the DQBUF
+ *           of its frame, the driver restarts its start profile on every
+ *           trigger so the phases are shown as for start.
+ *
+ *   latest  Stalls the consumer for -p frame periods (3 by default)
+ *           before each DQBUF, once with the "Latest frame only" control
+ *           off and once with it on. Prints the age of the dequeued frame,
+ *           from its timestamp to the return of DQBUF.
+ *
+ *   open    Opens, streams and closes every device given with -d (up to
+ *           16 and more) at the same time, -n rounds. Times the open with
+ *           the buffer setup, the first frame and the close of a device
+ *           still streaming, over all the devices.
+ *
+ * Debugfs is expected under /sys/kernel/debug, the driver has to be built
+ * with CONFIG_SN9C20X_DEBUGFS for the per-phase figures.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/videodev2.h>
+
+#include "sn9c20x-api.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/**
+ * @def BENCH_BUFFERS
+ *   Number of buffers mapped for the capture
+ */
+#define BENCH_BUFFERS 4
+
+/**
+ * @def BENCH_MAX_DEVICES
+ *   Most devices the open test takes
+ */
+#define BENCH_MAX_DEVICES 64
+
+/**
+ * @def BENCH_PHASES
+ *   Number of phases in the start profile of the driver
+ */
+#define BENCH_PHASES 9
+
+static const char *phase_names[BENCH_PHASES] = {
+	"restore", "queue", "bridge", "altset", "alloc",
+	"submit", "enable", "header", "frame"
+};
+
+/**
+ * @brief A capture device with its mapped buffers
+ */
+struct bench_dev {
+	const char *path;
+	int fd;
+	int minor;
+	unsigned int count;
+	void *mem[BENCH_BUFFERS];
+	size_t length[BENCH_BUFFERS];
+};
+
+/**
+ * @brief A set of samples in microseconds
+ */
+struct bench_stats {
+	const char *name;
+	double *v;
+	unsigned int n;
+	unsigned int size;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static void stats_add(struct bench_stats *s, double v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 64;
+		s->v = realloc(s->v, s->size * sizeof(*s->v));
+		if (s->v == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void stats_header(void)
+{
+	printf("%-12s %6s %9s %9s %9s %9s %9s %9s\n", "", "count",
+	       "min", "p50", "p90", "p99", "max", "avg");
+}
+
+/**
+ * @brief Print the distribution of a set of samples
+ *
+ * @param s Samples, sorted in place
+ */
+static void stats_print(struct bench_stats *s)
+{
+	double sum = 0;
+	unsigned int i;
+
+	if (s->n == 0) {
+		printf("%-12s %6u\n", s->name, 0);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(*s->v), cmp_double);
+	for (i = 0; i < s->n; i++)
+		sum += s->v[i];
+
+	printf("%-12s %6u %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", s->name,
+	       s->n, s->v[0], s->v[s->n / 2], s->v[s->n * 9 / 10],
+	       s->v[s->n * 99 / 100], s->v[s->n - 1], sum / s->n);
+}
+
+/**
+ * @brief Open a capture device and map its buffers
+ *
+ * @param dev Device to set up, path filled in
+ *
+ * @returns 0 or -1 on error
+ */
+static int bench_open(struct bench_dev *dev)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	struct stat st;
+	unsigned int i;
+
+	dev->fd = open(dev->path, O_RDWR);
+	if (dev->fd < 0) {
+		perror(dev->path);
+		return -1;
+	}
+
+	if (fstat(dev->fd, &st) == 0)
+		dev->minor = minor(st.st_rdev);
+
+	memset(&req, 0, sizeof(req));
+	req.count = BENCH_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(dev->fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("VIDIOC_REQBUFS");
+		goto err;
+	}
+	dev->count = req.count;
+
+	for (i = 0; i < dev->count; i++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.index = i;
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(dev->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			perror("VIDIOC_QUERYBUF");
+			goto err;
+		}
+		dev->length[i] = buf.length;
+		dev->mem[i] = mmap(NULL, buf.length, PROT_READ, MAP_SHARED,
+				   dev->fd, buf.m.offset);
+		if (dev->mem[i] == MAP_FAILED) {
+			perror("mmap");
+			dev->mem[i] = NULL;
+			goto err;
+		}
+	}
+	return 0;
+
+err:
+	close(dev->fd);
+	dev->fd = -1;
+	return -1;
+}
+
+static void bench_close(struct bench_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->count; i++)
+		if (dev->mem[i] != NULL)
+			munmap(dev->mem[i], dev->length[i]);
+	dev->count = 0;
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+static int bench_qbuf(struct bench_dev *dev, unsigned int index)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.index = index;
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(dev->fd, VIDIOC_QBUF, &buf) < 0) {
+		perror("VIDIOC_QBUF");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Queue all the buffers and start the stream
+ *
+ * @returns 0 or -1 on error
+ */
+static int bench_streamon(struct bench_dev *dev)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+
+	for (i = 0; i < dev->count; i++)
+		if (bench_qbuf(dev, i) < 0)
+			return -1;
+
+	if (xioctl(dev->fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("VIDIOC_STREAMON");
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_streamoff(struct bench_dev *dev)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (xioctl(dev->fd, VIDIOC_STREAMOFF, &type) < 0) {
+		perror("VIDIOC_STREAMOFF");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Wait for a frame and dequeue it
+ *
+ * @param dev Device
+ * @param buf Dequeued buffer
+ * @param timeout Timeout in ms
+ *
+ * @returns 0 or -1 on error or timeout
+ */
+static int bench_dqbuf(struct bench_dev *dev, struct v4l2_buffer *buf,
+	int timeout)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret <= 0) {
+		fprintf(stderr, "%s: %s\n", dev->path,
+			ret == 0 ? "no frame" : strerror(errno));
+		return -1;
+	}
+
+	memset(buf, 0, sizeof(*buf));
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf->memory = V4L2_MEMORY_MMAP;
+	if (xioctl(dev->fd, VIDIOC_DQBUF, buf) < 0) {
+		perror("VIDIOC_DQBUF");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Find a control of the driver by its name
+ *
+ * @param dev Device
+ * @param name Name of the control
+ *
+ * @returns Control id or 0 if the driver has none of that name
+ */
+static __u32 bench_find_ctrl(struct bench_dev *dev, const char *name)
+{
+	struct v4l2_queryctrl qc;
+
+	memset(&qc, 0, sizeof(qc));
+	qc.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (xioctl(dev->fd, VIDIOC_QUERYCTRL, &qc) == 0) {
+		if (strcmp((char *)qc.name, name) == 0)
+			return qc.id;
+		qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	fprintf(stderr, "%s: no control \"%s\"\n", dev->path, name);
+	return 0;
+}
+
+/**
+ * @brief Set a control of the driver by its name
+ *
+ * @returns 0 or -1 on error
+ */
+static int bench_set_ctrl(struct bench_dev *dev, const char *name,
+	int value)
+{
+	struct v4l2_control ctrl;
+
+	ctrl.id = bench_find_ctrl(dev, name);
+	ctrl.value = value;
+	if (ctrl.id == 0)
+		return -1;
+	if (xioctl(dev->fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Open a file of the device in debugfs
+ *
+ * @param dev Device
+ * @param name Name of the file in the directory of the device
+ *
+ * @returns Open file or NULL
+ */
+static FILE *bench_debugfs(struct bench_dev *dev, const char *name)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), "/sys/kernel/debug/sn9c20x/video%d/%s",
+		 dev->minor, name);
+	return fopen(path, "r");
+}
+
+/**
+ * @brief Read the phases of the last stream start from debugfs
+ *
+ * @param dev Device
+ * @param phase Time spent in each phase in microseconds
+ *
+ * @returns 0 or -1 if the profile can't be read
+ */
+static int bench_last_profile(struct bench_dev *dev, double *phase)
+{
+	char line[256];
+	int found = -1;
+	FILE *f;
+
+	f = bench_debugfs(dev, "start_profile");
+	if (f == NULL)
+		return -1;
+
+	/* Rows start with the index of the start, the summary doesn't */
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned int start;
+		int warm, used, i;
+		char *p = line;
+		long long v;
+
+		if (sscanf(p, "%u %d%n", &start, &warm, &used) != 2)
+			continue;
+		p += used;
+		for (i = 0; i < BENCH_PHASES; i++) {
+			if (sscanf(p, "%lld%n", &v, &used) != 1)
+				break;
+			phase[i] = v;
+			p += used;
+		}
+		if (i == BENCH_PHASES)
+			found = 0;
+	}
+
+	fclose(f);
+	return found;
+}
+
+/**
+ * @brief Samples of the phases of the start profile
+ */
+struct bench_phases {
+	struct bench_stats phase[BENCH_PHASES];
+	int profiled;
+};
+
+static void phases_init(struct bench_phases *p)
+{
+	unsigned int j;
+
+	memset(p, 0, sizeof(*p));
+	for (j = 0; j < BENCH_PHASES; j++)
+		p->phase[j].name = phase_names[j];
+}
+
+/**
+ * @brief Add the phases of the last start of the driver
+ */
+static void phases_add(struct bench_phases *p, struct bench_dev *dev)
+{
+	double phase[BENCH_PHASES];
+	unsigned int j;
+
+	if (bench_last_profile(dev, phase) < 0)
+		return;
+	for (j = 0; j < BENCH_PHASES; j++)
+		stats_add(&p->phase[j], phase[j]);
+	p->profiled = 1;
+}
+
+static void phases_print(struct bench_phases *p)
+{
+	unsigned int j;
+
+	if (!p->profiled) {
+		printf("no start_profile in debugfs, phases not shown\n");
+		return;
+	}
+	for (j = 0; j < BENCH_PHASES; j++)
+		stats_print(&p->phase[j]);
+}
+
+/**
+ * @brief Cycle STREAMON/STREAMOFF and print the start latencies
+ *
+ * @param dev Device
+ * @param count Number of starts
+ *
+ * @returns 0 or -1 on error
+ */
+static int bench_start(struct bench_dev *dev, unsigned int count)
+{
+	struct bench_stats streamon = { .name = "streamon" };
+	struct bench_stats first = { .name = "first frame" };
+	struct bench_phases phases;
+	struct v4l2_buffer buf;
+	double t0, t1, t2;
+	unsigned int i;
+
+	phases_init(&phases);
+
+	for (i = 0; i < count; i++) {
+		t0 = now_us();
+		if (bench_streamon(dev) < 0)
+			return -1;
+		t1 = now_us();
+		if (bench_dqbuf(dev, &buf, 5000) < 0)
+			return -1;
+		t2 = now_us();
+		if (bench_streamoff(dev) < 0)
+			return -1;
+
+		stats_add(&streamon, t1 - t0);
+		stats_add(&first, t2 - t0);
+		phases_add(&phases, dev);
+	}
+
+	stats_header();
+	stats_print(&streamon);
+	stats_print(&first);
+	phases_print(&phases);
+
+	return 0;
+}
+
+/**
+ * @brief Time the DQBUF of ready frames
+ *
+ * @param dev Device
+ * @param count Number of frames
+ *
+ * @returns 0 or -1 on error
+ */
+static int bench_dq(struct bench_dev *dev, unsigned int count)
+{
+	struct bench_stats dqbuf = { .name = "dqbuf" };
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	struct v4l2_buffer buf;
+	char line[128];
+	unsigned int i;
+	double t0;
+	FILE *f;
+	int ret = -1;
+
+	if (bench_streamon(dev) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (poll(&pfd, 1, 5000) != 1) {
+			fprintf(stderr, "%s: no frame\n", dev->path);
+			goto stop;
+		}
+
+		t0 = now_us();
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(dev->fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("VIDIOC_DQBUF");
+			goto stop;
+		}
+		stats_add(&dqbuf, now_us() - t0);
+
+		if (bench_qbuf(dev, buf.index) < 0)
+			goto stop;
+	}
+	ret = 0;
+
+	stats_header();
+	stats_print(&dqbuf);
+
+	f = bench_debugfs(dev, "dqbuf_latency");
+	if (f != NULL) {
+		printf("\ndriver histogram:\n");
+		while (fgets(line, sizeof(line), f) != NULL)
+			fputs(line, stdout);
+		fclose(f);
+	}
+
+stop:
+	bench_streamoff(dev);
+	return ret;
+}
+
+/**
+ * @brief Read the progress page
+ *
+ * @param page Mapped progress page
+ * @param p Consistent copy of the page
+ */
+static void bench_read_progress(volatile struct sn9c20x_progress *page,
+	struct sn9c20x_progress *p)
+{
+	__u32 count;
+
+	do {
+		count = page->count;
+		__sync_synchronize();
+		p->index = page->index;
+		p->sequence = page->sequence;
+		p->lines = page->lines;
+		p->bytesused = page->bytesused;
+		p->timestamp = page->timestamp;
+		__sync_synchronize();
+	} while ((count & 1) || count != page->count);
+	p->count = count;
+}
+
+/**
+ * @brief Measure how soon the top of a frame is visible
+ *
+ * @param dev Device
+ * @param count Number of frames
+ * @param lines Lines between progress updates
+ *
+ * @returns 0 or -1 on error
+ *
+ * The progress page is polled every 50 us. Both latencies are counted
+ * from the timestamp of the frame, the arrival of its first line.
+ */
+static int bench_slice(struct bench_dev *dev, unsigned int count,
+	unsigned int lines)
+{
+	struct bench_stats first = { .name = "first slice" };
+	struct bench_stats frame = { .name = "frame" };
+	volatile struct sn9c20x_progress *page;
+	struct sn9c20x_progress p;
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	struct v4l2_buffer buf;
+	__u32 seen = ~0U;
+	unsigned int frames = 0;
+	double t, deadline;
+	int ret = -1;
+
+	if (bench_set_ctrl(dev, "Progress update lines", lines) < 0)
+		return -1;
+
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+		    dev->fd, SN9C20X_PROGRESS_OFFSET);
+	if (page == MAP_FAILED) {
+		perror("mmap progress");
+		return -1;
+	}
+
+	if (bench_streamon(dev) < 0)
+		goto unmap;
+
+	deadline = now_us() + 5e6;
+	while (frames < count) {
+		t = now_us();
+		if (t > deadline) {
+			fprintf(stderr, "%s: no frame\n", dev->path);
+			goto stop;
+		}
+
+		bench_read_progress(page, &p);
+		if (p.count != 0 && p.sequence != seen && p.lines != 0) {
+			seen = p.sequence;
+			stats_add(&first, t - p.timestamp / 1e3);
+		}
+
+		if (poll(&pfd, 1, 0) == 1) {
+			if (bench_dqbuf(dev, &buf, 0) < 0)
+				goto stop;
+			t = now_us();
+			if (buf.sequence == seen)
+				stats_add(&frame, t - (buf.timestamp.tv_sec *
+						       1e6 +
+						       buf.timestamp.tv_usec));
+			if (bench_qbuf(dev, buf.index) < 0)
+				goto stop;
+			frames++;
+			deadline = t + 5e6;
+		}
+		usleep(50);
+	}
+	ret = 0;
+
+	printf("%u lines per update\n", lines);
+	stats_header();
+	stats_print(&first);
+	stats_print(&frame);
+
+stop:
+	bench_streamoff(dev);
+	bench_set_ctrl(dev, "Progress update lines", 0);
+unmap:
+	munmap((void *)page, sysconf(_SC_PAGESIZE));
+	return ret;
+}
+
+/**
+ * @brief Time single shots from the trigger to their frame
+ *
+ * @param dev Device
+ * @param count Number of shots
+ * @param gap Time between the shots in ms
+ *
+ * @returns 0 or -1 on error
+ *
+ * The driver refuses a trigger with -EBUSY until the previous shot has
+ * idled the stream, the trigger is retried then.
+ */
+static int bench_shot(struct bench_dev *dev, unsigned int count,
+	unsigned int gap)
+{
+	struct bench_stats trigger = { .name = "trigger" };
+	struct bench_stats frame = { .name = "frame" };
+	struct bench_phases phases;
+	struct v4l2_control ctrl;
+	struct v4l2_buffer buf;
+	unsigned int i;
+	double t0, t1;
+	int ret = -1;
+
+	phases_init(&phases);
+
+	ctrl.id = bench_find_ctrl(dev, "Trigger");
+	ctrl.value = 1;
+	if (ctrl.id == 0)
+		return -1;
+	if (bench_set_ctrl(dev, "Single shot", 1) < 0)
+		return -1;
+	if (bench_streamon(dev) < 0)
+		goto off;
+
+	for (i = 0; i < count; i++) {
+		usleep(gap * 1000);
+
+		for (;;) {
+			t0 = now_us();
+			if (xioctl(dev->fd, VIDIOC_S_CTRL, &ctrl) == 0)
+				break;
+			if (errno != EBUSY) {
+				perror("Trigger");
+				goto stop;
+			}
+			usleep(1000);
+		}
+		t1 = now_us();
+
+		if (bench_dqbuf(dev, &buf, 5000) < 0)
+			goto stop;
+		stats_add(&trigger, t1 - t0);
+		stats_add(&frame, now_us() - t0);
+		phases_add(&phases, dev);
+
+		if (bench_qbuf(dev, buf.index) < 0)
+			goto stop;
+	}
+	ret = 0;
+
+	printf("%u ms between shots\n", gap);
+	stats_header();
+	stats_print(&trigger);
+	stats_print(&frame);
+	phases_print(&phases);
+
+stop:
+	bench_streamoff(dev);
+off:
+	bench_set_ctrl(dev, "Single shot", 0);
+	return ret;
+}
+
+/**
+ * @brief Measure the frame period from the timestamps of a few frames
+ *
+ * @param dev Streaming device
+ * @param period Frame period in us
+ *
+ * @returns 0 or -1 on error
+ *
+ * G_PARM doesn't follow the frame rate of the sensor, the frames tell.
+ */
+static int bench_period(struct bench_dev *dev, double *period)
+{
+	struct v4l2_buffer buf;
+	double first = 0, t = 0;
+	unsigned int i;
+
+	for (i = 0; i < 6; i++) {
+		if (bench_dqbuf(dev, &buf, 5000) < 0)
+			return -1;
+		t = buf.timestamp.tv_sec * 1e6 + buf.timestamp.tv_usec;
+		if (i == 1)
+			first = t;
+		if (bench_qbuf(dev, buf.index) < 0)
+			return -1;
+	}
+	*period = (t - first) / 4;
+	return 0;
+}
+
+/**
+ * @brief Age of the frames of a consumer stalled before each DQBUF
+ *
+ * @param dev Device
+ * @param s Samples, age of each dequeued frame
+ * @param count Number of frames
+ * @param periods Frame periods of each stall
+ * @param latest Value of the latest frame control
+ * @param period Measured frame period in us
+ *
+ * @returns 0 or -1 on error
+ */
+static int bench_latest_run(struct bench_dev *dev, struct bench_stats *s,
+	unsigned int count, unsigned int periods, int latest, double *period)
+{
+	struct v4l2_buffer buf;
+	unsigned int i;
+	int ret = -1;
+
+	if (bench_set_ctrl(dev, "Latest frame only", latest) < 0)
+		return -1;
+	if (bench_streamon(dev) < 0)
+		goto off;
+	if (bench_period(dev, period) < 0)
+		goto stop;
+
+	for (i = 0; i < count; i++) {
+		usleep(periods * *period);
+		if (bench_dqbuf(dev, &buf, 5000) < 0)
+			goto stop;
+		stats_add(s, now_us() - (buf.timestamp.tv_sec * 1e6 +
+					 buf.timestamp.tv_usec));
+		if (bench_qbuf(dev, buf.index) < 0)
+			goto stop;
+	}
+	ret = 0;
+
+stop:
+	bench_streamoff(dev);
+off:
+	bench_set_ctrl(dev, "Latest frame only", 0);
+	return ret;
+}
+
+/**
+ * @brief Compare the age of the frames of a slow consumer with the latest
+ *	frame mode off and on
+ *
+ * @param dev Device
+ * @param count Number of frames of each mode
+ * @param periods Frame periods of each stall
+ *
+ * @returns 0 or -1 on error
+ *
+ * Without the latest frame mode the stalled consumer gets the oldest frame
+ * of its backlog, with it the most recent one.
+ */
+static int bench_latest(struct bench_dev *dev, unsigned int count,
+	unsigned int periods)
+{
+	struct bench_stats off = { .name = "off" };
+	struct bench_stats on = { .name = "latest" };
+	double period;
+
+	if (bench_latest_run(dev, &off, count, periods, 0, &period) < 0 ||
+	    bench_latest_run(dev, &on, count, periods, 1, &period) < 0)
+		return -1;
+
+	printf("%.0f us frame period, %u periods per stall\n", period,
+	       periods);
+	stats_header();
+	stats_print(&off);
+	stats_print(&on);
+	return 0;
+}
+
+/**
+ * @brief A device of the open test and its samples
+ */
+struct bench_worker {
+	struct bench_dev dev;
+	unsigned int count;
+	pthread_barrier_t *barrier;
+	struct bench_stats open;
+	struct bench_stats first;
+	struct bench_stats close;
+	int ret;
+};
+
+/**
+ * @brief Open, stream and close a device in step with the others
+ *
+ * Every round meets the other devices at the barrier twice, before the
+ * opens and before the closes, also once the device has failed.
+ */
+static void *bench_open_worker(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct v4l2_buffer buf;
+	unsigned int i;
+	double t0;
+
+	for (i = 0; i < w->count; i++) {
+		pthread_barrier_wait(w->barrier);
+		if (w->ret == 0) {
+			t0 = now_us();
+			if (bench_open(&w->dev) < 0) {
+				w->ret = -1;
+			} else {
+				stats_add(&w->open, now_us() - t0);
+				if (bench_streamon(&w->dev) < 0 ||
+				    bench_dqbuf(&w->dev, &buf, 5000) < 0) {
+					bench_close(&w->dev);
+					w->ret = -1;
+				} else {
+					stats_add(&w->first, now_us() - t0);
+				}
+			}
+		}
+
+		/* Close once all the devices stream */
+		pthread_barrier_wait(w->barrier);
+		if (w->ret == 0) {
+			t0 = now_us();
+			bench_close(&w->dev);
+			stats_add(&w->close, now_us() - t0);
+		}
+	}
+	return NULL;
+}
+
+static void stats_merge(struct bench_stats *to, struct bench_stats *from)
+{
+	unsigned int i;
+
+	for (i = 0; i < from->n; i++)
+		stats_add(to, from->v[i]);
+	free(from->v);
+}
+
+/**
+ * @brief Open, stream and close several devices at the same time
+ *
+ * @param paths Device nodes
+ * @param n Number of devices
+ * @param count Number of rounds
+ *
+ * @returns 0 or -1 if a device failed
+ */
+static int bench_open_close(const char **paths, unsigned int n,
+	unsigned int count)
+{
+	struct bench_stats open = { .name = "open" };
+	struct bench_stats first = { .name = "first frame" };
+	struct bench_stats close = { .name = "close" };
+	struct bench_worker *w;
+	pthread_barrier_t barrier;
+	pthread_t *threads;
+	unsigned int i;
+	int ret = 0;
+
+	w = calloc(n, sizeof(*w));
+	threads = calloc(n, sizeof(*threads));
+	if (w == NULL || threads == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	pthread_barrier_init(&barrier, NULL, n);
+
+	for (i = 0; i < n; i++) {
+		w[i].dev.path = paths[i];
+		w[i].dev.fd = -1;
+		w[i].count = count;
+		w[i].barrier = &barrier;
+		if (pthread_create(&threads[i], NULL, bench_open_worker,
+				   &w[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		if (w[i].ret < 0) {
+			fprintf(stderr, "%s: failed after %u rounds\n",
+				paths[i], w[i].close.n);
+			ret = -1;
+		}
+		stats_merge(&open, &w[i].open);
+		stats_merge(&first, &w[i].first);
+		stats_merge(&close, &w[i].close);
+	}
+
+	printf("%u devices\n", n);
+	stats_header();
+	stats_print(&open);
+	stats_print(&first);
+	stats_print(&close);
+
+	pthread_barrier_destroy(&barrier);
+	free(threads);
+	free(w);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s <test> [-d device] [-n count] [-l lines] "
+		"[-g gap] [-p periods]\n"
+		"\n"
+		"tests:\n"
+		"  start   STREAMON/STREAMOFF cycles, per phase start latency\n"
+		"  dqbuf   time spent in DQBUF for ready frames\n"
+		"  slice   latency of the first slice and of the whole frame\n"
+		"  shot    single-shot trigger to frame latency\n"
+		"  latest  frame age at DQBUF of a stalled consumer\n"
+		"  open    concurrent open/stream/close of every -d device\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_dev dev;
+	const char *paths[BENCH_MAX_DEVICES];
+	unsigned int devices = 0;
+	const char *test;
+	unsigned int count = 100;
+	unsigned int lines = 1;
+	unsigned int gap = 500;
+	unsigned int periods = 3;
+	int ret, opt;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	test = argv[1];
+
+	memset(&dev, 0, sizeof(dev));
+	dev.path = "/dev/video0";
+	dev.fd = -1;
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "d:n:l:g:p:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (devices == BENCH_MAX_DEVICES) {
+				fprintf(stderr, "at most %d devices\n",
+					BENCH_MAX_DEVICES);
+				return 1;
+			}
+			paths[devices++] = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lines = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gap = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			periods = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (devices == 0)
+		paths[devices++] = dev.path;
+	dev.path = paths[0];
+
+	if (strcmp(test, "open") == 0)
+		return bench_open_close(paths, devices, count) < 0;
+
+	if (bench_open(&dev) < 0)
+		return 1;
+
+	if (strcmp(test, "start") == 0) {
+		ret = bench_start(&dev, count);
+	} else if (strcmp(test, "dqbuf") == 0) {
+		ret = bench_dq(&dev, count);
+	} else if (strcmp(test, "slice") == 0) {
+		ret = bench_slice(&dev, count, lines);
+	} else if (strcmp(test, "shot") == 0) {
+		ret = bench_shot(&dev, count, gap);
+	} else if (strcmp(test, "latest") == 0) {
+		ret = bench_latest(&dev, count, periods);
+	} else {
+		usage(argv[0]);
+		ret = -1;
+	}
+
+	bench_close(&dev);
+	return ret < 0;
+}